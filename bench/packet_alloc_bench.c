@@ -0,0 +1,204 @@
+/*
+ *  Copyright (C) 2016 CZ.NIC, z.s.p.o.
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/**
+ * \file packet_alloc_bench.c
+ * Benchmark of the packet allocation (`dns_packet_create()`) against the three block layout it replaced.
+ *
+ * Replays the packet lifetime of the collector: a producer thread (the input) allocates
+ * the packets into frames of `frame_packets` and hands them over through a frame queue
+ * to a consumer thread (the output), which frees every frame once `window` newer packets
+ * arrived (the matching window). So the packets are freed by another thread than the
+ * one allocating them, as in the collector. The DNS data sizes are random, 30 to 512 bytes.
+ *
+ * The allocation variants:
+ * - three blocks: the packet struct, the DNS data copy and the libknot packet
+ *   (modelled by an allocation of `sizeof(knot_pkt_t)`, the parsed RR arrays are not modelled),
+ * - single block: `dns_packet_create()`, the struct and the DNS data in one block,
+ * - arenas: `dns_packet_create()` from a frame arena (`input_packet_arenas`).
+ *
+ * Build with `USE_TCMALLOC=1 make bench` to measure with tcmalloc instead of the libc allocator.
+ *
+ * Usage: packet_alloc_bench [packets [window [frame_packets [repeats]]]]
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "../src/common.h"
+#include "../src/packet.h"
+#include "../src/packet_arena.h"
+#include "../src/packet_frame.h"
+#include "../src/frame_queue.h"
+
+enum dns_bench_variant {
+    DNS_BENCH_THREE_BLOCKS,
+    DNS_BENCH_SINGLE_BLOCK,
+    DNS_BENCH_ARENAS,
+};
+
+static const char *dns_bench_variant_names[] = { "three blocks", "single block", "arenas" };
+
+/** Size of the largest DNS data */
+#define DNS_BENCH_MAX_DATA 512
+
+struct dns_bench {
+    enum dns_bench_variant variant;
+    size_t count, window, frame_packets;
+    struct dns_frame_queue *queue;
+    uint16_t *sizes;
+};
+
+/**
+ * Create a packet with `size` bytes of DNS data, as laid out by the given variant.
+ * The three block packet points `edns_data` to its modelled libknot packet.
+ */
+static struct dns_packet *
+dns_bench_packet_create(enum dns_bench_variant variant, struct dns_packet_arena *arena,
+                        const uint8_t *data, size_t size)
+{
+    if (variant != DNS_BENCH_THREE_BLOCKS)
+        return dns_packet_create(arena, data, size, 0);
+    struct dns_packet *pkt = xmalloc_zero(sizeof(struct dns_packet));
+    pkt->dns_data = xmalloc(size);
+    memcpy(pkt->dns_data, data, size);
+    pkt->dns_data_size = size;
+    pkt->edns_data = xmalloc_zero(sizeof(knot_pkt_t));
+    pkt->memory_size = sizeof(struct dns_packet) + size + sizeof(knot_pkt_t);
+    return pkt;
+}
+
+/**
+ * Free a frame with its packets, as laid out by the given variant.
+ */
+static void
+dns_bench_frame_destroy(enum dns_bench_variant variant, struct dns_packet_frame *frame)
+{
+    if (variant == DNS_BENCH_THREE_BLOCKS) {
+        struct dns_packet *pkt;
+        while ((pkt = clist_remove_head(&frame->packets))) {
+            free(pkt->edns_data);
+            free(pkt->dns_data);
+            free(pkt);
+        }
+    }
+    dns_packet_frame_destroy(frame);
+}
+
+static void *
+dns_bench_producer(void *data)
+{
+    struct dns_bench *b = data;
+    uint8_t dns_data[DNS_BENCH_MAX_DATA] = {0};
+    for (size_t i = 0; i < b->count; i += b->frame_packets) {
+        struct dns_packet_frame *frame = dns_packet_frame_create(i, i);
+        if (b->variant == DNS_BENCH_ARENAS)
+            frame->arena = dns_packet_arena_create();
+        for (size_t j = i; j < i + b->frame_packets && j < b->count; j++) {
+            struct dns_packet *pkt = dns_bench_packet_create(b->variant, frame->arena, dns_data, b->sizes[j]);
+            pkt->ts = j;
+            dns_packet_frame_append_packet(frame, pkt);
+        }
+        dns_frame_queue_enqueue(b->queue, frame);
+    }
+    dns_frame_queue_enqueue(b->queue, dns_packet_frame_create_final(b->count));
+    return NULL;
+}
+
+static double
+dns_bench_now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+/**
+ * Run the producer and free the frames in this thread, returning the elapsed time.
+ */
+static double
+dns_bench_run(struct dns_bench *b)
+{
+    // The frames in the window, in order
+    size_t frames = (b->count + b->frame_packets - 1) / b->frame_packets;
+    struct dns_packet_frame **held = xmalloc(frames * sizeof(struct dns_packet_frame *));
+    size_t first = 0, last = 0, held_packets = 0;
+    pthread_t producer;
+
+    double start = dns_bench_now();
+    if (pthread_create(&producer, NULL, dns_bench_producer, b) != 0)
+        die("Can not create the producer thread");
+    while (1) {
+        struct dns_packet_frame *frame = dns_frame_queue_dequeue(b->queue);
+        if (frame->type == 1) {
+            dns_packet_frame_destroy(frame);
+            break;
+        }
+        held[last++] = frame;
+        held_packets += frame->count;
+        // Free the frames that left the window
+        while (first < last && held_packets - held[first]->count >= b->window) {
+            held_packets -= held[first]->count;
+            dns_bench_frame_destroy(b->variant, held[first++]);
+        }
+    }
+    while (first < last)
+        dns_bench_frame_destroy(b->variant, held[first++]);
+    pthread_join(producer, NULL);
+    double elapsed = dns_bench_now() - start;
+    free(held);
+    return elapsed;
+}
+
+int
+main(int argc, char **argv)
+{
+    size_t count = argc > 1 ? strtoul(argv[1], NULL, 10) : 4000000;
+    size_t window = argc > 2 ? strtoul(argv[2], NULL, 10) : 500000;
+    size_t frame_packets = argc > 3 ? strtoul(argv[3], NULL, 10) : 1000;
+    int repeats = argc > 4 ? atoi(argv[4]) : 3;
+    if (count < 1 || window < 1 || frame_packets < 1 || repeats < 1)
+        die("The packets, the window, the frame packets and the repeats must be positive");
+
+    struct dns_bench b = { .count = count, .window = window, .frame_packets = frame_packets };
+    srandom(42);
+    b.sizes = xmalloc(count * sizeof(uint16_t));
+    for (size_t i = 0; i < count; i++)
+        b.sizes[i] = 30 + random() % (DNS_BENCH_MAX_DATA - 30 + 1);
+
+    // The variants run alternately, the best time of each is reported
+    double best[3] = {0.0, 0.0, 0.0};
+    for (int run = 0; run < repeats; run++) {
+        for (int v = DNS_BENCH_THREE_BLOCKS; v <= DNS_BENCH_ARENAS; v++) {
+            b.variant = v;
+            b.queue = dns_frame_queue_create(64, 0, DNS_QUEUE_BLOCK);
+            double elapsed = dns_bench_run(&b);
+            dns_frame_queue_destroy(b.queue);
+            if (run == 0 || elapsed < best[v])
+                best[v] = elapsed;
+        }
+    }
+    for (int v = DNS_BENCH_THREE_BLOCKS; v <= DNS_BENCH_ARENAS; v++)
+        printf("%-12s: %zu packets, window %zu, %zu per frame: %.1f ns per packet (best of %d)\n",
+               dns_bench_variant_names[v], count, window, frame_packets, best[v] * 1e9 / count, repeats);
+
+    free(b.sizes);
+    return 0;
+}
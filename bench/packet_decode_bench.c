@@ -0,0 +1,505 @@
+/* 
+ *  Copyright (C) 2016 CZ.NIC, z.s.p.o.
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/**
+ * \file packet_decode_bench.c
+ * Benchmark of the single pass decoders (`packet_decode.h`) against the libtrace accessor path they replaced.
+ *
+ * The accessor path is modelled without libtrace, so the benchmark needs no capture files:
+ * `dns_old_decode()` calls the accessors in the order of `dns_packet_net_from_libtrace_layers()`,
+ * and every accessor locates its header from the start of the frame, as libtrace does for
+ * the headers it has not cached. The libtrace call and caching overhead is not included,
+ * so the "before" numbers are a lower bound of the real libtrace path.
+ *
+ * Both decoders are fed fixed DNS query frames (Ethernet, 802.1Q/QinQ VLAN, Linux SLL,
+ * IPv6 with extension headers) and their results are checked to be the same before timing.
+ * Reports CPU cycles per packet on x86 (TSC), nanoseconds elsewhere.
+ *
+ * Usage: packet_decode_bench [iterations]
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+#include "../src/common.h"
+#include "../src/packet.h"
+#include "../src/packet_decode.h"
+
+/** Pcap link types of the frames */
+#define DNS_BENCH_DLT_EN10MB 1
+#define DNS_BENCH_DLT_LINUX_SLL 113
+
+/** @name The libtrace accessor path, one header walk per accessor */
+/** @{ */
+
+/**
+ * Locate the network layer header of the frame, as `trace_get_layer3()`.
+ */
+static const uint8_t *
+dns_old_get_layer3(int dlt, const uint8_t *data, size_t caplen, uint16_t *ethertype, size_t *remaining)
+{
+    size_t offset;
+    if (dlt == DNS_BENCH_DLT_LINUX_SLL) {
+        if (caplen < 16)
+            return NULL;
+        *ethertype = knot_wire_read_u16(data + 14);
+        offset = 16;
+    } else {
+        if (caplen < 14)
+            return NULL;
+        *ethertype = knot_wire_read_u16(data + 12);
+        offset = 14;
+        while (*ethertype == 0x8100 || *ethertype == 0x88A8 || *ethertype == 0x9100) {
+            if (caplen < offset + 4)
+                return NULL;
+            *ethertype = knot_wire_read_u16(data + offset + 2);
+            offset += 4;
+        }
+    }
+    *remaining = caplen - offset;
+    return data + offset;
+}
+
+/**
+ * The IPv4 header, as `trace_get_ip()`.
+ */
+static const uint8_t *
+dns_old_get_ip(int dlt, const uint8_t *data, size_t caplen)
+{
+    uint16_t ethertype;
+    size_t remaining;
+    const uint8_t *l3 = dns_old_get_layer3(dlt, data, caplen, &ethertype, &remaining);
+    return (l3 && ethertype == 0x0800 && remaining >= 20) ? l3 : NULL;
+}
+
+/**
+ * The IPv6 header, as `trace_get_ip6()`.
+ */
+static const uint8_t *
+dns_old_get_ip6(int dlt, const uint8_t *data, size_t caplen)
+{
+    uint16_t ethertype;
+    size_t remaining;
+    const uint8_t *l3 = dns_old_get_layer3(dlt, data, caplen, &ethertype, &remaining);
+    return (l3 && ethertype == 0x86DD && remaining >= 40) ? l3 : NULL;
+}
+
+/**
+ * Walk the IPv6 extension headers from `*next` at `offset`, stopping at the transport
+ * header or, when `frag` is set, at the fragment header. Returns the header offset.
+ */
+static size_t
+dns_old_skip_ipv6_ext(const uint8_t *ip6, size_t remaining, uint8_t *next, int frag)
+{
+    size_t offset = 40;
+    while ((*next == IPPROTO_HOPOPTS || *next == IPPROTO_ROUTING || *next == IPPROTO_DSTOPTS ||
+            *next == IPPROTO_FRAGMENT) && remaining >= offset + 8) {
+        if (frag && *next == IPPROTO_FRAGMENT)
+            break;
+        size_t ext_size = (*next == IPPROTO_FRAGMENT) ? 8 : (ip6[offset + 1] + 1) * 8;
+        *next = ip6[offset];
+        offset += ext_size;
+    }
+    return offset;
+}
+
+/**
+ * The transport header, its protocol and the captured bytes from it, as `trace_get_transport()`.
+ */
+static const uint8_t *
+dns_old_get_transport(int dlt, const uint8_t *data, size_t caplen, uint8_t *proto, size_t *remaining)
+{
+    uint16_t ethertype;
+    const uint8_t *l3 = dns_old_get_layer3(dlt, data, caplen, &ethertype, remaining);
+    if (!l3)
+        return NULL;
+    size_t offset;
+    if (ethertype == 0x0800 && *remaining >= 20) {
+        offset = (l3[0] & 0x0f) * 4;
+        *proto = l3[9];
+        *remaining = MIN(*remaining, knot_wire_read_u16(l3 + 2));
+    } else if (ethertype == 0x86DD && *remaining >= 40) {
+        *proto = l3[6];
+        offset = dns_old_skip_ipv6_ext(l3, *remaining, proto, 0);
+    } else {
+        return NULL;
+    }
+    if (offset > *remaining)
+        return NULL;
+    *remaining -= offset;
+    return l3 + offset;
+}
+
+/**
+ * The UDP header, as `trace_get_udp()`.
+ */
+static const uint8_t *
+dns_old_get_udp(int dlt, const uint8_t *data, size_t caplen)
+{
+    uint8_t proto;
+    size_t remaining;
+    const uint8_t *l4 = dns_old_get_transport(dlt, data, caplen, &proto, &remaining);
+    return (l4 && proto == IPPROTO_UDP && remaining >= 8) ? l4 : NULL;
+}
+
+/**
+ * The TCP header, as `trace_get_tcp()`.
+ */
+static const uint8_t *
+dns_old_get_tcp(int dlt, const uint8_t *data, size_t caplen)
+{
+    uint8_t proto;
+    size_t remaining;
+    const uint8_t *l4 = dns_old_get_transport(dlt, data, caplen, &proto, &remaining);
+    return (l4 && proto == IPPROTO_TCP && remaining >= 20) ? l4 : NULL;
+}
+
+/**
+ * The fragment offset and the more fragments flag, as `trace_get_fragment_offset()`.
+ */
+static uint16_t
+dns_old_get_fragment_offset(int dlt, const uint8_t *data, size_t caplen, uint8_t *more)
+{
+    *more = 0;
+    const uint8_t *ip = dns_old_get_ip(dlt, data, caplen);
+    if (ip) {
+        uint16_t frag = knot_wire_read_u16(ip + 6);
+        *more = !! (frag & 0x2000);
+        return (frag & 0x1fff) * 8;
+    }
+    const uint8_t *ip6 = dns_old_get_ip6(dlt, data, caplen);
+    if (ip6) {
+        uint8_t next = ip6[6];
+        size_t offset = dns_old_skip_ipv6_ext(ip6, caplen, &next, 1);
+        if (next == IPPROTO_FRAGMENT && caplen >= offset + 8) {
+            uint16_t frag = knot_wire_read_u16(ip6 + offset + 2);
+            *more = frag & 0x0001;
+            return frag & 0xfff8;
+        }
+    }
+    return 0;
+}
+
+/**
+ * The source or destination address and port, as `trace_get_source_address()`
+ * and `trace_get_destination_address()`.
+ */
+static int
+dns_old_get_address(int dlt, const uint8_t *data, size_t caplen, int source, struct sockaddr_in6 *addr)
+{
+    uint16_t ethertype;
+    size_t remaining;
+    const uint8_t *l3 = dns_old_get_layer3(dlt, data, caplen, &ethertype, &remaining);
+    if (!l3)
+        return 0;
+    uint8_t proto;
+    const uint8_t *l4 = dns_old_get_transport(dlt, data, caplen, &proto, &remaining);
+    uint16_t port = (l4 && remaining >= 4) ? knot_wire_read_u16(l4 + (source ? 0 : 2)) : 0;
+    memset(addr, 0, sizeof(*addr));
+    if (ethertype == 0x0800) {
+        struct sockaddr_in *a4 = (struct sockaddr_in *)addr;
+        a4->sin_family = AF_INET;
+        a4->sin_port = htons(port);
+        memcpy(&a4->sin_addr, l3 + (source ? 12 : 16), sizeof(a4->sin_addr));
+    } else {
+        addr->sin6_family = AF_INET6;
+        addr->sin6_port = htons(port);
+        memcpy(&addr->sin6_addr, l3 + (source ? 8 : 24), sizeof(addr->sin6_addr));
+    }
+    return 1;
+}
+
+/**
+ * The transport payload length on the wire, as `trace_get_payload_length()`.
+ */
+static size_t
+dns_old_get_payload_length(int dlt, const uint8_t *data, size_t caplen)
+{
+    const uint8_t *udp = dns_old_get_udp(dlt, data, caplen);
+    if (udp)
+        return knot_wire_read_u16(udp + 4) - 8;
+    const uint8_t *tcp = dns_old_get_tcp(dlt, data, caplen);
+    if (!tcp)
+        return 0;
+    const uint8_t *ip = dns_old_get_ip(dlt, data, caplen);
+    const uint8_t *ip6 = ip ? NULL : dns_old_get_ip6(dlt, data, caplen);
+    size_t ip_payload = ip ? knot_wire_read_u16(ip + 2) - (ip[0] & 0x0f) * 4 :
+                             knot_wire_read_u16(ip6 + 4) - (tcp - ip6 - 40);
+    return ip_payload - (tcp[12] >> 4) * 4;
+}
+
+/**
+ * Decode the frame with the accessors of `dns_packet_net_from_libtrace_layers()`, in its order.
+ */
+static dns_ret_t
+dns_old_decode(int dlt, const uint8_t *data, size_t caplen, struct dns_packet_net *net)
+{
+    uint8_t proto;
+    size_t remaining;
+    const uint8_t *transport = dns_old_get_transport(dlt, data, caplen, &proto, &remaining);
+    if (!transport)
+        return DNS_RET_DROP_NETWORK;
+    const uint8_t *ip = dns_old_get_ip(dlt, data, caplen);
+    const uint8_t *ip6 = dns_old_get_ip6(dlt, data, caplen);
+    const uint8_t *tcp = dns_old_get_tcp(dlt, data, caplen);
+    const uint8_t *udp = dns_old_get_udp(dlt, data, caplen);
+
+    uint8_t frag_more;
+    if (dns_old_get_fragment_offset(dlt, data, caplen, &frag_more) > 0 || frag_more)
+        return DNS_RET_DROP_FRAGMENTED;
+
+    const uint8_t *dns_data;
+    switch (proto) {
+    case IPPROTO_TCP:
+        if (tcp[13] & (DNS_TCP_SYN | DNS_TCP_FIN))
+            return DNS_RET_DROP_TRANSPORT;
+        size_t hdr_size = (tcp[12] >> 4) * 4;
+        if (remaining < hdr_size + sizeof(uint16_t))
+            return DNS_RET_DROP_NETWORK;
+        size_t message_size = knot_wire_read_u16(transport + hdr_size);
+        dns_data = transport + hdr_size + sizeof(uint16_t);
+        remaining -= hdr_size + sizeof(uint16_t);
+        if (message_size + sizeof(uint16_t) != dns_old_get_payload_length(dlt, data, caplen))
+            return DNS_RET_DROP_TRANSPORT;
+        break;
+    case IPPROTO_UDP:
+        dns_data = transport + 8;
+        remaining -= 8;
+        break;
+    default:
+        return DNS_RET_DROP_TRANSPORT;
+    }
+
+    if (!(dns_old_get_address(dlt, data, caplen, 1, &net->src_addr) &&
+          dns_old_get_address(dlt, data, caplen, 0, &net->dst_addr)))
+        return DNS_RET_DROP_NETWORK;
+
+    net->protocol = proto;
+    net->ttl = ip ? ip[8] : (ip6 ? ip6[7] : 0);
+    net->udp_sum = udp ? knot_wire_read_u16(udp + 6) : 0;
+    net->dns_data = dns_data;
+    net->dns_data_size = remaining;
+    net->payload_size = dns_old_get_payload_length(dlt, data, caplen);
+    return DNS_RET_OK;
+}
+
+/** @} */
+
+/** @name The benchmark frames */
+/** @{ */
+
+/** A DNS query for "example.com A" */
+static const uint8_t dns_bench_query[] = {
+    0x12, 0x34, 0x01, 0x00, 0x00, 0x01, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+    7, 'e', 'x', 'a', 'm', 'p', 'l', 'e', 3, 'c', 'o', 'm', 0, 0x00, 0x01, 0x00, 0x01,
+};
+
+struct dns_bench_frame {
+    const char *name;
+    int dlt;
+    /** Number of 802.1Q tags (Ethernet only) */
+    int vlans;
+    /** IP version, 4 or 6 */
+    int ip;
+    /** Number of 8 byte IPv6 destination options headers */
+    int ext_headers;
+    /** IPPROTO_UDP or IPPROTO_TCP */
+    uint8_t proto;
+    uint8_t data[256];
+    size_t size;
+};
+
+static struct dns_bench_frame dns_bench_frames[] = {
+    { "Ethernet IPv4 UDP", DNS_BENCH_DLT_EN10MB, 0, 4, 0, IPPROTO_UDP },
+    { "Ethernet QinQ IPv4 UDP", DNS_BENCH_DLT_EN10MB, 2, 4, 0, IPPROTO_UDP },
+    { "Ethernet 802.1Q IPv6 UDP", DNS_BENCH_DLT_EN10MB, 1, 6, 0, IPPROTO_UDP },
+    { "SLL IPv4 TCP", DNS_BENCH_DLT_LINUX_SLL, 0, 4, 0, IPPROTO_TCP },
+    { "SLL IPv6 UDP", DNS_BENCH_DLT_LINUX_SLL, 0, 6, 0, IPPROTO_UDP },
+    { "Ethernet IPv6 2 ext. headers UDP", DNS_BENCH_DLT_EN10MB, 0, 6, 2, IPPROTO_UDP },
+    { "Ethernet IPv6 1 ext. header TCP", DNS_BENCH_DLT_EN10MB, 0, 6, 1, IPPROTO_TCP },
+};
+
+/**
+ * Build the frame data as given by the other `struct dns_bench_frame` fields.
+ */
+static void
+dns_bench_build_frame(struct dns_bench_frame *f)
+{
+    uint8_t *p = f->data;
+    uint16_t ethertype = (f->ip == 4) ? 0x0800 : 0x86DD;
+
+    // Link layer
+    if (f->dlt == DNS_BENCH_DLT_LINUX_SLL) {
+        memset(p, 0, 14);
+        knot_wire_write_u16(p + 2, 1); // ARPHRD_ETHER
+        knot_wire_write_u16(p + 4, 6);
+        knot_wire_write_u16(p + 14, ethertype);
+        p += 16;
+    } else {
+        memset(p, 0x02, 12);
+        p += 12;
+        for (int i = 0; i < f->vlans; i++) {
+            knot_wire_write_u16(p, (i == 0 && f->vlans > 1) ? 0x88A8 : 0x8100);
+            knot_wire_write_u16(p + 2, 100 + i);
+            p += 4;
+        }
+        knot_wire_write_u16(p, ethertype);
+        p += 2;
+    }
+
+    // Transport header and the DNS data, placed after the network headers
+    size_t l3_size = (f->ip == 4) ? 20 : 40 + 8 * f->ext_headers;
+    uint8_t *l4 = p + l3_size;
+    size_t l4_size;
+    if (f->proto == IPPROTO_UDP) {
+        l4_size = 8 + sizeof(dns_bench_query);
+        knot_wire_write_u16(l4, 34567);
+        knot_wire_write_u16(l4 + 2, 53);
+        knot_wire_write_u16(l4 + 4, l4_size);
+        knot_wire_write_u16(l4 + 6, 0xbeef);
+        memcpy(l4 + 8, dns_bench_query, sizeof(dns_bench_query));
+    } else {
+        l4_size = 20 + 2 + sizeof(dns_bench_query);
+        memset(l4, 0, 20);
+        knot_wire_write_u16(l4, 34567);
+        knot_wire_write_u16(l4 + 2, 53);
+        knot_wire_write_u32(l4 + 4, 1000);
+        l4[12] = 5 << 4;
+        l4[13] = 0x18; // PSH, ACK
+        knot_wire_write_u16(l4 + 20, sizeof(dns_bench_query));
+        memcpy(l4 + 22, dns_bench_query, sizeof(dns_bench_query));
+    }
+
+    // Network layer
+    if (f->ip == 4) {
+        memset(p, 0, 20);
+        p[0] = 0x45;
+        knot_wire_write_u16(p + 2, 20 + l4_size);
+        knot_wire_write_u16(p + 4, 4321);
+        knot_wire_write_u16(p + 6, 0x4000); // Don't fragment
+        p[8] = 64;
+        p[9] = f->proto;
+        uint8_t src[] = {192, 0, 2, 1}, dst[] = {198, 51, 100, 53};
+        memcpy(p + 12, src, 4);
+        memcpy(p + 16, dst, 4);
+    } else {
+        memset(p, 0, 40);
+        p[0] = 0x60;
+        knot_wire_write_u16(p + 4, 8 * f->ext_headers + l4_size);
+        p[6] = f->ext_headers ? IPPROTO_DSTOPTS : f->proto;
+        p[7] = 64;
+        p[8] = 0x20; p[9] = 0x01; p[10] = 0x0d; p[11] = 0xb8; p[23] = 1;
+        p[24] = 0x20; p[25] = 0x01; p[26] = 0x0d; p[27] = 0xb8; p[39] = 0x53;
+        for (int i = 0; i < f->ext_headers; i++) {
+            uint8_t *ext = p + 40 + 8 * i;
+            memset(ext, 0, 8);
+            ext[0] = (i + 1 < f->ext_headers) ? IPPROTO_DSTOPTS : f->proto;
+            ext[2] = 1; // PadN option
+            ext[3] = 4;
+        }
+    }
+    f->size = (l4 + l4_size) - f->data;
+}
+
+/** @} */
+
+/**
+ * Timestamp counter, CPU cycles on x86.
+ */
+static inline uint64_t
+dns_bench_ticks(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+    return __rdtsc();
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+#endif
+}
+
+/** Accumulates the decoded sizes so the decoding is not optimized away */
+static volatile size_t dns_bench_sink;
+
+/**
+ * Decode the frame `iterations` times with the single pass or the accessor decoder,
+ * return the ticks per packet.
+ */
+static double
+dns_bench_decode(const struct dns_bench_frame *f, size_t iterations, int old)
+{
+    struct dns_packet_net net;
+    size_t sum = 0;
+    uint64_t start = dns_bench_ticks();
+    for (size_t i = 0; i < iterations; i++) {
+        dns_ret_t r = old ? dns_old_decode(f->dlt, f->data, f->size, &net) :
+                            dns_packet_decode_dlt(f->dlt, f->data, f->size, &net);
+        sum += net.dns_data_size + r;
+    }
+    uint64_t ticks = dns_bench_ticks() - start;
+    dns_bench_sink += sum;
+    return (double)ticks / iterations;
+}
+
+int
+main(int argc, char **argv)
+{
+    size_t iterations = argc > 1 ? strtoul(argv[1], NULL, 10) : 10000000;
+    if (iterations < 1)
+        die("The number of iterations must be positive");
+
+#if defined(__x86_64__) || defined(__i386__)
+    const char *unit = "cycles";
+#else
+    const char *unit = "ns";
+#endif
+
+    for (size_t i = 0; i < sizeof(dns_bench_frames) / sizeof(dns_bench_frames[0]); i++) {
+        struct dns_bench_frame *f = &dns_bench_frames[i];
+        dns_bench_build_frame(f);
+
+        // Both decoders must agree on the frame
+        struct dns_packet_net old_net, new_net;
+        memset(&old_net, 0, sizeof(old_net));
+        memset(&new_net, 0, sizeof(new_net));
+        dns_ret_t old_r = dns_old_decode(f->dlt, f->data, f->size, &old_net);
+        dns_ret_t new_r = dns_packet_decode_dlt(f->dlt, f->data, f->size, &new_net);
+        if (old_r != DNS_RET_OK || new_r != DNS_RET_OK)
+            die("%s: decoding failed (accessors %d, single pass %d)", f->name, old_r, new_r);
+        if (memcmp(&old_net.src_addr, &new_net.src_addr, sizeof(old_net.src_addr)) ||
+            memcmp(&old_net.dst_addr, &new_net.dst_addr, sizeof(old_net.dst_addr)) ||
+            old_net.protocol != new_net.protocol || old_net.ttl != new_net.ttl ||
+            old_net.udp_sum != new_net.udp_sum || old_net.dns_data != new_net.dns_data ||
+            old_net.dns_data_size != new_net.dns_data_size || old_net.payload_size != new_net.payload_size ||
+            new_net.dns_data_size != sizeof(dns_bench_query))
+            die("%s: the decoders differ", f->name);
+
+        double old_ticks = dns_bench_decode(f, iterations, 1);
+        double new_ticks = dns_bench_decode(f, iterations, 0);
+        printf("%-34s accessors: %6.1f %s, single pass: %6.1f %s per packet\n",
+               f->name, old_ticks, unit, new_ticks, unit);
+    }
+    return 0;
+}
@@ -0,0 +1,275 @@
+/* 
+ *  Copyright (C) 2016 CZ.NIC, z.s.p.o.
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/**
+ * \file packet_hash_bench.c
+ * Benchmark of the matcher packet hash (`packet_hash.h`) against the chained table it replaced.
+ *
+ * Replays the matcher workload: every request is inserted, and after a window of `window`
+ * newer requests it is either matched by its response or removed as unanswered.
+ * Both tables use the same keyed key hash, so only the table structure is compared.
+ * The tables run alternately `repeats` times and the best time of each is reported,
+ * as a single run is easily disturbed by the other load of the machine.
+ *
+ * Usage: packet_hash_bench [requests [window [answered_percent [repeats]]]]
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <arpa/inet.h>
+
+#include "../src/common.h"
+#include "../src/packet.h"
+#include "../src/packet_hash.h"
+#include "../src/worker_packet_matcher.h"
+
+/** @name The chained hash table as before the open addressing one */
+/** @{ */
+
+struct dns_old_hash_bucket {
+    dns_hash_value_t hash_value;
+    struct dns_old_hash_bucket *next;
+    clist packets;
+};
+
+struct dns_old_hash {
+    size_t capacity;
+    size_t min_capacity;
+    size_t buckets;
+    struct dns_old_hash_bucket **data;
+};
+
+#define DNS_OLD_HASH_MIN_PERCENT 25
+#define DNS_OLD_HASH_BEST_PERCENT 50
+#define DNS_OLD_HASH_MAX_PERCENT 75
+
+static struct dns_old_hash *
+dns_old_hash_create(size_t capacity)
+{
+    struct dns_old_hash *h = xmalloc_zero(sizeof(struct dns_old_hash));
+    h->capacity = capacity;
+    h->min_capacity = capacity;
+    h->data = xmalloc_zero(h->capacity * sizeof(struct dns_old_hash_bucket *));
+    return h;
+}
+
+static void
+dns_old_hash_destroy(struct dns_old_hash *h)
+{
+    for (size_t i = 0; i < h->capacity; i++)
+        for (struct dns_old_hash_bucket *b = h->data[i]; b;) {
+            struct dns_old_hash_bucket *t = b->next;
+            free(b);
+            b = t;
+        }
+    free(h->data);
+    free(h);
+}
+
+static void
+dns_old_hash_resize(struct dns_old_hash *h, size_t new_capacity)
+{
+    if (new_capacity < h->min_capacity)
+        new_capacity = h->min_capacity;
+    if (new_capacity == h->capacity)
+        return;
+    struct dns_old_hash_bucket **new_data = xmalloc_zero(new_capacity * sizeof(struct dns_old_hash_bucket *));
+    for (size_t i = 0; i < h->capacity; i++)
+        for (struct dns_old_hash_bucket *b = h->data[i]; b;) {
+            struct dns_old_hash_bucket *t = b->next;
+            dns_hash_value_t mod_hash = b->hash_value % new_capacity;
+            b->next = new_data[mod_hash];
+            new_data[mod_hash] = b;
+            b = t;
+        }
+    free(h->data);
+    h->data = new_data;
+    h->capacity = new_capacity;
+}
+
+static struct dns_old_hash_bucket **
+dns_old_hash_find_bucket(struct dns_old_hash *h, struct dns_packet *p)
+{
+    struct dns_old_hash_bucket **bp;
+    for (bp = &h->data[p->key_hash % h->capacity]; *bp; bp = &((*bp)->next)) {
+        struct dns_packet *first_packet = DNS_PACKET_FROM_SECNODE(clist_head(&(*bp)->packets));
+        if (((*bp)->hash_value == p->key_hash) && (dns_packet_primary_match(p, first_packet)))
+            return bp;
+    }
+    return bp;
+}
+
+static void
+dns_old_hash_insert_packet(struct dns_old_hash *h, struct dns_packet *p)
+{
+    struct dns_old_hash_bucket **bp = dns_old_hash_find_bucket(h, p);
+    struct dns_old_hash_bucket *b = *bp;
+    if (!b) {
+        b = xmalloc_zero(sizeof(struct dns_old_hash_bucket));
+        b->hash_value = p->key_hash;
+        clist_init(&b->packets);
+        b->next = NULL;
+        *bp = b;
+        h->buckets ++;
+        if (h->buckets > h->capacity * DNS_OLD_HASH_MAX_PERCENT / 100)
+            dns_old_hash_resize(h, h->buckets * 100 / DNS_OLD_HASH_BEST_PERCENT);
+    }
+    clist_add_tail(&b->packets, &p->secnode);
+}
+
+static void
+dns_old_hash_remove_from_bucket(struct dns_old_hash *h, struct dns_packet *p, struct dns_old_hash_bucket **bp)
+{
+    struct dns_old_hash_bucket *b = *bp;
+    clist_remove(&p->secnode);
+    if (clist_empty(&b->packets)) {
+        *bp = b->next;
+        free(b);
+        h->buckets --;
+        if (h->buckets < h->capacity * DNS_OLD_HASH_MIN_PERCENT / 100)
+            dns_old_hash_resize(h, h->buckets * 100 / DNS_OLD_HASH_BEST_PERCENT);
+    }
+}
+
+static struct dns_packet *
+dns_old_hash_get_match(struct dns_old_hash *h, struct dns_packet *p)
+{
+    struct dns_old_hash_bucket **bp = dns_old_hash_find_bucket(h, p);
+    if (!*bp)
+        return NULL;
+    struct dns_packet *req = DNS_PACKET_FROM_SECNODE(clist_head(&(*bp)->packets));
+    dns_old_hash_remove_from_bucket(h, req, bp);
+    return req;
+}
+
+static void
+dns_old_hash_remove_packet(struct dns_old_hash *h, struct dns_packet *p)
+{
+    struct dns_old_hash_bucket **bp = dns_old_hash_find_bucket(h, p);
+    dns_old_hash_remove_from_bucket(h, p, bp);
+}
+
+/** @} */
+
+/**
+ * Create a request (or its response) of the given flow, with the key computed.
+ */
+static struct dns_packet *
+dns_bench_packet(uint32_t client, uint16_t port, uint16_t id, int response)
+{
+    uint8_t header[DNS_PACKET_QNAME_OFFSET] = {0};
+    if (response)
+        header[2] = 0x80; // QR
+    struct dns_packet *pkt = dns_packet_create(NULL, header, sizeof(header), 0);
+    struct sockaddr_in *client_sa = (struct sockaddr_in *)(response ? &pkt->dst_addr : &pkt->src_addr);
+    struct sockaddr_in *server_sa = (struct sockaddr_in *)(response ? &pkt->src_addr : &pkt->dst_addr);
+    client_sa->sin_family = server_sa->sin_family = AF_INET;
+    client_sa->sin_addr.s_addr = htonl(0x0a000000 | client);
+    client_sa->sin_port = htons(port);
+    server_sa->sin_addr.s_addr = htonl(0xc0000201);
+    server_sa->sin_port = htons(53);
+    pkt->net_protocol = 17;
+    pkt->dns_id = id;
+    dns_packet_compute_key(pkt);
+    return pkt;
+}
+
+static double
+dns_bench_now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+int
+main(int argc, char **argv)
+{
+    size_t count = argc > 1 ? strtoul(argv[1], NULL, 10) : 1000000;
+    size_t window = argc > 2 ? strtoul(argv[2], NULL, 10) : 100000;
+    int answered = argc > 3 ? atoi(argv[3]) : 90;
+    int repeats = argc > 4 ? atoi(argv[4]) : 5;
+    if (window < 1 || window > count || count > 65536UL * 64512)
+        die("The window must be 1..requests, at most 65536 * 64512 requests");
+    if (repeats < 1)
+        die("At least one repeat needed");
+
+    dns_packet_hash_init_secret();
+    srandom(42);
+    struct dns_packet **requests = xmalloc(count * sizeof(struct dns_packet *));
+    struct dns_packet **responses = xmalloc(count * sizeof(struct dns_packet *));
+    for (size_t i = 0; i < count; i++) {
+        // Distinct flows, so every response matches its own request
+        uint32_t client = i % 65536;
+        uint16_t port = 1024 + i / 65536, id = random();
+        requests[i] = dns_bench_packet(client, port, id, 0);
+        responses[i] = (random() % 100 < answered) ? dns_bench_packet(client, port, id, 1) : NULL;
+    }
+
+    double best[2] = {0.0, 0.0};
+    size_t matched[2] = {0, 0};
+    for (int run = 0; run < 2 * repeats; run++) {
+        int old = !(run % 2);
+        struct dns_old_hash *oh = old ? dns_old_hash_create(WORKER_PACKET_MATCHER_MIN_HASH_SIZE) : NULL;
+        struct dns_packet_hash *nh = old ? NULL : dns_packet_hash_create(WORKER_PACKET_MATCHER_MIN_HASH_SIZE);
+        matched[old] = 0;
+        double start = dns_bench_now();
+        for (size_t i = 0; i < count + window; i++) {
+            if (i < count) {
+                if (old)
+                    dns_old_hash_insert_packet(oh, requests[i]);
+                else
+                    dns_packet_hash_insert_packet(nh, requests[i]);
+            }
+            if (i < window)
+                continue;
+            size_t j = i - window;
+            if (responses[j]) {
+                struct dns_packet *req = old ? dns_old_hash_get_match(oh, responses[j]) :
+                                               dns_packet_hash_get_match(nh, responses[j], 0);
+                matched[old] += (req == requests[j]);
+            } else {
+                if (old)
+                    dns_old_hash_remove_packet(oh, requests[j]);
+                else
+                    dns_packet_hash_remove_packet(nh, requests[j]);
+            }
+        }
+        double elapsed = dns_bench_now() - start;
+        if (run < 2 || elapsed < best[old])
+            best[old] = elapsed;
+        if (old)
+            dns_old_hash_destroy(oh);
+        else
+            dns_packet_hash_destroy(nh);
+    }
+    size_t ops = count + count; // Inserts plus matches or removals
+    for (int old = 1; old >= 0; old--)
+        printf("%s hash: %zu requests, window %zu, %zu matched: %.1f ns per operation (best of %d)\n",
+               old ? "chained" : "open addressing", count, window, matched[old], best[old] * 1e9 / ops, repeats);
+
+    for (size_t i = 0; i < count; i++) {
+        dns_packet_destroy(requests[i]);
+        if (responses[i])
+            dns_packet_destroy(responses[i]);
+    }
+    free(requests);
+    free(responses);
+    return 0;
+}
@@ -18,6 +18,7 @@
 #include "common.h"
 #include "config.h"
 #include <ctype.h>
+#include <unistd.h>
 
 static char *
 dns_collector_conf_init(void *data)
@@ -28,6 +29,7 @@ dns_collector_conf_init(void *data)
     conf->max_frame_duration_sec = 0.5;
     conf->max_frame_size = 1 << 18;
     conf->max_queue_len = 8;
+    conf->max_queue_size = 0;
     conf->report_period_sec = 60;
 
     // Input
@@ -36,6 +38,23 @@ dns_collector_conf_init(void *data)
     conf->input_snaplen = -1;
     conf->input_promiscuous = 1;
     conf->input_real_time_grace_sec = 0.1; // TODO: allow configuration
+    conf->input_compact_packets = 0;
+    conf->input_packet_arenas = 0;
+    conf->input_native_pcap = 1;
+    conf->input_offline_threads = 1;
+    conf->input_offline_chunk_size = 1ULL << 30;
+    conf->input_parse_threads = 0;
+    conf->input_defrag_memory = 0;
+    conf->input_defrag_timeout_sec = 2.0;
+    conf->input_tcp_memory = 0;
+    conf->input_tcp_timeout_sec = 10.0;
+    conf->input_reorder_window_sec = 0.0;
+    conf->input_dedup_window_sec = 0.0;
+    conf->input_afpacket_threads = 1;
+    conf->input_afpacket_block_size = 1 << 20;
+    conf->input_afpacket_blocks = 64;
+    conf->input_overload_mode = DNS_OVERLOAD_BLOCK;
+    conf->input_overload_shed_start = 0.5;
 
     // Packet dump options
     conf->dump_path_fmt = "";
@@ -46,7 +65,10 @@ dns_collector_conf_init(void *data)
 
     // Matching
     conf->match_window_sec = 5.0;
+    conf->match_early_release = 0;
+    conf->match_emit_delay_sec = 0.0;
     conf->match_qname = 0;
+    conf->match_threads = 1;
 
     // General output
     conf->output_type = DNS_OUTPUT_TYPE_CSV;
@@ -66,6 +88,20 @@ dns_collector_conf_init(void *data)
     return NULL;
 }
 
+char *
+dns_config_check_afpacket(const struct dns_config *conf)
+{
+    if (conf->input_uri == NULL ||
+        strncmp(conf->input_uri, DNS_AFPACKET_URI_PREFIX, strlen(DNS_AFPACKET_URI_PREFIX)) != 0)
+        return NULL;
+    if (conf->input_afpacket_threads < 1 || conf->input_afpacket_threads > DNS_MAX_AFPACKET_THREADS)
+        return "'input_afpacket_threads' must be 1..64";
+    if (conf->input_afpacket_block_size < 4096 || conf->input_afpacket_block_size % getpagesize() != 0)
+        return "'input_afpacket_block_size' must be a multiple of the page size";
+    if (conf->input_afpacket_blocks < 2)
+        return "'input_afpacket_blocks' must be at least 2";
+    return NULL;
+}
 
 static char *
 dns_collector_conf_commit(void *data)
@@ -76,6 +112,14 @@ dns_collector_conf_commit(void *data)
         return "'max_frame_duration_sec' too small, minimum 0.001 sec";
     if (conf->max_queue_len < 1)
         return "'max_queue_len' must be at least 1";
+    if (conf->max_queue_size > 0 && conf->max_queue_size < conf->max_frame_size)
+        return "'max_queue_size' must be 0 (no limit) or at least 'max_frame_size'";
+    if (conf->match_emit_delay_sec < 0.0 || conf->match_emit_delay_sec > conf->match_window_sec)
+        return "'match_emit_delay' must be between 0 and 'match_window'";
+    if (conf->match_emit_delay_sec > 0.0 && !conf->match_early_release)
+        return "'match_emit_delay' requires 'match_early_release'";
+    if (conf->match_threads < 1 || conf->match_threads > DNS_MAX_MATCH_THREADS)
+        return "'match_threads' must be 1..64";
     switch (conf->output_type) {
         case DNS_OUTPUT_TYPE_CSV:
             if (strlen(conf->csv_separator) != 1)
@@ -93,6 +137,23 @@ dns_collector_conf_commit(void *data)
         default:
             return "only output types 'csv' and 'cbor' currently supported";
     }
+    if (conf->input_overload_shed_start < 0.0 || conf->input_overload_shed_start >= 1.0)
+        return "'input_overload_shed_start' must be at least 0 and less than 1";
+    char *afpacket_err = dns_config_check_afpacket(conf);
+    if (afpacket_err)
+        return afpacket_err;
+    if (conf->input_offline_threads < 1 || conf->input_offline_threads > DNS_MAX_OFFLINE_THREADS)
+        return "'input_offline_threads' must be 1..64";
+    if (conf->input_parse_threads < 0 || conf->input_parse_threads > DNS_MAX_PARSE_THREADS)
+        return "'input_parse_threads' must be 0..64";
+    if (conf->input_defrag_timeout_sec <= 0.0)
+        return "'input_defrag_timeout' must be positive";
+    if (conf->input_tcp_timeout_sec <= 0.0)
+        return "'input_tcp_timeout' must be positive";
+    if (conf->input_reorder_window_sec < 0.0 || conf->input_reorder_window_sec >= conf->max_frame_duration_sec)
+        return "'input_reorder_window' must be non-negative and shorter than 'max_frame_duration'";
+    if (conf->input_dedup_window_sec < 0.0)
+        return "'input_dedup_window' must be non-negative";
     if (conf->dump_compress_level < 0 || conf->dump_compress_level > 9)
         return "'dump_compress_level' must be 0..9";
 
@@ -102,6 +163,9 @@ dns_collector_conf_commit(void *data)
 static const char *dns_output_types[] = {
     "csv", "cbor", NULL };
 
+static const char *dns_overload_modes[] = {
+    "block", "shed", NULL };
+
 static const char *dns_dump_compress_types[] = {
     "none",
     "gzip",
@@ -126,6 +190,7 @@ struct cf_section dns_config_section = {
         CF_DOUBLE("max_frame_duration", PTR_TO(struct dns_config, max_frame_duration_sec)),
         CF_INT("max_frame_size", PTR_TO(struct dns_config, max_frame_size)),
         CF_INT("max_queue_len", PTR_TO(struct dns_config, max_queue_len)),
+        CF_U64("max_queue_size", PTR_TO(struct dns_config, max_queue_size)),
         CF_INT("report_period", PTR_TO(struct dns_config, report_period_sec)),
 
         // Input
@@ -133,6 +198,23 @@ struct cf_section dns_config_section = {
         CF_STRING("input_filter", PTR_TO(struct dns_config, input_filter)),
         CF_INT("input_snaplen", PTR_TO(struct dns_config, input_snaplen)),
         CF_INT("input_promiscuous", PTR_TO(struct dns_config, input_promiscuous)),
+        CF_INT("input_compact_packets", PTR_TO(struct dns_config, input_compact_packets)),
+        CF_INT("input_packet_arenas", PTR_TO(struct dns_config, input_packet_arenas)),
+        CF_INT("input_native_pcap", PTR_TO(struct dns_config, input_native_pcap)),
+        CF_INT("input_offline_threads", PTR_TO(struct dns_config, input_offline_threads)),
+        CF_U64("input_offline_chunk_size", PTR_TO(struct dns_config, input_offline_chunk_size)),
+        CF_INT("input_parse_threads", PTR_TO(struct dns_config, input_parse_threads)),
+        CF_U64("input_defrag_memory", PTR_TO(struct dns_config, input_defrag_memory)),
+        CF_DOUBLE("input_defrag_timeout", PTR_TO(struct dns_config, input_defrag_timeout_sec)),
+        CF_U64("input_tcp_memory", PTR_TO(struct dns_config, input_tcp_memory)),
+        CF_DOUBLE("input_tcp_timeout", PTR_TO(struct dns_config, input_tcp_timeout_sec)),
+        CF_DOUBLE("input_reorder_window", PTR_TO(struct dns_config, input_reorder_window_sec)),
+        CF_DOUBLE("input_dedup_window", PTR_TO(struct dns_config, input_dedup_window_sec)),
+        CF_INT("input_afpacket_threads", PTR_TO(struct dns_config, input_afpacket_threads)),
+        CF_INT("input_afpacket_block_size", PTR_TO(struct dns_config, input_afpacket_block_size)),
+        CF_INT("input_afpacket_blocks", PTR_TO(struct dns_config, input_afpacket_blocks)),
+        CF_LOOKUP("input_overload_mode", PTR_TO(struct dns_config, input_overload_mode), dns_overload_modes),
+        CF_DOUBLE("input_overload_shed_start", PTR_TO(struct dns_config, input_overload_shed_start)),
 
         // Packet dump options
         CF_STRING("dump_path_fmt", PTR_TO(struct dns_config, dump_path_fmt)),
@@ -143,7 +225,10 @@ struct cf_section dns_config_section = {
 
         // Matching
         CF_DOUBLE("match_window", PTR_TO(struct dns_config, match_window_sec)),
+        CF_INT("match_early_release", PTR_TO(struct dns_config, match_early_release)),
+        CF_DOUBLE("match_emit_delay", PTR_TO(struct dns_config, match_emit_delay_sec)),
         CF_INT("match_qname", PTR_TO(struct dns_config, match_qname)),
+        CF_INT("match_threads", PTR_TO(struct dns_config, match_threads)),
 
         // General output options
         CF_LOOKUP("output_type", PTR_TO(struct dns_config, output_type), dns_output_types),
@@ -36,6 +36,7 @@ struct dns_config {
     double max_frame_duration_sec;
     int max_frame_size;
     int max_queue_len;
+    u64 max_queue_size;
     int report_period_sec;
 
     // Input
@@ -44,6 +45,23 @@ struct dns_config {
     int input_snaplen;
     int input_promiscuous;
     double input_real_time_grace_sec;
+    int input_overload_mode;
+    double input_overload_shed_start;
+    int input_compact_packets;
+    int input_packet_arenas;
+    int input_native_pcap;
+    int input_offline_threads;
+    u64 input_offline_chunk_size;
+    int input_parse_threads;
+    u64 input_defrag_memory;
+    double input_defrag_timeout_sec;
+    u64 input_tcp_memory;
+    double input_tcp_timeout_sec;
+    double input_reorder_window_sec;
+    double input_dedup_window_sec;
+    int input_afpacket_threads;
+    int input_afpacket_block_size;
+    int input_afpacket_blocks;
 
     // Packet dump options
     char *dump_path_fmt;
@@ -54,7 +72,10 @@ struct dns_config {
 
     // Matching
     double match_window_sec;
+    int match_early_release;
+    double match_emit_delay_sec;
     int match_qname;
+    int match_threads;
 
     // General output options
     int output_type;
@@ -72,12 +93,39 @@ struct dns_config {
     uint32_t cbor_fields;
 };
 
+/** The `input_uri` prefix selecting the AF_PACKET capture, followed by the interface name. */
+#define DNS_AFPACKET_URI_PREFIX "afpacket:"
+
 extern struct cf_section dns_config_section;
 
+/**
+ * Check the `input_afpacket_*` options, only when `input_uri` selects the AF_PACKET capture.
+ * Called on config commit and again after `-i` overrides `input_uri`.
+ * Returns an error message or NULL.
+ */
+char *
+dns_config_check_afpacket(const struct dns_config *conf);
+
 /** TRACE_OPTION_COMPRESSTYPE_ corresponding to the values of dump_compress_type */
 extern trace_option_compresstype_t dns_dump_compress_types_num[];
 
+/** Upper bound on the number of matcher shards (`match_threads`) */
+#define DNS_MAX_MATCH_THREADS 64
+
+/** Upper bound on the number of AF_PACKET capture threads (`input_afpacket_threads`) */
+#define DNS_MAX_AFPACKET_THREADS 64
+
+/** Upper bound on the number of offline input threads (`input_offline_threads`) */
+#define DNS_MAX_OFFLINE_THREADS 64
+
+/** Upper bound on the number of DNS parsing threads (`input_parse_threads`) */
+#define DNS_MAX_PARSE_THREADS 64
+
 #define DNS_OUTPUT_TYPE_CSV 0
 #define DNS_OUTPUT_TYPE_CBOR 1
 
+/** Values of input_overload_mode */
+#define DNS_OVERLOAD_BLOCK 0
+#define DNS_OVERLOAD_SHED 1
+
 #endif /* DNSCOL_COLLECTOR_CONFIG_H */
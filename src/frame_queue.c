@@ -19,25 +19,74 @@
 #include <pthread.h>
 #include <stdlib.h>
 #include <assert.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
 
 #include "packet_frame.h"
 
 #include "frame_queue.h"
 
 
-struct dns_frame_queue *
-dns_frame_queue_create(size_t capacity, enum dns_frame_queue_on_full on_full)
+/**
+ * Allocate the queue struct common to both modes, without the item array.
+ */
+static struct dns_frame_queue *
+dns_frame_queue_alloc(size_t capacity, size_t size_cap, enum dns_frame_queue_on_full on_full)
 {
-    struct dns_frame_queue *q = (struct dns_frame_queue*) malloc(sizeof(struct dns_frame_queue));
-    q->queue = (struct dns_packet_frame**) malloc(sizeof(struct dns_packet_frame *) * capacity);
+    assert(capacity >= 1 && capacity < (1U << 31));
+    struct dns_frame_queue *q = (struct dns_frame_queue*) aligned_alloc(DNS_CACHELINE_SIZE, sizeof(struct dns_frame_queue));
+    if (!q)
+        die("Out of memory allocating a frame queue");
+    memset(q, 0, sizeof(struct dns_frame_queue));
+    q->queue = NULL;
     q->length = 0;
     q->start = 0;
     q->capacity = capacity;
+    q->size_cap = size_cap;
     q->on_full = on_full;
-    q->total_size = 0;
+    atomic_init(&q->total_size, 0);
+    atomic_init(&q->max_length, 0);
+    atomic_init(&q->max_size, 0);
+    atomic_init(&q->dropped, 0);
     pthread_cond_init(&q->empty_cond, NULL);
     pthread_cond_init(&q->full_cond, NULL);
     pthread_mutex_init(&q->mutex, NULL);
+    q->spsc = 0;
+    q->ring = NULL;
+    return q;
+}
+
+struct dns_frame_queue *
+dns_frame_queue_create(size_t capacity, size_t size_cap, enum dns_frame_queue_on_full on_full)
+{
+    struct dns_frame_queue *q = dns_frame_queue_alloc(capacity, size_cap, on_full);
+    q->queue = (struct dns_packet_frame**) malloc(sizeof(struct dns_packet_frame *) * capacity);
+    return q;
+}
+
+struct dns_frame_queue *
+dns_frame_queue_create_spsc(size_t capacity, size_t size_cap, enum dns_frame_queue_on_full on_full)
+{
+    struct dns_frame_queue *q = dns_frame_queue_alloc(capacity, size_cap, on_full);
+    q->spsc = 1;
+    // The free running indices wrap at 2^32, a multiple of the power of two ring size
+    size_t ring_size = 1;
+    while (ring_size < capacity)
+        ring_size *= 2;
+    q->ring_mask = ring_size - 1;
+    q->ring = malloc(sizeof(*q->ring) * ring_size);
+    q->ring_sizes = malloc(sizeof(*q->ring_sizes) * ring_size);
+    for (size_t i = 0; i < ring_size; i++) {
+        atomic_init(&q->ring[i], NULL);
+        atomic_init(&q->ring_sizes[i], 0);
+    }
+    atomic_init(&q->head, 0);
+    atomic_init(&q->tail, 0);
+    atomic_init(&q->consumer_waiting, 0);
+    atomic_init(&q->producer_waiting, 0);
+    q->producer_spin = DNS_FRAME_QUEUE_SPIN_MIN;
+    q->consumer_spin = DNS_FRAME_QUEUE_SPIN_MIN;
     return q;
 }
 
@@ -47,7 +96,14 @@ dns_frame_queue_destroy(struct dns_frame_queue* q)
     assert(q);
 
     for (int i = 0; i < q->length; i++)
-        dns_packet_frame_destroy(q->queue[i]);
+        dns_packet_frame_destroy(q->queue[(q->start + i) % q->capacity]);
+    if (q->spsc) {
+        unsigned head = atomic_load(&q->head);
+        for (unsigned t = atomic_load(&q->tail); t != head; t++)
+            dns_packet_frame_destroy(atomic_load(&q->ring[t & q->ring_mask]));
+        free(q->ring);
+        free(q->ring_sizes);
+    }
     free(q->queue);
     pthread_mutex_destroy(&q->mutex);
     pthread_cond_destroy(&q->full_cond);
@@ -67,6 +123,143 @@ dns_frame_queue_dequeue_internal(struct dns_frame_queue* q)
     return f;
 }
 
+/**
+ * Would adding a frame of `size` bytes exceed the queue limits with `length` frames
+ * of `total_size` bytes queued?
+ */
+static inline int
+dns_frame_queue_is_full(struct dns_frame_queue* q, size_t length, size_t total_size, size_t size)
+{
+    if (length >= q->capacity)
+        return 1;
+    return (q->size_cap > 0) && (length > 0) && (total_size + size > q->size_cap);
+}
+
+/**
+ * Update the high-water marks after an enqueue (by the only producer or under the mutex).
+ */
+static inline void
+dns_frame_queue_update_stats(struct dns_frame_queue* q, size_t length, size_t total_size)
+{
+    if (length > atomic_load_explicit(&q->max_length, memory_order_relaxed))
+        atomic_store_explicit(&q->max_length, length, memory_order_relaxed);
+    if (total_size > atomic_load_explicit(&q->max_size, memory_order_relaxed))
+        atomic_store_explicit(&q->max_size, total_size, memory_order_relaxed);
+}
+
+static inline void
+dns_frame_queue_cpu_relax(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#endif
+}
+
+/**
+ * Wait until the SPSC index `word` differs from `val`, first by spinning for up to `*spin` checks,
+ * then by sleeping on the futex, announced by `waiting` to the other side.
+ * The spin limit grows when spinning was enough and shrinks when the thread had to sleep.
+ */
+static void
+dns_frame_queue_spsc_wait(atomic_uint *word, unsigned val, atomic_int *waiting, unsigned *spin)
+{
+    for (unsigned i = 0; i < *spin; i++) {
+        if (atomic_load_explicit(word, memory_order_acquire) != val) {
+            *spin = MIN(*spin * 2, DNS_FRAME_QUEUE_SPIN_MAX);
+            return;
+        }
+        dns_frame_queue_cpu_relax();
+    }
+    *spin = MAX(*spin / 2, DNS_FRAME_QUEUE_SPIN_MIN);
+
+    // Sequentially consistent flag store and index load pair with the index store and flag load
+    // in `dns_frame_queue_spsc_wake()`, so either we see the new index or the other side sees the flag
+    atomic_store(waiting, 1);
+    while (atomic_load(word) == val)
+        syscall(SYS_futex, word, FUTEX_WAIT_PRIVATE, val, NULL, NULL, 0);
+    atomic_store_explicit(waiting, 0, memory_order_relaxed);
+}
+
+/**
+ * Wake the other side sleeping on the SPSC index `word` (after its update), if any.
+ */
+static inline void
+dns_frame_queue_spsc_wake(atomic_uint *word, atomic_int *waiting)
+{
+    if (atomic_load(waiting))
+        syscall(SYS_futex, word, FUTEX_WAKE_PRIVATE, 1, NULL, NULL, 0);
+}
+
+/**
+ * Claim the oldest frame of a non-empty SPSC queue by advancing `tail` from `t`.
+ * Returns NULL when the frame was claimed by the other side in the meantime.
+ * The size is decreased before advancing the tail, so a producer seeing the new tail
+ * also sees the new size and never waits for a tail change that is not coming.
+ * The frame itself is not touched before the claim succeeds, the other side may free it.
+ */
+static inline struct dns_packet_frame *
+dns_frame_queue_spsc_claim(struct dns_frame_queue* q, unsigned t)
+{
+    struct dns_packet_frame *f = atomic_load_explicit(&q->ring[t & q->ring_mask], memory_order_relaxed);
+    size_t size = atomic_load_explicit(&q->ring_sizes[t & q->ring_mask], memory_order_relaxed);
+    atomic_fetch_sub(&q->total_size, size);
+    if (!atomic_compare_exchange_strong(&q->tail, &t, t + 1)) {
+        atomic_fetch_add(&q->total_size, size);
+        return NULL;
+    }
+    return f;
+}
+
+static void
+dns_frame_queue_spsc_enqueue(struct dns_frame_queue* q, struct dns_packet_frame *f)
+{
+    unsigned h = atomic_load_explicit(&q->head, memory_order_relaxed); // Only written by us
+    unsigned t;
+    while (t = atomic_load_explicit(&q->tail, memory_order_acquire),
+           dns_frame_queue_is_full(q, h - t, atomic_load_explicit(&q->total_size, memory_order_relaxed), f->size)) {
+        if (q->on_full == DNS_QUEUE_BLOCK) {
+            dns_frame_queue_spsc_wait(&q->tail, t, &q->producer_waiting, &q->producer_spin);
+        }
+        if (q->on_full == DNS_QUEUE_DROP_OLDEST) {
+            struct dns_packet_frame *old = dns_frame_queue_spsc_claim(q, t);
+            if (old) {
+                dns_packet_frame_destroy(old);
+                atomic_fetch_add_explicit(&q->dropped, 1, memory_order_relaxed);
+            }
+        }
+        if (q->on_full == DNS_QUEUE_DROP_NEWEST) {
+            dns_packet_frame_destroy(f);
+            atomic_fetch_add_explicit(&q->dropped, 1, memory_order_relaxed);
+            return;
+        }
+    }
+
+    atomic_store_explicit(&q->ring[h & q->ring_mask], f, memory_order_relaxed);
+    atomic_store_explicit(&q->ring_sizes[h & q->ring_mask], f->size, memory_order_relaxed);
+    size_t total_size = atomic_fetch_add_explicit(&q->total_size, f->size, memory_order_relaxed) + f->size;
+    dns_frame_queue_update_stats(q, h + 1 - t, total_size);
+    atomic_store(&q->head, h + 1); // Publishes the slot
+    dns_frame_queue_spsc_wake(&q->head, &q->consumer_waiting);
+}
+
+static struct dns_packet_frame *
+dns_frame_queue_spsc_dequeue(struct dns_frame_queue* q)
+{
+    while (1) {
+        unsigned t = atomic_load_explicit(&q->tail, memory_order_relaxed);
+        unsigned h = atomic_load_explicit(&q->head, memory_order_acquire);
+        if (h == t) {
+            dns_frame_queue_spsc_wait(&q->head, h, &q->consumer_waiting, &q->consumer_spin);
+            continue;
+        }
+        struct dns_packet_frame *f = dns_frame_queue_spsc_claim(q, t);
+        if (f) {
+            dns_frame_queue_spsc_wake(&q->tail, &q->producer_waiting);
+            return f;
+        }
+    }
+}
+
 void
 dns_frame_queue_enqueue(struct dns_frame_queue* q, struct dns_packet_frame *f)
 {
@@ -77,18 +270,25 @@ dns_frame_queue_enqueue(struct dns_frame_queue* q, struct dns_packet_frame *f)
         return;
     }
 
+    if (q->spsc) {
+        dns_frame_queue_spsc_enqueue(q, f);
+        return;
+    }
+
     pthread_mutex_lock(&q->mutex);
 
-    while (q->length + 1 > q->capacity) {
+    while (dns_frame_queue_is_full(q, q->length, q->total_size, f->size)) {
         assert(q->length >= 1);
         if (q->on_full == DNS_QUEUE_BLOCK) {
             pthread_cond_wait(&q->full_cond, &q->mutex);
         }
         if (q->on_full == DNS_QUEUE_DROP_OLDEST) {
             dns_packet_frame_destroy(dns_frame_queue_dequeue_internal(q));
+            q->dropped ++;
         }
         if (q->on_full == DNS_QUEUE_DROP_NEWEST) {
             dns_packet_frame_destroy(f);
+            q->dropped ++;
             f = NULL;
             break;
         }      
@@ -98,6 +298,7 @@ dns_frame_queue_enqueue(struct dns_frame_queue* q, struct dns_packet_frame *f)
         q->queue[(q->start + q->length) % q->capacity] = f;
         q->length ++;
         q->total_size += f->size;
+        dns_frame_queue_update_stats(q, q->length, q->total_size);
     }
 
     pthread_cond_broadcast(&q->empty_cond);
@@ -109,6 +310,9 @@ dns_frame_queue_dequeue(struct dns_frame_queue* q)
 {
     assert(q);
 
+    if (q->spsc)
+        return dns_frame_queue_spsc_dequeue(q);
+
     pthread_mutex_lock(&q->mutex);
 
     while (q->length == 0) {
@@ -121,3 +325,42 @@ dns_frame_queue_dequeue(struct dns_frame_queue* q)
     return f;
 }
 
+double
+dns_frame_queue_occupancy(struct dns_frame_queue* q)
+{
+    assert(q);
+
+    size_t length;
+    if (q->spsc) {
+        length = atomic_load(&q->head) - atomic_load(&q->tail);
+    } else {
+        pthread_mutex_lock(&q->mutex);
+        length = q->length;
+        pthread_mutex_unlock(&q->mutex);
+    }
+    double occupancy = (double)length / q->capacity;
+    if (q->size_cap > 0)
+        occupancy = MAX(occupancy, (double)atomic_load(&q->total_size) / q->size_cap);
+    return occupancy;
+}
+
+void
+dns_frame_queue_report(struct dns_frame_queue* q, const char *name)
+{
+    assert(q && name);
+
+    size_t length;
+    if (q->spsc) {
+        length = atomic_load(&q->head) - atomic_load(&q->tail);
+    } else {
+        pthread_mutex_lock(&q->mutex);
+        length = q->length;
+        pthread_mutex_unlock(&q->mutex);
+    }
+    size_t max_length = atomic_exchange_explicit(&q->max_length, 0, memory_order_relaxed);
+    size_t max_size = atomic_exchange_explicit(&q->max_size, 0, memory_order_relaxed);
+    size_t dropped = atomic_exchange_explicit(&q->dropped, 0, memory_order_relaxed);
+    msg(L_INFO, "queue %s: %zu frames (%zu bytes) queued, high-water %zu frames (%zu bytes) of %zu frames (%zu bytes), %zu frames dropped",
+        name, length, atomic_load_explicit(&q->total_size, memory_order_relaxed),
+        max_length, max_size, q->capacity, q->size_cap, dropped);
+}
@@ -24,6 +24,7 @@
  */
 
 #include <pthread.h>
+#include <stdatomic.h>
 
 #include "common.h"
 
@@ -33,8 +34,27 @@ enum dns_frame_queue_on_full {
     DNS_QUEUE_DROP_OLDEST,
 };
 
+/** Bounds of the adaptive number of checks before a SPSC queue side sleeps */
+#define DNS_FRAME_QUEUE_SPIN_MIN 16
+#define DNS_FRAME_QUEUE_SPIN_MAX 4096
+
+/** Cache line size for padding the SPSC queue indices */
+#define DNS_CACHELINE_SIZE 64
+
 struct dns_packet_frame;
 
+/**
+ * A bounded frame queue in one of two modes.
+ *
+ * The general mode (`dns_frame_queue_create()`) is a mutex-protected circular array
+ * for any number of producers and consumers.
+ *
+ * The SPSC mode (`dns_frame_queue_create_spsc()`) is a lock-free ring for exactly one
+ * producer and one consumer thread. The producer owns `head`, the consumer owns `tail`
+ * (except for dropping the oldest frame on full queue, claimed by CAS on `tail`),
+ * each on its own cache line. A side that can not proceed spins for an adaptive number
+ * of checks and then sleeps on a futex on the other side's index.
+ */
 struct dns_frame_queue {
     /** Cirtcular array of queue items, queue[start] is oldest, queue[(start + length - 1) % capacity] newest. */
     struct dns_packet_frame **queue;
@@ -45,25 +65,72 @@ struct dns_frame_queue {
     /** Maximum number of items in queue. */
     size_t capacity;
 
+    /** Maximum size of the queued frames in bytes, 0 for no limit.
+     * A frame is always accepted into an empty queue, even when larger. */
+    size_t size_cap;
+
     /** Behavior on insert to full queue. */
     enum dns_frame_queue_on_full on_full;
 
     /** Size of the queued frames in bytes. */
-    size_t total_size;
+    atomic_size_t total_size;
+
+    /** High-water marks of the queue length and size since the last `dns_frame_queue_report()`. */
+    atomic_size_t max_length, max_size;
+
+    /** Number of frames dropped on full queue since the last `dns_frame_queue_report()`. */
+    atomic_size_t dropped;
 
     pthread_cond_t empty_cond;
     pthread_cond_t full_cond;
     pthread_mutex_t mutex;
+
+    /** Is this a lock-free single-producer single-consumer queue? The fields below are used only then. */
+    int spsc;
+
+    /** SPSC ring of `capacity` rounded up to a power of two slots, indexed by `head` and `tail`
+     * masked by `ring_mask`. The general mode `queue` is not allocated. */
+    _Atomic(struct dns_packet_frame *) *ring;
+
+    /** SPSC: sizes of the frames in `ring`, read when claiming a frame that may be freed by the other side. */
+    atomic_size_t *ring_sizes;
+
+    /** SPSC: ring size minus one. */
+    unsigned ring_mask;
+
+    /** SPSC: number of frames ever enqueued. Written by the producer, futex word for the consumer. */
+    _Alignas(DNS_CACHELINE_SIZE) atomic_uint head;
+    /** SPSC: set while the consumer sleeps on `head`. */
+    atomic_int consumer_waiting;
+    /** SPSC: producer's adaptive spin limit. */
+    unsigned producer_spin;
+
+    /** SPSC: number of frames ever dequeued or dropped. Written by the consumer, futex word for the producer. */
+    _Alignas(DNS_CACHELINE_SIZE) atomic_uint tail;
+    /** SPSC: set while the producer sleeps on `tail`. */
+    atomic_int producer_waiting;
+    /** SPSC: consumer's adaptive spin limit. */
+    unsigned consumer_spin;
 };
 
 /**
  * Allocate a fixed-capacity queue and size bound.
  *
  * Size is counted in bytes as reported by the contained structures, size_cap == 0 ignores the cap.
+ * The queue is full when it holds `capacity` frames or when the next frame would exceed `size_cap`
+ * (a frame is always accepted into an empty queue).
  * The parameter on_full determines the behaviour on full queue, see enum dns_frame_queue_on_full.
  */
 struct dns_frame_queue *
-dns_frame_queue_create(size_t capacity, enum dns_frame_queue_on_full on_full);
+dns_frame_queue_create(size_t capacity, size_t size_cap, enum dns_frame_queue_on_full on_full);
+
+/**
+ * Allocate a lock-free queue for exactly one producer and one consumer thread
+ * (one enqueueing and one dequeueing thread for the whole queue life).
+ * Otherwise the same as `dns_frame_queue_create()`.
+ */
+struct dns_frame_queue *
+dns_frame_queue_create_spsc(size_t capacity, size_t size_cap, enum dns_frame_queue_on_full on_full);
 
 /**
  * Free the queue and all contained frames.
@@ -85,5 +152,20 @@ dns_frame_queue_enqueue(struct dns_frame_queue* q, struct dns_packet_frame *f);
 struct dns_packet_frame *
 dns_frame_queue_dequeue(struct dns_frame_queue* q);
 
+/**
+ * Return the fill level of the queue as the larger of the length and size fractions of their bounds
+ * (1.0 or more for a full queue). May be called from any thread, exact only for the producer
+ * of a SPSC queue (where it can only decrease meanwhile).
+ */
+double
+dns_frame_queue_occupancy(struct dns_frame_queue* q);
+
+/**
+ * Log the current and high-water length and size of the queue and the number of dropped frames,
+ * resetting the high-water marks and the drop count. May be called from any thread.
+ */
+void
+dns_frame_queue_report(struct dns_frame_queue* q, const char *name);
+
 
 #endif /* DNSCOL_FRAME_QUEUE_H */
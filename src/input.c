@@ -24,15 +24,40 @@
 #include <errno.h>
 #include <libtrace.h>
 #include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+#include <ucw/heap.h>
 
 #include "common.h"
 #include "packet_frame.h"
 #include "frame_queue.h"
 #include "input.h"
+#include "input_afpacket.h"
+#include "pcap_reader.h"
+#include "packet_decode.h"
+#include "packet_defrag.h"
+#include "packet_tcp.h"
+#include "packet_dedup.h"
 
 static void
 dns_input_report(struct dns_input *input, int force);
 
+static void
+dns_input_append_packet(struct dns_input *input, struct dns_packet *pkt);
+
+static void
+dns_input_reorder_release(struct dns_input *input, dns_us_time_t time);
+
+/** Order of the held back packets, see `struct dns_input_reorder_item` */
+#define DNS_INPUT_REORDER_LESS(a, b) ((a).ts < (b).ts || ((a).ts == (b).ts && (a).seq < (b).seq))
+
+int
+dns_input_keeps_state(const struct dns_config *conf)
+{
+    return conf->input_defrag_memory > 0 || conf->input_tcp_memory > 0 ||
+           conf->input_reorder_window_sec > 0.0 || conf->input_dedup_window_sec > 0.0;
+}
+
 struct dns_input *
 dns_input_create(struct dns_config *conf, struct dns_frame_queue *output)
 {
@@ -46,7 +71,19 @@ dns_input_create(struct dns_config *conf, struct dns_frame_queue *output)
     input->frame_max_duration = dns_fsec_to_us_time(conf->max_frame_duration_sec);
     input->frame_max_size = conf->max_frame_size;
     input->real_time_grace = dns_fsec_to_us_time(conf->input_real_time_grace_sec);
+    input->reorder_window = dns_fsec_to_us_time(conf->input_reorder_window_sec);
+    input->reorder_newest = DNS_NO_TIME;
+    input->reorder_released = DNS_NO_TIME;
     input->promisc = conf->input_promiscuous;
+    input->fields = (conf->output_type == DNS_OUTPUT_TYPE_CBOR) ? conf->cbor_fields : conf->csv_fields;
+    input->compact_packets = conf->input_compact_packets;
+    input->packet_arenas = conf->input_packet_arenas;
+    input->native_pcap = conf->input_native_pcap;
+    input->overload_shed = (conf->input_overload_mode == DNS_OVERLOAD_SHED);
+    input->overload_shed_start = conf->input_overload_shed_start;
+    input->shed_threshold = 0;
+    if (input->packet_arenas)
+        input->frame->arena = dns_packet_arena_create();
     input->bpf_string = strdup(conf->input_filter);
     input->report_period_sec = conf->report_period_sec;
     input->last_report_time = DNS_NO_TIME;
@@ -55,6 +92,15 @@ dns_input_create(struct dns_config *conf, struct dns_frame_queue *output)
     } else {
         input->dumper = NULL;
     }
+    input->defer_parse = (conf->input_parse_threads > 0) && !input->dumper;
+    if (strncmp(input->uri, DNS_AFPACKET_URI_PREFIX, strlen(DNS_AFPACKET_URI_PREFIX)) == 0)
+        input->afpacket = dns_afpacket_create(conf, input->uri + strlen(DNS_AFPACKET_URI_PREFIX));
+    if (conf->input_defrag_memory > 0)
+        input->defrag = dns_defrag_create(conf);
+    if (conf->input_tcp_memory > 0)
+        input->tcp = dns_tcp_create(conf);
+    if (conf->input_dedup_window_sec > 0.0)
+        input->dedup = dns_dedup_create(conf);
 
     return input;
 }
@@ -69,7 +115,25 @@ dns_input_output_frame(struct dns_input *input)
     assert(input && input->frame);
     dns_input_report(input, 0);
     struct dns_packet_frame *new_frame = dns_packet_frame_create(input->frame->time_end, input->frame->time_end);
-    dns_frame_queue_enqueue(input->output, input->frame); // Hand over ownership
+    if (input->packet_arenas)
+        new_frame->arena = dns_packet_arena_create();
+
+    if (input->overload_shed && input->online && input->output) {
+        // We are the only producer, so the queue can only get emptier after the check
+        double occupancy = dns_frame_queue_occupancy(input->output);
+        if (occupancy >= 1.0) {
+            // Shed the whole frame, the following frames continue in time
+            input->current_shed_queue_full += input->frame->count;
+            dns_packet_frame_destroy(input->frame);
+            input->frame = NULL;
+        }
+        // Shed fraction grows linearly from 0 at overload_shed_start to 1 at full queue
+        double shed = (occupancy - input->overload_shed_start) / (1.0 - input->overload_shed_start);
+        input->shed_threshold = (uint64_t)(MIN(MAX(shed, 0.0), 1.0) * (double)(1ULL << 32));
+    }
+
+    if (input->frame)
+        dns_frame_queue_enqueue(input->output, input->frame); // Hand over ownership
     input->frame = new_frame;
 }
 
@@ -103,6 +167,9 @@ dns_input_finish(struct dns_input *input)
 {
     assert(input && input->frame);
 
+    // Release all the held back packets
+    if (input->reorder_count > 0)
+        dns_input_reorder_release(input, input->reorder_newest);
     dns_input_output_frame(input);
 
     // One final empty frame
@@ -122,6 +189,16 @@ dns_input_destroy(struct dns_input *input)
 
     if (input->dumper)
         dns_dump_destroy(input->dumper);
+    if (input->afpacket)
+        dns_afpacket_destroy(input->afpacket);
+    if (input->defrag)
+        dns_defrag_destroy(input->defrag);
+    if (input->tcp)
+        dns_tcp_destroy(input->tcp);
+    if (input->dedup)
+        dns_dedup_destroy(input->dedup);
+    assert(input->reorder_count == 0);
+    free(input->reorder_heap);
     if (input->bpf_string)
         free(input->bpf_string);
     if (input->uri)
@@ -234,6 +311,52 @@ dns_input_trace_open(struct dns_input *input)
     return DNS_RET_OK;
 }
 
+/**
+ * Create the packet from the decoded network data (`r` being the decoding result) and append it
+ * to the frame, unless it is a duplicate. Leaves the DNS parsing to the parsers when deferred.
+ */
+static dns_ret_t
+dns_input_add_net(struct dns_input *input, dns_ret_t r, struct dns_packet_net *net)
+{
+    if (r != DNS_RET_OK)
+        return r;
+    if (input->dedup && dns_dedup_check(input->dedup, net))
+        return DNS_RET_OK;
+    struct dns_packet *pkt = NULL;
+    if (input->defer_parse)
+        r = dns_packet_create_unparsed(net, &pkt, input->frame->arena);
+    else
+        r = dns_packet_create_from_net(net, &pkt, input->frame->arena, input->fields, input->compact_packets);
+    if (r != DNS_RET_OK)
+        return r;
+    assert(pkt != NULL);
+    dns_input_append_packet(input, pkt);
+    return DNS_RET_OK;
+}
+
+/**
+ * Process the decoded network data (`r` being the decoding result), reassembling the IP fragments
+ * and the TCP streams, appending the resulting packets to the frame. Returns the drop reason
+ * when the data are dropped. With the TCP reassembly, the TCP segments are never reported
+ * as dropped (not even with invalid messages), as they may carry several messages.
+ */
+static dns_ret_t
+dns_input_process_net(struct dns_input *input, dns_ret_t r, struct dns_packet_net *net)
+{
+    if (r == DNS_RET_DROP_FRAGMENTED && input->defrag)
+        r = dns_defrag_add(input->defrag, net);
+    // `net->tcp` is set whenever the transport was decoded (successfully or not)
+    if (input->tcp && (r == DNS_RET_OK || r == DNS_RET_DROP_TRANSPORT) &&
+        net->protocol == IPPROTO_TCP && net->tcp.data) {
+        struct dns_packet_net message;
+        dns_tcp_add(input->tcp, net);
+        while (dns_tcp_next(input->tcp, &message) == DNS_RET_OK)
+            dns_input_add_net(input, DNS_RET_OK, &message);
+        return DNS_RET_OK;
+    }
+    return dns_input_add_net(input, r, net);
+}
+
 /**
  * Read and process the packet just read from an input trace.
  */
@@ -242,8 +365,9 @@ dns_input_process_read_packet(struct dns_input *input)
 {
     input->current_packets_read += 1;
     input->current_bytes_read += trace_get_wire_length(input->packet);
-    struct dns_packet *pkt = NULL;
-    dns_ret_t r = dns_packet_create_from_libtrace(input->packet, &pkt);
+    struct dns_packet_net net;
+    dns_ret_t r = dns_packet_net_from_libtrace(input->packet, &net);
+    r = dns_input_process_net(input, r, &net);
     if (r != DNS_RET_OK) {
         if (input->dumper)
             if (dns_dump_packet(input->dumper, input->packet, r) != DNS_RET_OK) {
@@ -251,16 +375,97 @@ dns_input_process_read_packet(struct dns_input *input)
                 dns_dump_destroy(input->dumper);
                 input->dumper = NULL;
             }
-        return DNS_RET_OK;
     }
-    assert(pkt != NULL);
+    return DNS_RET_OK;
+}
 
+/**
+ * Append a packet to the current frame, advancing the time.
+ */
+static void
+dns_input_emit_packet(struct dns_input *input, struct dns_packet *pkt)
+{
     dns_input_advance_time_to(input, pkt->ts);
     if ((input->frame->count > 0) && (input->frame->size + pkt->memory_size > input->frame_max_size)) {
         dns_input_output_frame(input);
     }
     dns_packet_frame_append_packet(input->frame, pkt);
-    return DNS_RET_OK;
+}
+
+/**
+ * Append all the held back packets up to the given time to the frames, in time order.
+ */
+static void
+dns_input_reorder_release(struct dns_input *input, dns_us_time_t time)
+{
+    while (input->reorder_count > 0 && input->reorder_heap[1].ts <= time) {
+        struct dns_packet *pkt = input->reorder_heap[1].pkt;
+        input->reorder_released = input->reorder_heap[1].ts;
+        HEAP_DELETE_MIN(struct dns_input_reorder_item, input->reorder_heap, input->reorder_count,
+                        DNS_INPUT_REORDER_LESS, HEAP_SWAP);
+        dns_input_emit_packet(input, pkt);
+    }
+}
+
+/**
+ * Overload shedding by the flow hash, so a request and its response are shed together.
+ * Returns 1 (destroying the packet) when the packet is shed.
+ */
+static int
+dns_input_shed_packet(struct dns_input *input, struct dns_packet *pkt)
+{
+    if ((pkt->key_hash >> 32) < input->shed_threshold) {
+        input->current_shed_sampled ++;
+        dns_packet_destroy(pkt);
+        return 1;
+    }
+    return 0;
+}
+
+/**
+ * Hold the packet back in the reorder heap until released by `dns_input_reorder_release()`,
+ * counting it as late when it is older than an already released packet.
+ * In-order packets cost a constant time heap insertion.
+ */
+static void
+dns_input_reorder_hold(struct dns_input *input, struct dns_packet *pkt)
+{
+    if (input->reorder_released != DNS_NO_TIME && pkt->ts < input->reorder_released)
+        input->total_reorder_late ++;
+    if (input->reorder_newest == DNS_NO_TIME || pkt->ts > input->reorder_newest)
+        input->reorder_newest = pkt->ts;
+
+    // The heap is indexed from 1
+    if (input->reorder_count + 1 >= input->reorder_capacity) {
+        input->reorder_capacity = MAX(2 * input->reorder_capacity, 64);
+        input->reorder_heap = xrealloc(input->reorder_heap,
+                                       input->reorder_capacity * sizeof(struct dns_input_reorder_item));
+    }
+    struct dns_input_reorder_item item = { .ts = pkt->ts, .seq = input->reorder_seq ++, .pkt = pkt };
+    HEAP_INSERT(struct dns_input_reorder_item, input->reorder_heap, input->reorder_count,
+                DNS_INPUT_REORDER_LESS, HEAP_SWAP, item);
+}
+
+/**
+ * Append a parsed packet to the current frame (unless shed), advancing the time.
+ * With the time reordering, the packet is held back until a packet newer by the window
+ * arrives (or the time advances past it otherwise), releasing the older packets in time order.
+ */
+static void
+dns_input_append_packet(struct dns_input *input, struct dns_packet *pkt)
+{
+    if (dns_input_shed_packet(input, pkt))
+        return;
+
+    if (input->reorder_window == 0) {
+        dns_input_emit_packet(input, pkt);
+        return;
+    }
+
+    if (input->reorder_newest != DNS_NO_TIME && pkt->ts < input->reorder_newest)
+        input->total_reordered ++;
+    dns_input_reorder_hold(input, pkt);
+    dns_input_reorder_release(input, input->reorder_newest - input->reorder_window);
 }
 
 /**
@@ -274,6 +479,7 @@ dns_input_process_catch_real_time(struct dns_input *input)
     if (input->online) {
         dns_us_time_t now_us = dns_current_us_time();
         if (now_us > input->frame->time_end + input->real_time_grace) {
+            dns_input_reorder_release(input, now_us - input->real_time_grace);
             dns_input_advance_time_to(input, now_us - input->real_time_grace);
         }
     }
@@ -295,6 +501,9 @@ dns_input_report(struct dns_input *input, int force)
         if (input->current_packets_dropped == UINT64_MAX)
             input->current_packets_dropped = 0;
     }
+    if (input->afpacket)
+        dns_afpacket_take_stats(input->afpacket, &input->current_packets_read,
+                                &input->current_bytes_read, &input->current_packets_dropped);
 
 #define DOSTAT(stat) \
     double rate_ ## stat = 0.0; \
@@ -306,6 +515,8 @@ dns_input_report(struct dns_input *input, int force)
     DOSTAT(packets_read);
     DOSTAT(bytes_read);
     DOSTAT(packets_dropped);
+    DOSTAT(shed_sampled);
+    DOSTAT(shed_queue_full);
 
     msg(L_INFO, "input: %"PRIu64" (%.3lg/s) packets, %"PRIu64" (%.3lg/s) bytes, %"PRIu64" (%.3lg/s) dropped",
         input->current_packets_read, rate_packets_read,
@@ -313,6 +524,25 @@ dns_input_report(struct dns_input *input, int force)
         input->current_packets_dropped, rate_packets_dropped);
     msg(L_INFO, "input totals: %"PRIu64" packets, %"PRIu64" bytes, %"PRIu64" dropped",
         input->total_packets_read, input->total_bytes_read, input->total_packets_dropped);
+    if (input->overload_shed) {
+        msg(L_INFO, "input shed: %"PRIu64" (%.3lg/s) sampled, %"PRIu64" (%.3lg/s) in frames on full queue, now shedding %.1lf%%",
+            input->current_shed_sampled, rate_shed_sampled,
+            input->current_shed_queue_full, rate_shed_queue_full,
+            100.0 * input->shed_threshold / (double)(1ULL << 32));
+        msg(L_INFO, "input shed totals: %"PRIu64" sampled, %"PRIu64" in frames on full queue",
+            input->total_shed_sampled, input->total_shed_queue_full);
+    }
+    if (input->reorder_window > 0)
+        msg(L_INFO, "input reorder: %"PRIu64" packets reordered, %"PRIu64" later than the window, %zu held back",
+            input->total_reordered, input->total_reorder_late, input->reorder_count);
+    if (input->defrag)
+        dns_defrag_report(input->defrag, "input");
+    if (input->tcp)
+        dns_tcp_report(input->tcp, "input");
+    if (input->dedup)
+        dns_dedup_report(input->dedup, "input");
+    if (input->output)
+        dns_frame_queue_report(input->output, "input-matcher");
     if (input->online && input->frame) {
         msg(L_INFO, "input is %.3lf s behind real time (with %.3lf s grace time)",
             dns_us_time_to_fsec(now - input->frame->time_end),
@@ -322,96 +552,312 @@ dns_input_report(struct dns_input *input, int force)
     input->current_packets_read = 0;
     input->current_bytes_read = 0;
     input->current_packets_dropped = 0;
+    input->current_shed_sampled = 0;
+    input->current_shed_queue_full = 0;
 
     input->last_report_time = now;
 #undef DOSTAT
 }
 
-dns_ret_t
-dns_input_process(struct dns_input *input, const char *offline_uri)
+/**
+ * Append all the captured packets that can not be preceded by any future packet
+ * of the capture threads to the input frames, in time order.
+ * Any future packet of a thread comes at the end time of its last frame or later,
+ * up to the reorder window earlier (the parts of the threads are only nearly in time
+ * order), so packets strictly before the minimum of such times over all the running
+ * threads less the window are safe to release. All the pending packets are merged
+ * in the reorder heap, `newest` being the time of the newest packet of every thread.
+ */
+static void
+dns_input_afpacket_release(struct dns_input *input, clist *pending, dns_us_time_t *progress,
+                           dns_us_time_t *newest, int *finished)
 {
-    assert((!!input->online) == (!offline_uri));
+    int all_finished = 1;
+    dns_us_time_t watermark = DNS_NO_TIME;
+    for (int i = 0; i < input->afpacket->count; i++) {
+        if (finished[i])
+            continue;
+        all_finished = 0;
+        if (progress[i] == DNS_NO_TIME)
+            return; // Nothing known about this thread yet
+        if (watermark == DNS_NO_TIME || progress[i] < watermark)
+            watermark = progress[i];
+    }
 
-    dns_ret_t r;
-    libtrace_eventobj_t ev;
-    fd_set rfds;
+    for (int i = 0; i < input->afpacket->count; i++) {
+        struct dns_packet *pkt;
+        while ((pkt = clist_remove_head(&pending[i]))) {
+            if (dns_input_shed_packet(input, pkt))
+                continue;
+            if (newest[i] != DNS_NO_TIME && pkt->ts < newest[i])
+                input->total_reordered ++;
+            else
+                newest[i] = pkt->ts;
+            dns_input_reorder_hold(input, pkt);
+        }
+    }
 
-    if (!input->online) {
-        if (input->uri)
-            free(input->uri);
-        input->uri = strdup(offline_uri);
-        msg(L_INFO, "Processing offline input %s", input->uri);
+    if (all_finished) {
+        dns_input_reorder_release(input, input->reorder_newest);
     } else {
-        msg(L_INFO, "Processing online input %s", input->uri);
+        dns_input_reorder_release(input, watermark - input->reorder_window - 1);
+        dns_input_advance_time_to(input, watermark - input->reorder_window);
     }
-    
-    r = dns_input_trace_open(input);
-    if (r != DNS_RET_OK) {
+}
+
+/**
+ * Run the AF_PACKET capture threads and merge their packets into the input frames
+ * until all of them stop (on `dns_global_stop`).
+ */
+static dns_ret_t
+dns_input_process_afpacket(struct dns_input *input)
+{
+    struct dns_afpacket *afp = input->afpacket;
+    msg(L_INFO, "Processing online input %s", input->uri);
+    if (input->dumper)
+        msg(L_WARN, "Packet dumping is not supported with AF_PACKET capture, not dumping any packets");
+
+    if (dns_afpacket_open(afp) != DNS_RET_OK) {
         msg(L_ERROR, "Failed to open %s", input->uri);
-        return r;
+        return DNS_RET_ERR;
     }
 
     // Do not report immediatelly
     if (input->last_report_time == DNS_NO_TIME)
         input->last_report_time = dns_current_us_time();
 
-    // Wake up at least twice per timeframe or once per second
-    dns_us_time_t max_sleep = MIN(input->frame_max_duration, dns_fsec_to_us_time(1.0));
+    clist *pending = xmalloc_zero(afp->count * sizeof(clist));
+    dns_us_time_t *progress = xmalloc_zero(afp->count * sizeof(dns_us_time_t));
+    dns_us_time_t *newest = xmalloc_zero(afp->count * sizeof(dns_us_time_t));
+    int *finished = xmalloc_zero(afp->count * sizeof(int));
+    for (int i = 0; i < afp->count; i++) {
+        clist_init(&pending[i]);
+        progress[i] = DNS_NO_TIME;
+        newest[i] = DNS_NO_TIME;
+    }
 
-    // Online event loop
-    while (1) {
+    dns_afpacket_start(afp);
+    int running_threads = afp->count;
+    while (running_threads > 0) {
+        struct dns_packet_frame *f = dns_frame_queue_dequeue(afp->out);
+        int i = f->shard;
+        assert(i >= 0 && i < afp->count && !finished[i]);
+        if (f->type == 1) {
+            finished[i] = 1;
+            running_threads --;
+        }
+        clist_add_list_tail(&pending[i], &f->packets);
+        f->count = 0;
+        progress[i] = f->time_end;
+        dns_packet_frame_destroy(f);
+        dns_input_afpacket_release(input, pending, progress, newest, finished);
+        dns_input_report(input, 0);
+    }
+    dns_afpacket_finish(afp);
+
+    msg(L_INFO, "Interrupted reading input %s", input->uri);
+    dns_input_report(input, 1);
+    for (int i = 0; i < afp->count; i++)
+        assert(clist_empty(&pending[i]));
+    free(pending);
+    free(progress);
+    free(newest);
+    free(finished);
+    return DNS_RET_OK;
+}
 
+/**
+ * Read all the packets of an offline file with the native reader.
+ */
+static dns_ret_t
+dns_input_process_pcap(struct dns_input *input, struct dns_pcap_reader *reader)
+{
+    // Do not report immediatelly
+    if (input->last_report_time == DNS_NO_TIME)
+        input->last_report_time = dns_current_us_time();
+
+    struct dns_pcap_record rec;
+    dns_ret_t r;
+    while (1) {
         if (dns_global_stop) {
             msg(L_INFO, "Interrupted reading input %s", input->uri);
-            dns_input_report(input, 1);
-            dns_input_trace_close(input);
-            return DNS_RET_OK;
+            r = DNS_RET_OK;
+            break;
+        }
+        r = dns_pcap_reader_next(reader, &rec);
+        if (r != DNS_RET_OK) {
+            if (r == DNS_RET_EOF) {
+                msg(L_DEBUG, "Reading '%s' terminated", input->uri);
+                r = DNS_RET_OK;
+            }
+            break;
         }
 
-        ev = trace_event(input->trace, input->packet);
-        switch (ev.type) {
+        input->current_packets_read += 1;
+        input->current_bytes_read += rec.wirelen;
+        // The packet data are decoded in place, only the DNS data are copied
+        struct dns_packet_net net;
+        net.ts = rec.ts;
+        net.wire_size = rec.wirelen;
+        dns_input_process_net(input, dns_packet_decode_dlt(rec.linktype, rec.data, rec.caplen, &net), &net);
+    }
+    dns_input_report(input, 1);
+    dns_pcap_reader_destroy(reader);
+    return r;
+}
 
-        case TRACE_EVENT_PACKET:
-            dns_input_process_read_packet(input);
+/**
+ * Arm the timer to the deadline of the current frame, when it is to be closed
+ * by `dns_input_process_catch_real_time()` (with no packets arriving).
+ */
+static void
+dns_input_arm_frame_timer(struct dns_input *input, int timer_fd)
+{
+    dns_us_time_t deadline = input->frame->time_start + input->frame_max_duration + input->real_time_grace;
+    struct itimerspec its = {
+        .it_interval = { 0, 0 },
+        .it_value = { .tv_sec = deadline / 1000000, .tv_nsec = (deadline % 1000000) * 1000 },
+    };
+    if (timerfd_settime(timer_fd, TFD_TIMER_ABSTIME, &its, NULL) < 0)
+        die("timerfd_settime failed: %s", strerror(errno));
+}
+
+/**
+ * Process the events of the open trace until it terminates or `dns_global_stop` is set.
+ *
+ * Every wakeup drains all the packets available without blocking (with no system calls
+ * or clock reads of our own per packet). When the trace would block, the input waits in
+ * `epoll_wait()` for the trace file descriptor and, when online, a timerfd armed to the
+ * deadline of the current frame, so the frames are closed on schedule when idle.
+ */
+static dns_ret_t
+dns_input_process_trace_events(struct dns_input *input)
+{
+    dns_ret_t r = DNS_RET_OK;
+    int epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    int timer_fd = timerfd_create(CLOCK_REALTIME, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (epoll_fd < 0 || timer_fd < 0)
+        die("Creating the input epoll and timer failed: %s", strerror(errno));
+    struct epoll_event event = { .events = EPOLLIN, .data.fd = timer_fd };
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, timer_fd, &event) < 0)
+        die("epoll_ctl on the input timer failed: %s", strerror(errno));
+    int trace_fd = -1;
+
+    while (1) {
+
+        if (dns_global_stop) {
+            msg(L_INFO, "Interrupted reading input %s", input->uri);
             break;
+        }
+
+        libtrace_eventobj_t ev = trace_event(input->trace, input->packet);
+        if (ev.type == TRACE_EVENT_PACKET) {
+            dns_input_process_read_packet(input);
+            continue;
+        }
 
-        case TRACE_EVENT_TERMINATE:
+        if (ev.type == TRACE_EVENT_TERMINATE) {
             msg(L_DEBUG, "Reading '%s' terminated", input->uri);
             if (trace_is_err(input->trace)) {
                 trace_perror(input->trace, "trace terminated with error");
                 r = DNS_RET_ERR;
-            } else {
-                r = DNS_RET_OK;
             }
-            dns_input_report(input, 1);
-            dns_input_trace_close(input);
-            return r;
+            break;
+        }
+
+        if (ev.type != TRACE_EVENT_SLEEP && ev.type != TRACE_EVENT_IOWAIT)
+            die("Unknown trace event");
 
-        case TRACE_EVENT_SLEEP:
+        // Drained: close the frames due by now, then wait for the packets or the next frame deadline
+        int timeout_ms = -1;
+        if (ev.type == TRACE_EVENT_SLEEP) {
+            timeout_ms = (int)(ev.seconds * 1000.0) + 1;
+        } else if (ev.fd != trace_fd) {
+            if (trace_fd >= 0)
+                epoll_ctl(epoll_fd, EPOLL_CTL_DEL, trace_fd, NULL);
+            event.data.fd = ev.fd;
+            if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, ev.fd, &event) < 0) {
+                msg(L_ERROR, "epoll_ctl on trace: %s", strerror(errno));
+                r = DNS_RET_ERR;
+                break;
+            }
+            trace_fd = ev.fd;
+        }
+        if (input->online) {
             dns_input_process_catch_real_time(input);
-            usleep((useconds_t)(MIN(max_sleep, dns_fsec_to_us_time(ev.seconds))));
+            dns_input_arm_frame_timer(input, timer_fd);
+        }
+        struct epoll_event events[2];
+        int n = epoll_wait(epoll_fd, events, 2, timeout_ms);
+        if (n < 0 && errno != EINTR) {
+            msg(L_ERROR, "epoll_wait on trace: %s", strerror(errno));
+            r = DNS_RET_ERR;
             break;
+        }
+        for (int i = 0; i < n; i++) {
+            if (events[i].data.fd == timer_fd) {
+                uint64_t expirations;
+                if (read(timer_fd, &expirations, sizeof(expirations)) < 0 && errno != EAGAIN)
+                    die("Reading the input timer failed: %s", strerror(errno));
+                dns_input_process_catch_real_time(input);
+            }
+        }
+    }
 
-        case TRACE_EVENT_IOWAIT:
-            dns_input_process_catch_real_time(input);
-            FD_ZERO(&rfds);
-            FD_SET(ev.fd, &rfds);
-            struct timeval tv = { .tv_sec = max_sleep / 1000000, .tv_usec = max_sleep % 1000000};
-            int sr = select(ev.fd + 1, &rfds, NULL, NULL, &tv);
-            if (sr < 0) {
-                if (errno != EINTR) {
-                    perror("select on trace");
-                    dns_input_trace_close(input);
-                    return DNS_RET_ERR;
+    close(timer_fd);
+    close(epoll_fd);
+    dns_input_report(input, 1);
+    dns_input_trace_close(input);
+    return r;
+}
+
+dns_ret_t
+dns_input_process(struct dns_input *input, const char *offline_uri)
+{
+    assert((!!input->online) == (!offline_uri));
+
+    dns_ret_t r;
+
+    if (!input->online) {
+        if (input->uri)
+            free(input->uri);
+        input->uri = strdup(offline_uri);
+        msg(L_INFO, "Processing offline input %s", input->uri);
+        // Files of other formats and link types are left to libtrace
+        if (input->native_pcap && !input->dumper) {
+            const char *path = input->uri;
+            if (strncmp(path, DNS_INPUT_PCAPFILE_PREFIX, strlen(DNS_INPUT_PCAPFILE_PREFIX)) == 0)
+                path += strlen(DNS_INPUT_PCAPFILE_PREFIX);
+            struct dns_pcap_reader *reader = dns_pcap_reader_open(path, input->bpf_string, input->snaplen);
+            if (reader) {
+                if (input->offline_end > 0) {
+                    msg(L_INFO, "Reading bytes %zu-%zu of %s", input->offline_start, input->offline_end, input->uri);
+                    dns_pcap_reader_set_range(reader, input->offline_start, input->offline_end);
                 }
+                return dns_input_process_pcap(input, reader);
             }
-            break;
-
-        default:
-            die("Unknown trace event");
         }
+        if (input->offline_end > 0) {
+            msg(L_ERROR, "Failed to open %s for reading a part of it", input->uri);
+            return DNS_RET_ERR;
+        }
+    } else if (input->afpacket) {
+        return dns_input_process_afpacket(input);
+    } else {
+        msg(L_INFO, "Processing online input %s", input->uri);
+    }
+    
+    r = dns_input_trace_open(input);
+    if (r != DNS_RET_OK) {
+        msg(L_ERROR, "Failed to open %s", input->uri);
+        return r;
     }
-    die("Edge of the world!");
+
+    // Do not report immediatelly
+    if (input->last_report_time == DNS_NO_TIME)
+        input->last_report_time = dns_current_us_time();
+
+    return dns_input_process_trace_events(input);
 }
 
 
@@ -31,6 +31,24 @@
 #include "dump.h"
 #include "packet.h"
 
+struct dns_afpacket;
+struct dns_defrag;
+struct dns_tcp;
+struct dns_dedup;
+
+/** The libtrace URI prefix of the offline files, stripped for the native pcap reader */
+#define DNS_INPUT_PCAPFILE_PREFIX "pcapfile:"
+
+/**
+ * A packet held back by the time reordering of the input.
+ */
+struct dns_input_reorder_item {
+    /** The packet time and the arrival order (for stable ordering of equal times) */
+    dns_us_time_t ts;
+    uint64_t seq;
+    struct dns_packet *pkt;
+};
+
 /**
  * Input configuration.
  */
@@ -59,10 +77,59 @@ struct dns_input {
     /** Maximum packet frame size in bytes */
     int frame_max_size;
 
+    /** Output fields, selects the data extracted from the parsed packets */
+    uint32_t fields;
+
+    /** Keep only the compact query record of every packet (see `dns_packet_create_from_libtrace()`) */
+    int compact_packets;
+
+    /** Allocate the packets of every frame from a per-frame arena (see `struct dns_packet_arena`) */
+    int packet_arenas;
+
+    /** Leave the DNS parsing to `struct dns_worker_packet_parsers`, only creating unparsed packets
+     * (see `dns_packet_create_unparsed()`). Not used when dumping, which needs the parse result. */
+    int defer_parse;
+
+    /** Read offline pcap and pcapng files with `struct dns_pcap_reader` instead of libtrace
+     * (unless dumping, which needs libtrace packets) */
+    int native_pcap;
+
+    /** Byte range of the offline file to read with the native reader
+     * (see `dns_pcap_reader_set_range()`), both 0 to read the whole file. */
+    size_t offline_start, offline_end;
+
+    /** Shed load instead of blocking on a full output queue when online (`DNS_OVERLOAD_SHED`) */
+    int overload_shed;
+
+    /** Output queue fill level to start shedding at */
+    double overload_shed_start;
+
+    /** Packets with the upper 32 bits of `key_hash` below this are shed (0 to keep all, up to 2^32).
+     * Updated on every frame output from the output queue fill level. */
+    uint64_t shed_threshold;
+
     /** Grace time to lag behind real time when online
      * (does not apply when there are packets to read). */
     dns_us_time_t real_time_grace;
 
+    /** Time reordering window, 0 when disabled. Packets are held back until a packet
+     * newer by the window arrives, so the packets captured slightly out of order
+     * (e.g. a response timestamped before its request) reach the matcher in time order. */
+    dns_us_time_t reorder_window;
+
+    /** The held back packets, a binary min-heap by time in `reorder_heap[1..reorder_count]`
+     * (`reorder_capacity` items allocated). Owned, with the packets. */
+    struct dns_input_reorder_item *reorder_heap;
+    size_t reorder_count, reorder_capacity;
+
+    /** Time of the newest packet and of the last released packet, the arrival counter */
+    dns_us_time_t reorder_newest, reorder_released;
+    uint64_t reorder_seq;
+
+    /** Packets arriving out of order, and those later than the window (released immediately) */
+    uint64_t total_reordered;
+    uint64_t total_reorder_late;
+
     int report_period_sec;
     dns_us_time_t last_report_time;
     uint64_t total_packets_dropped;
@@ -71,6 +138,12 @@ struct dns_input {
     uint64_t current_packets_dropped;
     uint64_t current_packets_read;
     uint64_t current_bytes_read;
+    /** Packets shed by sampling under overload */
+    uint64_t total_shed_sampled;
+    uint64_t current_shed_sampled;
+    /** Packets shed in whole frames on a full output queue */
+    uint64_t total_shed_queue_full;
+    uint64_t current_shed_queue_full;
 
     /** BPF compiled filter. Owned by the input. */
     libtrace_filter_t *bpf_filter;
@@ -91,8 +164,30 @@ struct dns_input {
 
     /** Configured dumper (owned by the input) or NULL */
     struct dns_dump *dumper;
+
+    /** IP fragment reassembly table (owned by the input), NULL when disabled.
+     * Not used by the AF_PACKET capture, which has a table per capture thread. */
+    struct dns_defrag *defrag;
+
+    /** TCP stream reassembly table (owned by the input), NULL when disabled. */
+    struct dns_tcp *tcp;
+
+    /** Duplicate packet filter (owned by the input), NULL when disabled. */
+    struct dns_dedup *dedup;
+
+    /** Multi-threaded AF_PACKET capture (owned by the input) when `uri` has the
+     * `DNS_AFPACKET_URI_PREFIX`, NULL otherwise. Used for online input only. */
+    struct dns_afpacket *afpacket;
 };
 
+/**
+ * Whether the configured input keeps state across the packets that would be lost
+ * when a trace is read in several independent parts (files or chunks): the IP and TCP
+ * reassembly, the time reordering or the deduplication.
+ */
+int
+dns_input_keeps_state(const struct dns_config *conf);
+
 /**
  * Allocate and initialize the input, allocate a frame,
  * create dumper if path configured.
@@ -119,6 +214,10 @@ dns_input_destroy(struct dns_input *input);
  * Opens a live or offline trace and runs the packet processing loop.
  * For online input, input->uri is used and set offline_uri=NULL.
  * For offline input, offline_uri specifies the file to process.
+ * An online AF_PACKET capture merges the packets of the capture threads
+ * in time order, lagging behind the slowest thread by the reorder window. Other traces are drained
+ * of all the available packets on every wakeup, waiting in epoll for more packets
+ * or the deadline of the current frame (closing it on schedule when idle).
  */
 dns_ret_t
 dns_input_process(struct dns_input *input, const char *offline_uri);
@@ -0,0 +1,475 @@
+/*
+ *  Copyright (C) 2016 CZ.NIC, z.s.p.o.
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <net/if.h>
+#include <net/if_arp.h>
+#include <arpa/inet.h>
+#include <linux/if_packet.h>
+#include <linux/if_ether.h>
+#include <linux/filter.h>
+#include <pcap/pcap.h>
+
+#include "input_afpacket.h"
+#include "packet_frame.h"
+#include "packet_arena.h"
+#include "frame_queue.h"
+#include "packet.h"
+#include "packet_decode.h"
+#include "packet_defrag.h"
+#include "packet_tcp.h"
+#include "packet_dedup.h"
+
+/** Nominal ring frame size, TPACKET_V3 packs the packets in the blocks regardless of it */
+#define DNS_AFPACKET_FRAME_SIZE 2048
+
+/** Timeout after which the kernel hands over a partially filled block */
+#define DNS_AFPACKET_BLOCK_TIMEOUT_MS 10
+
+/** Snaplen of the compiled BPF filter when not limited by `input_snaplen` */
+#define DNS_AFPACKET_MAX_SNAPLEN 262144
+
+struct dns_afpacket *
+dns_afpacket_create(struct dns_config *conf, const char *ifname)
+{
+    struct dns_afpacket *afp = xmalloc_zero(sizeof(struct dns_afpacket));
+
+    afp->ifname = strdup(ifname);
+    afp->count = conf->input_afpacket_threads;
+    afp->block_size = conf->input_afpacket_block_size;
+    afp->block_count = conf->input_afpacket_blocks;
+    afp->fanout_id = getpid() & 0xffff;
+    afp->frame_max_duration = dns_fsec_to_us_time(conf->max_frame_duration_sec);
+    afp->frame_max_size = conf->max_frame_size;
+    afp->real_time_grace = dns_fsec_to_us_time(conf->input_real_time_grace_sec);
+    afp->snaplen = conf->input_snaplen;
+    afp->promisc = conf->input_promiscuous;
+    afp->bpf_string = strdup(conf->input_filter);
+    afp->fields = (conf->output_type == DNS_OUTPUT_TYPE_CBOR) ? conf->cbor_fields : conf->csv_fields;
+    afp->compact_packets = conf->input_compact_packets;
+    afp->defer_parse = conf->input_parse_threads > 0;
+    afp->packet_arenas = conf->input_packet_arenas;
+    pthread_mutex_init(&afp->running, NULL);
+
+    // All the threads output to one queue, merged by the input
+    afp->out = dns_frame_queue_create(conf->max_queue_len * afp->count, conf->max_queue_size * afp->count,
+                                      DNS_QUEUE_BLOCK);
+    afp->threads = xmalloc_zero(afp->count * sizeof(struct dns_afpacket_thread));
+    for (int i = 0; i < afp->count; i++) {
+        struct dns_afpacket_thread *t = &afp->threads[i];
+        t->afp = afp;
+        t->index = i;
+        t->fd = -1;
+        t->ring = NULL;
+        if (conf->input_defrag_memory > 0)
+            t->defrag = dns_defrag_create(conf);
+        if (conf->input_tcp_memory > 0)
+            t->tcp = dns_tcp_create(conf);
+        if (conf->input_dedup_window_sec > 0.0)
+            t->dedup = dns_dedup_create(conf);
+        atomic_init(&t->packets, 0);
+        atomic_init(&t->bytes, 0);
+    }
+    return afp;
+}
+
+void
+dns_afpacket_destroy(struct dns_afpacket *afp)
+{
+    if (pthread_mutex_trylock(&afp->running) != 0)
+        die("destroying a running AF_PACKET capture");
+    pthread_mutex_unlock(&afp->running);
+    pthread_mutex_destroy(&afp->running);
+    for (int i = 0; i < afp->count; i++) {
+        assert(afp->threads[i].fd < 0 && !afp->threads[i].frame);
+        if (afp->threads[i].defrag)
+            dns_defrag_destroy(afp->threads[i].defrag);
+        if (afp->threads[i].tcp)
+            dns_tcp_destroy(afp->threads[i].tcp);
+        if (afp->threads[i].dedup)
+            dns_dedup_destroy(afp->threads[i].dedup);
+    }
+    dns_frame_queue_destroy(afp->out);
+    free(afp->threads);
+    free(afp->bpf_string);
+    free(afp->ifname);
+    free(afp);
+}
+
+/**
+ * Close the socket and unmap the ring of the thread (if open).
+ */
+static void
+dns_afpacket_thread_close(struct dns_afpacket_thread *t)
+{
+    if (t->ring) {
+        munmap(t->ring, (size_t)t->afp->block_size * t->afp->block_count);
+        t->ring = NULL;
+    }
+    if (t->fd >= 0) {
+        close(t->fd);
+        t->fd = -1;
+    }
+}
+
+/**
+ * Compile the configured filter and attach it to the socket, so the kernel
+ * does not copy the unwanted packets into the ring at all.
+ */
+static dns_ret_t
+dns_afpacket_attach_filter(struct dns_afpacket_thread *t)
+{
+    struct dns_afpacket *afp = t->afp;
+    pcap_t *dead = pcap_open_dead(DLT_EN10MB, afp->snaplen > 0 ? afp->snaplen : DNS_AFPACKET_MAX_SNAPLEN);
+    if (!dead)
+        die("FATAL: libpcap allocation error!");
+
+    struct bpf_program prog;
+    if (pcap_compile(dead, &prog, afp->bpf_string, 1, PCAP_NETMASK_UNKNOWN) < 0) {
+        msg(L_FATAL, "Error compiling filter '%s': %s", afp->bpf_string, pcap_geterr(dead));
+        pcap_close(dead);
+        return DNS_RET_ERR;
+    }
+    // The BPF instructions of libpcap and the kernel have the same layout
+    struct sock_fprog fprog = { .len = prog.bf_len, .filter = (struct sock_filter *)prog.bf_insns };
+    int r = setsockopt(t->fd, SOL_SOCKET, SO_ATTACH_FILTER, &fprog, sizeof(fprog));
+    pcap_freecode(&prog);
+    pcap_close(dead);
+    if (r < 0) {
+        msg(L_FATAL, "Error attaching filter '%s' on '%s': %s", afp->bpf_string, afp->ifname, strerror(errno));
+        return DNS_RET_ERR;
+    }
+    return DNS_RET_OK;
+}
+
+/**
+ * Open the socket of the thread, set up its ring and join the fanout group.
+ * The socket does not receive any packets before it is set up and bound.
+ */
+static dns_ret_t
+dns_afpacket_thread_open(struct dns_afpacket_thread *t, int ifindex)
+{
+    struct dns_afpacket *afp = t->afp;
+    assert(t->fd < 0);
+
+#define CHECK(call, what) \
+    if ((call) < 0) { \
+        msg(L_FATAL, "AF_PACKET error %s on '%s': %s", (what), afp->ifname, strerror(errno)); \
+        dns_afpacket_thread_close(t); \
+        return DNS_RET_ERR; \
+    }
+
+    CHECK(t->fd = socket(AF_PACKET, SOCK_RAW, 0), "creating socket");
+
+    int version = TPACKET_V3;
+    CHECK(setsockopt(t->fd, SOL_PACKET, PACKET_VERSION, &version, sizeof(version)), "setting TPACKET_V3");
+
+    struct tpacket_req3 req = {
+        .tp_block_size = afp->block_size,
+        .tp_block_nr = afp->block_count,
+        .tp_frame_size = DNS_AFPACKET_FRAME_SIZE,
+        .tp_frame_nr = (afp->block_size / DNS_AFPACKET_FRAME_SIZE) * afp->block_count,
+        .tp_retire_blk_tov = DNS_AFPACKET_BLOCK_TIMEOUT_MS,
+        .tp_sizeof_priv = 0,
+        .tp_feature_req_word = 0,
+    };
+    CHECK(setsockopt(t->fd, SOL_PACKET, PACKET_RX_RING, &req, sizeof(req)), "setting up the ring");
+
+    size_t ring_size = (size_t)afp->block_size * afp->block_count;
+    void *ring = mmap(NULL, ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, t->fd, 0);
+    if (ring == MAP_FAILED) {
+        msg(L_FATAL, "AF_PACKET error mapping the ring of '%s': %s", afp->ifname, strerror(errno));
+        dns_afpacket_thread_close(t);
+        return DNS_RET_ERR;
+    }
+    t->ring = ring;
+
+    if (afp->bpf_string && strlen(afp->bpf_string) > 0) {
+        if (dns_afpacket_attach_filter(t) != DNS_RET_OK) {
+            dns_afpacket_thread_close(t);
+            return DNS_RET_ERR;
+        }
+    }
+
+    struct sockaddr_ll sll = {
+        .sll_family = AF_PACKET,
+        .sll_protocol = htons(ETH_P_ALL),
+        .sll_ifindex = ifindex,
+    };
+    CHECK(bind(t->fd, (struct sockaddr *)&sll, sizeof(sll)), "binding socket");
+
+    // Split the traffic by flow hash. The kernel defragments only IPv4 first, the IPv6 fragments
+    // are hashed without the ports so all the fragments of a packet still go to the same thread
+    int fanout = afp->fanout_id | ((PACKET_FANOUT_HASH | PACKET_FANOUT_FLAG_DEFRAG) << 16);
+    CHECK(setsockopt(t->fd, SOL_PACKET, PACKET_FANOUT, &fanout, sizeof(fanout)), "joining fanout group");
+
+    if (afp->promisc) {
+        struct packet_mreq mreq = { .mr_ifindex = ifindex, .mr_type = PACKET_MR_PROMISC };
+        CHECK(setsockopt(t->fd, SOL_PACKET, PACKET_ADD_MEMBERSHIP, &mreq, sizeof(mreq)), "setting promiscuous mode");
+    }
+#undef CHECK
+
+    return DNS_RET_OK;
+}
+
+dns_ret_t
+dns_afpacket_open(struct dns_afpacket *afp)
+{
+    int ifindex = if_nametoindex(afp->ifname);
+    if (ifindex == 0) {
+        msg(L_FATAL, "AF_PACKET capture interface '%s' not found: %s", afp->ifname, strerror(errno));
+        return DNS_RET_ERR;
+    }
+
+    for (int i = 0; i < afp->count; i++) {
+        if (dns_afpacket_thread_open(&afp->threads[i], ifindex) != DNS_RET_OK) {
+            for (int j = 0; j < i; j++)
+                dns_afpacket_thread_close(&afp->threads[j]);
+            return DNS_RET_ERR;
+        }
+    }
+
+    // Only Ethernet framing is decoded
+    struct sockaddr_ll sll;
+    socklen_t sll_len = sizeof(sll);
+    if (getsockname(afp->threads[0].fd, (struct sockaddr *)&sll, &sll_len) == 0 &&
+        sll.sll_hatype != ARPHRD_ETHER && sll.sll_hatype != ARPHRD_LOOPBACK) {
+        msg(L_FATAL, "AF_PACKET capture interface '%s' is not an Ethernet interface (type %d)",
+            afp->ifname, sll.sll_hatype);
+        for (int i = 0; i < afp->count; i++)
+            dns_afpacket_thread_close(&afp->threads[i]);
+        return DNS_RET_ERR;
+    }
+
+    msg(L_INFO, "AF_PACKET capture on '%s' with %d threads (fanout group %d, %d x %d B ring per thread)",
+        afp->ifname, afp->count, afp->fanout_id, afp->block_count, afp->block_size);
+    return DNS_RET_OK;
+}
+
+/**
+ * Outputs the current frame of the thread and creates a new one.
+ */
+static void
+dns_afpacket_thread_output_frame(struct dns_afpacket_thread *t)
+{
+    struct dns_packet_frame *new_frame = dns_packet_frame_create(t->frame->time_end, t->frame->time_end);
+    if (t->afp->packet_arenas)
+        new_frame->arena = dns_packet_arena_create();
+    t->frame->shard = t->index;
+    dns_frame_queue_enqueue(t->afp->out, t->frame); // Hand over ownership
+    t->frame = new_frame;
+}
+
+/**
+ * Output packet frames until the given time fits within the current frame,
+ * same as `dns_input_advance_time_to()`.
+ */
+static void
+dns_afpacket_thread_advance_time_to(struct dns_afpacket_thread *t, dns_us_time_t time)
+{
+    struct dns_afpacket *afp = t->afp;
+    if (t->frame->time_start == DNS_NO_TIME) {
+        t->frame->time_start = time;
+        t->frame->time_end = time;
+    }
+    while (time >= t->frame->time_start + afp->frame_max_duration) {
+        t->frame->time_end = t->frame->time_start + afp->frame_max_duration;
+        dns_afpacket_thread_output_frame(t);
+    }
+    t->frame->time_end = MAX(t->frame->time_end, time);
+}
+
+/**
+ * Create the packet from the decoded network data and append it to the thread frame,
+ * unless it is a duplicate (copies of a packet always come to the same thread).
+ */
+static void
+dns_afpacket_thread_add_net(struct dns_afpacket_thread *t, struct dns_packet_net *net)
+{
+    struct dns_afpacket *afp = t->afp;
+    if (t->dedup && dns_dedup_check(t->dedup, net))
+        return;
+    struct dns_packet *pkt = NULL;
+    dns_ret_t r;
+    if (afp->defer_parse)
+        r = dns_packet_create_unparsed(net, &pkt, t->frame->arena);
+    else
+        r = dns_packet_create_from_net(net, &pkt, t->frame->arena, afp->fields, afp->compact_packets);
+    if (r != DNS_RET_OK)
+        return;
+
+    dns_afpacket_thread_advance_time_to(t, pkt->ts);
+    if ((t->frame->count > 0) && (t->frame->size + pkt->memory_size > afp->frame_max_size))
+        dns_afpacket_thread_output_frame(t);
+    dns_packet_frame_append_packet(t->frame, pkt);
+}
+
+/**
+ * Parse one packet in place in the ring and append it to the thread frame
+ * (or the packet it completes, with the IP reassembly, or all the DNS messages
+ * it completes, with the TCP reassembly).
+ * Only the DNS data are copied (into the new packets).
+ */
+static void
+dns_afpacket_thread_process_packet(struct dns_afpacket_thread *t, const uint8_t *data,
+                                   uint32_t caplen, uint32_t wirelen, dns_us_time_t ts)
+{
+    struct dns_afpacket *afp = t->afp;
+    atomic_fetch_add_explicit(&t->packets, 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&t->bytes, wirelen, memory_order_relaxed);
+
+    if (afp->snaplen > 0)
+        caplen = MIN(caplen, (uint32_t)afp->snaplen);
+
+    struct dns_packet_net net;
+    dns_ret_t r = dns_packet_decode_ether(data, caplen, &net);
+    net.ts = ts;
+    net.wire_size = wirelen;
+    if (r == DNS_RET_DROP_FRAGMENTED && t->defrag)
+        r = dns_defrag_add(t->defrag, &net);
+    // The flows never change threads, as the kernel splits the traffic by the flow hash
+    if (t->tcp && (r == DNS_RET_OK || r == DNS_RET_DROP_TRANSPORT) &&
+        net.protocol == IPPROTO_TCP && net.tcp.data) {
+        struct dns_packet_net message;
+        dns_tcp_add(t->tcp, &net);
+        while (dns_tcp_next(t->tcp, &message) == DNS_RET_OK)
+            dns_afpacket_thread_add_net(t, &message);
+        return;
+    }
+    if (r == DNS_RET_OK)
+        dns_afpacket_thread_add_net(t, &net);
+}
+
+/**
+ * Process all the packets of a ring block handed over by the kernel.
+ * The block is returned to the kernel by the caller once all its packets are copied.
+ */
+static void
+dns_afpacket_thread_process_block(struct dns_afpacket_thread *t, struct tpacket_block_desc *bd)
+{
+    uint32_t num_pkts = bd->hdr.bh1.num_pkts;
+    uint8_t *p = (uint8_t *)bd + bd->hdr.bh1.offset_to_first_pkt;
+    for (uint32_t i = 0; i < num_pkts; i++) {
+        struct tpacket3_hdr *ph = (struct tpacket3_hdr *)p;
+        // The loopback delivers every packet twice, skip the outgoing copy (as libpcap does)
+        struct sockaddr_ll *sll = (struct sockaddr_ll *)(p + TPACKET_ALIGN(sizeof(struct tpacket3_hdr)));
+        if (sll->sll_pkttype != PACKET_OUTGOING || sll->sll_hatype != ARPHRD_LOOPBACK) {
+            dns_us_time_t ts = (dns_us_time_t)ph->tp_sec * 1000000 + ph->tp_nsec / 1000;
+            dns_afpacket_thread_process_packet(t, p + ph->tp_mac, ph->tp_snaplen, ph->tp_len, ts);
+        }
+        p += ph->tp_next_offset;
+    }
+}
+
+static void *
+dns_afpacket_thread_main(void *data)
+{
+    struct dns_afpacket_thread *t = data;
+    struct dns_afpacket *afp = t->afp;
+    unsigned int block = 0;
+
+    // Wake up at least twice per timeframe or once per second
+    int max_sleep_ms = MIN(afp->frame_max_duration, dns_fsec_to_us_time(1.0)) / 2000;
+    dns_afpacket_thread_advance_time_to(t, dns_current_us_time());
+
+    while (!dns_global_stop) {
+        struct tpacket_block_desc *bd = (struct tpacket_block_desc *)(t->ring + (size_t)block * afp->block_size);
+        if (!(__atomic_load_n(&bd->hdr.bh1.block_status, __ATOMIC_ACQUIRE) & TP_STATUS_USER)) {
+            struct pollfd pfd = { .fd = t->fd, .events = POLLIN | POLLERR };
+            if (poll(&pfd, 1, MAX(max_sleep_ms, 1)) < 0 && errno != EINTR)
+                die("poll on AF_PACKET socket failed: %s", strerror(errno));
+            // Idle: keep up with real time, so the merged stream does not wait for this thread
+            dns_us_time_t now = dns_current_us_time();
+            if (now > t->frame->time_end + afp->real_time_grace)
+                dns_afpacket_thread_advance_time_to(t, now - afp->real_time_grace);
+            continue;
+        }
+        dns_afpacket_thread_process_block(t, bd);
+        __atomic_store_n(&bd->hdr.bh1.block_status, TP_STATUS_KERNEL, __ATOMIC_RELEASE);
+        block = (block + 1) % afp->block_count;
+    }
+
+    dns_afpacket_thread_output_frame(t);
+    t->frame->type = 1;
+    t->frame->shard = t->index;
+    dns_frame_queue_enqueue(afp->out, t->frame);
+    t->frame = NULL;
+    return NULL;
+}
+
+void
+dns_afpacket_start(struct dns_afpacket *afp)
+{
+    if (pthread_mutex_trylock(&afp->running) != 0)
+        die("starting a running AF_PACKET capture");
+    for (int i = 0; i < afp->count; i++) {
+        struct dns_afpacket_thread *t = &afp->threads[i];
+        assert(t->fd >= 0 && !t->frame);
+        t->frame = dns_packet_frame_create(DNS_NO_TIME, DNS_NO_TIME);
+        if (afp->packet_arenas)
+            t->frame->arena = dns_packet_arena_create();
+        int r = pthread_create(&t->thread, NULL, dns_afpacket_thread_main, t);
+        assert(r == 0);
+    }
+    msg(L_DEBUG, "AF_PACKET capture threads started");
+}
+
+void
+dns_afpacket_finish(struct dns_afpacket *afp)
+{
+    for (int i = 0; i < afp->count; i++) {
+        int r = pthread_join(afp->threads[i].thread, NULL);
+        assert(r == 0);
+    }
+    pthread_mutex_unlock(&afp->running);
+    for (int i = 0; i < afp->count; i++) {
+        dns_afpacket_thread_close(&afp->threads[i]);
+        char name[32];
+        snprintf(name, sizeof(name), "capture %d", i);
+        if (afp->threads[i].defrag)
+            dns_defrag_report(afp->threads[i].defrag, name);
+        if (afp->threads[i].tcp)
+            dns_tcp_report(afp->threads[i].tcp, name);
+        if (afp->threads[i].dedup)
+            dns_dedup_report(afp->threads[i].dedup, name);
+    }
+    dns_frame_queue_report(afp->out, "capture-input");
+    msg(L_DEBUG, "AF_PACKET capture threads stopped and joined");
+}
+
+void
+dns_afpacket_take_stats(struct dns_afpacket *afp, uint64_t *packets, uint64_t *bytes, uint64_t *dropped)
+{
+    for (int i = 0; i < afp->count; i++) {
+        struct dns_afpacket_thread *t = &afp->threads[i];
+        *packets += atomic_exchange(&t->packets, 0);
+        *bytes += atomic_exchange(&t->bytes, 0);
+        // Reading the statistics resets the kernel counters
+        struct tpacket_stats_v3 st;
+        socklen_t len = sizeof(st);
+        if (t->fd >= 0 && getsockopt(t->fd, SOL_PACKET, PACKET_STATISTICS, &st, &len) == 0)
+            *dropped += st.tp_drops;
+    }
+}
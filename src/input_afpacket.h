@@ -0,0 +1,173 @@
+/*
+ *  Copyright (C) 2016 CZ.NIC, z.s.p.o.
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef DNSCOL_INPUT_AFPACKET_H
+#define DNSCOL_INPUT_AFPACKET_H
+
+/**
+ * \file input_afpacket.h
+ * Multi-threaded online capture from Linux AF_PACKET TPACKET_V3 rings.
+ */
+
+#include <stdatomic.h>
+#include <pthread.h>
+
+#include "common.h"
+#include "config.h"
+
+struct dns_frame_queue;
+struct dns_packet_frame;
+struct dns_afpacket;
+struct dns_defrag;
+struct dns_tcp;
+struct dns_dedup;
+
+/**
+ * One capture thread with its own socket and ring, a member of the fanout group.
+ */
+struct dns_afpacket_thread {
+    /** The owning capture */
+    struct dns_afpacket *afp;
+
+    /** Index of the thread, also set as `shard` of the produced frames */
+    int index;
+
+    /** The packet socket, -1 when not open */
+    int fd;
+
+    /** The mmapped TPACKET_V3 ring of `afp->block_count` blocks */
+    uint8_t *ring;
+
+    /** Currently filled frame, owned by the thread. */
+    struct dns_packet_frame *frame;
+
+    /** IP fragment reassembly table of the thread (owned), NULL when disabled. */
+    struct dns_defrag *defrag;
+
+    /** TCP stream reassembly table of the thread (owned), NULL when disabled. */
+    struct dns_tcp *tcp;
+
+    /** Duplicate packet filter of the thread (owned), NULL when disabled. */
+    struct dns_dedup *dedup;
+
+    /** Captured packets and bytes, taken and reset by `dns_afpacket_take_stats()` */
+    atomic_uint_fast64_t packets, bytes;
+
+    pthread_t thread;
+};
+
+/**
+ * AF_PACKET capture on one interface by `count` threads in a PACKET_FANOUT_HASH group.
+ *
+ * The kernel splits the traffic between the thread sockets by the flow hash
+ * (defragmenting IPv4 first, hashing IPv6 fragments without the ports), so every
+ * thread sees a part of the traffic (in time order up to the capture jitter) with all
+ * the fragments of a packet and reassembles the remaining (IPv6) fragments itself.
+ * Every thread decodes its packets in place in the ring (see `dns_packet_decode_ether()`),
+ * copying only the DNS data into frames of its own. It outputs them with `shard`
+ * set to the thread index into the common `out` queue. The time of the threads is
+ * advanced to real time while idle, so the consumer may merge the parts back into
+ * a single time-ordered stream (within the reorder window), see `dns_input_process()`.
+ */
+struct dns_afpacket {
+    /** Capture interface name, owned. */
+    char *ifname;
+
+    /** Number of capture threads */
+    int count;
+
+    /** The capture threads */
+    struct dns_afpacket_thread *threads;
+
+    /** Queue of the frames produced by all the threads, owned. */
+    struct dns_frame_queue *out;
+
+    /** PACKET_FANOUT group id */
+    int fanout_id;
+
+    /** Ring block size and count per thread */
+    int block_size, block_count;
+
+    /** Maximum packet frame duration */
+    dns_us_time_t frame_max_duration;
+
+    /** Maximum packet frame size in bytes */
+    int frame_max_size;
+
+    /** Grace time to lag behind real time when idle */
+    dns_us_time_t real_time_grace;
+
+    /** Length of wire packet capture, -1 for no limit */
+    int snaplen;
+
+    /** Promiscuous mode for the interface */
+    int promisc;
+
+    /** BPF filter string, compiled into a kernel socket filter. Owned. */
+    char *bpf_string;
+
+    /** Parsing options, see `struct dns_input` */
+    uint32_t fields;
+    int compact_packets;
+    int packet_arenas;
+    int defer_parse;
+
+    /** The mutex indicating that the threads are started and running. */
+    pthread_mutex_t running;
+};
+
+/**
+ * Allocate and configure the capture of `ifname`, does not open any sockets yet.
+ * The output queue is owned by the capture.
+ */
+struct dns_afpacket *
+dns_afpacket_create(struct dns_config *conf, const char *ifname);
+
+/**
+ * Open the sockets and rings of all the threads and join the fanout group.
+ * Returns DNS_RET_ERR (with a message logged) on any error.
+ */
+dns_ret_t
+dns_afpacket_open(struct dns_afpacket *afp);
+
+/**
+ * Start the capture threads, the sockets must be open. The threads run
+ * until `dns_global_stop` is set, then output their last frame and a final frame.
+ */
+void
+dns_afpacket_start(struct dns_afpacket *afp);
+
+/**
+ * Wait for all the capture threads to stop and close the sockets.
+ */
+void
+dns_afpacket_finish(struct dns_afpacket *afp);
+
+/**
+ * Free the capture struct, the threads must not be running!
+ */
+void
+dns_afpacket_destroy(struct dns_afpacket *afp);
+
+/**
+ * Add the packets and bytes captured and the packets dropped by the kernel
+ * since the last call to the given counters.
+ */
+void
+dns_afpacket_take_stats(struct dns_afpacket *afp, uint64_t *packets, uint64_t *bytes, uint64_t *dropped);
+
+#endif /* DNSCOL_INPUT_AFPACKET_H */
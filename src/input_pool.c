@@ -0,0 +1,170 @@
+/* 
+ *  Copyright (C) 2016 CZ.NIC, z.s.p.o.
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "input_pool.h"
+#include "input.h"
+#include "frame_queue.h"
+#include "packet_frame.h"
+#include "pcap_reader.h"
+
+struct dns_input_pool *
+dns_input_pool_create(struct dns_config *conf, char **files, int file_count, struct dns_frame_queue *out)
+{
+    assert(conf->input_offline_threads >= 1 && out);
+    // The jobs start with empty reassembly and reorder buffers, see `main()`
+    assert(!dns_input_keeps_state(conf));
+    struct dns_input_pool *pool = xmalloc_zero(sizeof(struct dns_input_pool));
+    pool->conf = conf;
+    pool->out = out;
+
+    // Whole files, or chunks of the large ones
+    for (int f = 0; f < file_count; f++) {
+        size_t *bounds = NULL;
+        int chunks = 0;
+        if (conf->input_native_pcap && conf->input_offline_chunk_size > 0) {
+            struct dns_pcap_reader *reader = dns_pcap_reader_open(files[f], "", -1);
+            if (reader) {
+                chunks = dns_pcap_reader_split(reader, conf->input_offline_chunk_size, &bounds);
+                dns_pcap_reader_destroy(reader);
+            }
+        }
+        if (chunks > 1)
+            msg(L_INFO, "Reading %s in %d chunks", files[f], chunks);
+        else
+            chunks = 1;
+        pool->jobs = xrealloc(pool->jobs, (pool->job_count + chunks) * sizeof(struct dns_input_pool_job));
+        for (int i = 0; i < chunks; i++) {
+            struct dns_input_pool_job *job = &pool->jobs[pool->job_count++];
+            job->path = files[f];
+            job->start = bounds ? bounds[i] : 0;
+            job->end = bounds ? bounds[i + 1] : 0;
+        }
+        free(bounds);
+    }
+    pool->count = MIN(conf->input_offline_threads, MAX(pool->job_count, 1));
+    pthread_mutex_init(&pool->running, NULL);
+
+    pool->queues = xmalloc_zero(pool->count * sizeof(struct dns_frame_queue *));
+    pool->threads = xmalloc_zero(pool->count * sizeof(pthread_t));
+    for (int i = 0; i < pool->count; i++) {
+        pool->queues[i] = dns_frame_queue_create_spsc(conf->max_queue_len, conf->max_queue_size, DNS_QUEUE_BLOCK);
+    }
+    return pool;
+}
+
+void
+dns_input_pool_destroy(struct dns_input_pool *pool)
+{
+    if (pthread_mutex_trylock(&pool->running) != 0)
+        die("destroying a running input pool");
+    pthread_mutex_unlock(&pool->running);
+    pthread_mutex_destroy(&pool->running);
+    for (int i = 0; i < pool->count; i++)
+        dns_frame_queue_destroy(pool->queues[i]);
+    free(pool->queues);
+    free(pool->jobs);
+    free(pool->threads);
+    free(pool);
+}
+
+/**
+ * Thread argument: the pool and the thread index.
+ */
+struct dns_input_pool_thread {
+    struct dns_input_pool *pool;
+    int index;
+};
+
+/**
+ * Read the jobs of the thread one by one, each with a new input
+ * ending with its final frame.
+ */
+static void*
+dns_input_pool_main(void *data)
+{
+    struct dns_input_pool_thread *t = data;
+    struct dns_input_pool *pool = t->pool;
+    for (int j = t->index; j < pool->job_count; j += pool->count) {
+        struct dns_input *input = dns_input_create(pool->conf, pool->queues[t->index]);
+        input->offline_start = pool->jobs[j].start;
+        input->offline_end = pool->jobs[j].end;
+        if (!dns_global_stop) {
+            char fn[1024];
+            snprintf(fn, sizeof(fn), "%s%s", DNS_INPUT_PCAPFILE_PREFIX, pool->jobs[j].path);
+            dns_ret_t r = dns_input_process(input, fn);
+            if (r != DNS_RET_OK)
+                msg(L_ERROR, "Processing of '%s' unsuccesfull (code %d)", fn, r);
+        }
+        // The final frame marks the end of the file for the consumer
+        dns_input_finish(input);
+        dns_input_destroy(input);
+    }
+    free(t);
+    return NULL;
+}
+
+void
+dns_input_pool_start(struct dns_input_pool *pool)
+{
+    if (pthread_mutex_trylock(&pool->running) != 0)
+        die("starting a running input pool");
+    for (int i = 0; i < pool->count; i++) {
+        struct dns_input_pool_thread *t = xmalloc_zero(sizeof(struct dns_input_pool_thread));
+        t->pool = pool;
+        t->index = i;
+        int r = pthread_create(&pool->threads[i], NULL, dns_input_pool_main, t);
+        assert(r == 0);
+    }
+    msg(L_DEBUG, "Input pool started (%d threads for %d jobs)", pool->count, pool->job_count);
+}
+
+void
+dns_input_pool_process(struct dns_input_pool *pool)
+{
+    for (int j = 0; j < pool->job_count; j++) {
+        struct dns_frame_queue *q = pool->queues[j % pool->count];
+        while (1) {
+            struct dns_packet_frame *frame = dns_frame_queue_dequeue(q);
+            if (frame->type == 1) {
+                dns_packet_frame_destroy(frame);
+                break;
+            }
+            dns_frame_queue_enqueue(pool->out, frame); // Hand over ownership
+        }
+    }
+}
+
+void
+dns_input_pool_finish(struct dns_input_pool *pool)
+{
+    for (int i = 0; i < pool->count; i++) {
+        int r = pthread_join(pool->threads[i], NULL);
+        assert(r == 0);
+    }
+    pthread_mutex_unlock(&pool->running);
+    for (int i = 0; i < pool->count; i++) {
+        char name[32];
+        snprintf(name, sizeof(name), "input-%d", i);
+        dns_frame_queue_report(pool->queues[i], name);
+    }
+    msg(L_DEBUG, "Input pool stopped and joined");
+}
@@ -0,0 +1,116 @@
+/* 
+ *  Copyright (C) 2016 CZ.NIC, z.s.p.o.
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef DNSCOL_INPUT_POOL_H
+#define DNSCOL_INPUT_POOL_H
+
+/**
+ * \file input_pool.h
+ * Parallel reading of offline input files.
+ */
+
+#include <pthread.h>
+
+#include "common.h"
+#include "config.h"
+
+struct dns_frame_queue;
+
+/**
+ * A part of the input read by one input: a whole file or its byte range.
+ */
+struct dns_input_pool_job {
+    /** The file name, not owned. */
+    const char *path;
+
+    /** The byte range to read (see `struct dns_input`), both 0 for the whole file */
+    size_t start, end;
+};
+
+/**
+ * A pool of input threads reading a sequence of offline files concurrently.
+ *
+ * The files are read in jobs: whole files, or chunks of the pcap files larger than
+ * `input_offline_chunk_size` (see `dns_pcap_reader_split()`).
+ * Job `i` is read by thread `i % count` with a `struct dns_input` of its own,
+ * into the queue of the thread. The consumer forwards the frames of the jobs
+ * in order into the output queue (see `dns_input_pool_process()`),
+ * so the matcher sees the same packet stream as when reading the files one
+ * by one and the requests near the file and chunk boundaries are matched the same way.
+ * The IP and TCP reassembly, the time reordering and the deduplication would be done
+ * per job, not crossing the file and chunk boundaries, so the pool is only used
+ * with all of them off (the files are read one by one otherwise, see `main()`).
+ * Reading and parsing of the following jobs runs ahead by up to
+ * `max_queue_len` frames per thread.
+ */
+struct dns_input_pool {
+    /** The configuration the inputs are created with, not owned. */
+    struct dns_config *conf;
+
+    /** The jobs, in order, owned. */
+    struct dns_input_pool_job *jobs;
+    int job_count;
+
+    /** Number of input threads */
+    int count;
+
+    /** Per-thread output queues, owned. */
+    struct dns_frame_queue **queues;
+
+    /** Output queue, not owned. */
+    struct dns_frame_queue *out;
+
+    /** The input threads */
+    pthread_t *threads;
+
+    /** The mutex indicating that the threads are started and running. */
+    pthread_mutex_t running;
+};
+
+/**
+ * Create a pool of `conf->input_offline_threads` threads reading the given files into `out`.
+ * Splits the large files into chunks.
+ */
+struct dns_input_pool *
+dns_input_pool_create(struct dns_config *conf, char **files, int file_count, struct dns_frame_queue *out);
+
+/**
+ * Start the input threads. The threads must not be already running!
+ */
+void
+dns_input_pool_start(struct dns_input_pool *pool);
+
+/**
+ * Forward the frames of all the files in order to the output queue until
+ * all the files are read (or the input is interrupted). Does not send any final frame.
+ */
+void
+dns_input_pool_process(struct dns_input_pool *pool);
+
+/**
+ * Wait for all the input threads to stop.
+ */
+void
+dns_input_pool_finish(struct dns_input_pool *pool);
+
+/**
+ * Destroy the pool, the threads must not be running!
+ */
+void
+dns_input_pool_destroy(struct dns_input_pool *pool);
+
+#endif /* DNSCOL_INPUT_POOL_H */
@@ -25,11 +25,15 @@
 #include "config.h"
 #include "frame_queue.h"
 #include "input.h"
+#include "input_pool.h"
 #include "output_csv.h"
 #include "output_cbor.h"
 #include "packet_frame.h"
+#include "packet_hash.h"
 #include "worker_frame_logger.h"
 #include "worker_packet_matcher.h"
+#include "worker_matcher_shards.h"
+#include "worker_packet_parsers.h"
 
 #define MAX_TRACE_SIZE 42
 static void
@@ -128,6 +132,9 @@ int main(int argc UNUSED, char **argv)
             opt_failure("ERROR: Both input interface (-i) and input pcap files provided.");
             return 2;
         }
+        char *afpacket_err = dns_config_check_afpacket(conf);
+        if (afpacket_err)
+            die("Invalid config: %s", afpacket_err);
     }
 
     if (main_output_path != NULL) {
@@ -152,14 +159,28 @@ int main(int argc UNUSED, char **argv)
 
     // Construct and start workflow
 
+    dns_packet_hash_init_secret();
+
+    // Every pipeline link has a single producer and a single consumer thread
     struct dns_frame_queue *q_input_mathcher =
-        dns_frame_queue_create(conf->max_queue_len, DNS_QUEUE_BLOCK);
+        dns_frame_queue_create_spsc(conf->max_queue_len, conf->max_queue_size, DNS_QUEUE_BLOCK);
     struct dns_frame_queue *q_matcher_output =
-        dns_frame_queue_create(conf->max_queue_len, DNS_QUEUE_BLOCK);
+        dns_frame_queue_create_spsc(conf->max_queue_len, conf->max_queue_size, DNS_QUEUE_BLOCK);
+    // Optional DNS parsing stage between the input and the matcher
+    struct dns_frame_queue *q_input_parsers = NULL;
+    struct dns_worker_packet_parsers *w_parsers = NULL;
+    if (conf->input_parse_threads > 0) {
+        q_input_parsers = dns_frame_queue_create_spsc(conf->max_queue_len, conf->max_queue_size, DNS_QUEUE_BLOCK);
+        w_parsers = dns_worker_packet_parsers_create(conf, q_input_parsers, q_input_mathcher);
+    }
     struct dns_input *input =
-        dns_input_create(conf, q_input_mathcher);
-    struct dns_worker_packet_matcher *w_matcher =
-        dns_worker_packet_matcher_create(conf, q_input_mathcher, q_matcher_output);
+        dns_input_create(conf, w_parsers ? q_input_parsers : q_input_mathcher);
+    struct dns_worker_packet_matcher *w_matcher = NULL;
+    struct dns_worker_matcher_shards *w_shards = NULL;
+    if (conf->match_threads > 1)
+        w_shards = dns_worker_matcher_shards_create(conf, q_input_mathcher, q_matcher_output);
+    else
+        w_matcher = dns_worker_packet_matcher_create(conf, q_input_mathcher, q_matcher_output);
 
     struct dns_output *output;
     switch (conf->output_type) {
@@ -172,12 +193,46 @@ int main(int argc UNUSED, char **argv)
         default: die("Invalid output type");
     }
 
-    dns_worker_packet_matcher_start(w_matcher);
+    if (w_shards)
+        dns_worker_matcher_shards_start(w_shards);
+    else
+        dns_worker_packet_matcher_start(w_matcher);
+    if (w_parsers)
+        dns_worker_packet_parsers_start(w_parsers);
     output->start_output(output);
 
     // Main loop, start inputs
 
-    if (*main_inputs) {
+    int dumping = conf->dump_path_fmt && strlen(conf->dump_path_fmt) > 0;
+    if (w_parsers && dumping)
+        msg(L_WARN, "Packet dumping needs the parse result, parsing the packets in the input thread");
+    // The stream state is per input, the parallel inputs would reset it at every file and chunk
+    int stateful = dns_input_keeps_state(conf);
+    if (*main_inputs && conf->input_offline_threads > 1 && dumping)
+        msg(L_WARN, "Packet dumping needs a single input, reading the input files one by one");
+    else if (*main_inputs && conf->input_offline_threads > 1 && stateful)
+        msg(L_WARN, "IP or TCP reassembly, reordering or deduplication need a single input, reading the input files one by one");
+    if (*main_inputs && conf->input_offline_threads > 1 && !dumping && !stateful) {
+        // offline pcaps read in parallel, up to the first file that can not be opened
+        int count = 0;
+        for (char **in = main_inputs; *in; in++, count++) {
+            FILE *f = fopen(*in, "rb");
+            if (f == NULL) {
+                msg(L_ERROR, "Error opening file '%s': %s", *in, strerror(errno));
+                if (in == main_inputs) {
+                    die("No output written.");
+                }
+                break;
+            }
+            fclose(f);
+        }
+        struct dns_input_pool *pool = dns_input_pool_create(conf, main_inputs, count,
+                                                            w_parsers ? q_input_parsers : q_input_mathcher);
+        dns_input_pool_start(pool);
+        dns_input_pool_process(pool);
+        dns_input_pool_finish(pool);
+        dns_input_pool_destroy(pool);
+    } else if (*main_inputs) {
         // offline pcaps
         for (char **in = main_inputs; *in; in++) {
             char fn[1024];
@@ -190,7 +245,7 @@ int main(int argc UNUSED, char **argv)
                 break;
             }
             fclose(f);
-            snprintf(fn, sizeof(fn), "pcapfile:%s", *in);
+            snprintf(fn, sizeof(fn), "%s%s", DNS_INPUT_PCAPFILE_PREFIX, *in);
             r = dns_input_process(input, fn);
             if (r != DNS_RET_OK) {
                 msg(L_ERROR, "Processing of '%s' unsuccesfull (code %d)", fn, r);
@@ -208,15 +263,27 @@ int main(int argc UNUSED, char **argv)
     // Send the last frame, wait for threads to exit
 
     dns_input_finish(input);
-    dns_worker_packet_matcher_finish(w_matcher);
+    if (w_parsers)
+        dns_worker_packet_parsers_finish(w_parsers);
+    if (w_shards)
+        dns_worker_matcher_shards_finish(w_shards);
+    else
+        dns_worker_packet_matcher_finish(w_matcher);
     output->finish_output(output);
 
     // Dealloc and cleanup
 
     dns_input_destroy(input);
-    dns_worker_packet_matcher_destroy(w_matcher);
+    if (w_parsers)
+        dns_worker_packet_parsers_destroy(w_parsers);
+    if (w_shards)
+        dns_worker_matcher_shards_destroy(w_shards);
+    else
+        dns_worker_packet_matcher_destroy(w_matcher);
     output->finalize_output(output);
     free(output);
+    if (q_input_parsers)
+        dns_frame_queue_destroy(q_input_parsers);
     dns_frame_queue_destroy(q_input_mathcher);
     dns_frame_queue_destroy(q_matcher_output);
 
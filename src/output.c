@@ -249,6 +249,7 @@ dns_output_close(struct dns_output *out, dns_us_time_t time)
         out->current_items, rate_items, out->current_request_only, out->current_response_only);
     msg(L_INFO, "output totals: %"PRIu64" items (%"PRIu64" req-only, %"PRIu64" resp-only), %"PRIu64" bytes",
         out->total_items, out->total_request_only, out->total_response_only, out->total_bytes);
+    dns_frame_queue_report(out->in, "matcher-output");
 
     out->current_items = 0;
     out->current_request_only = 0;
@@ -138,28 +138,28 @@ write_packet(FILE *f, uint32_t fields, dns_packet_t *pkt)
     // DNS header
 
     COND(id) 
-        CERR(cbor_encode_int(&eitem, knot_wire_get_id(pkt->knot_packet->wire)));
+        CERR(cbor_encode_int(&eitem, knot_wire_get_id(pkt->dns_data)));
     COND_END
 
     COND(qtype) 
-        CERR(cbor_encode_int(&eitem, knot_pkt_qtype(pkt->knot_packet)));
+        CERR(cbor_encode_int(&eitem, pkt->qtype));
     COND_END
 
     COND(qclass) 
-        CERR(cbor_encode_int(&eitem, knot_pkt_qclass(pkt->knot_packet)));
+        CERR(cbor_encode_int(&eitem, pkt->qclass));
     COND_END
 
     COND(opcode)
-        CERR(cbor_encode_int(&eitem, knot_wire_get_opcode(pkt->knot_packet->wire)));
+        CERR(cbor_encode_int(&eitem, knot_wire_get_opcode(pkt->dns_data)));
     COND_END
 
     CONDIF(rcode, DNS_PACKET_RESPONSE(pkt))
-            CERR(cbor_encode_int(&eitem, knot_wire_get_rcode(DNS_PACKET_RESPONSE(pkt)->knot_packet->wire)));
+            CERR(cbor_encode_int(&eitem, knot_wire_get_rcode(DNS_PACKET_RESPONSE(pkt)->dns_data)));
     COND_END
 
 #define WRITEFLAG(label, type, name) CONDIF(label, DNS_PACKET_ ## type (pkt)) \
             CERR(cbor_encode_boolean( &eitem, \
-            !! knot_wire_get_ ## name(DNS_PACKET_ ## type (pkt)->knot_packet->wire))); \
+            !! knot_wire_get_ ## name(DNS_PACKET_ ## type (pkt)->dns_data))); \
         COND_END
 
     WRITEFLAG(resp_aa, RESPONSE, aa);
@@ -174,7 +174,7 @@ write_packet(FILE *f, uint32_t fields, dns_packet_t *pkt)
 
     COND(qname) 
         char qname_buf[1024];
-        char *res = knot_dname_to_str(qname_buf, knot_pkt_qname(pkt->knot_packet), sizeof(qname_buf));
+        char *res = knot_dname_to_str(qname_buf, DNS_PACKET_QNAME(pkt), sizeof(qname_buf));
         if (res) {
             CERR(cbor_encode_text_stringz(&eitem, res));
         } else {
@@ -196,28 +196,31 @@ write_packet(FILE *f, uint32_t fields, dns_packet_t *pkt)
 
     // EDNS
 
-    const knot_rrset_t *req_opt_rr = (pkt && DNS_PACKET_REQUEST(pkt)) ? DNS_PACKET_REQUEST(pkt)->knot_packet->opt_rr : NULL;
-    const knot_rrset_t *resp_opt_rr = (pkt && DNS_PACKET_RESPONSE(pkt)) ? DNS_PACKET_RESPONSE(pkt)->knot_packet->opt_rr : NULL;
+    // Packets with EDNS (or NULL)
+    const dns_packet_t *req_edns = (pkt && DNS_PACKET_REQUEST(pkt) && DNS_PACKET_REQUEST(pkt)->edns_present) ?
+        DNS_PACKET_REQUEST(pkt) : NULL;
+    const dns_packet_t *resp_edns = (pkt && DNS_PACKET_RESPONSE(pkt) && DNS_PACKET_RESPONSE(pkt)->edns_present) ?
+        DNS_PACKET_RESPONSE(pkt) : NULL;
 
-    CONDIF(req_edns_ver, req_opt_rr)
-        CERR(cbor_encode_int(&eitem, knot_edns_get_version(req_opt_rr)));
+    CONDIF(req_edns_ver, req_edns)
+        CERR(cbor_encode_int(&eitem, req_edns->edns_version));
     COND_END
 
-    CONDIF(req_edns_udp, req_opt_rr)
-        CERR(cbor_encode_int(&eitem, knot_edns_get_payload(req_opt_rr)));
+    CONDIF(req_edns_udp, req_edns)
+        CERR(cbor_encode_int(&eitem, req_edns->edns_udp_size));
     COND_END
 
-    CONDIF(req_edns_do, req_opt_rr)
-        CERR(cbor_encode_boolean(&eitem, !! knot_edns_do(req_opt_rr)));
+    CONDIF(req_edns_do, req_edns)
+        CERR(cbor_encode_boolean(&eitem, !! req_edns->edns_do));
     COND_END
 
-    CONDIF(resp_edns_rcode, resp_opt_rr)
-        CERR(cbor_encode_int(&eitem, knot_edns_get_ext_rcode(resp_opt_rr)));
+    CONDIF(resp_edns_rcode, resp_edns)
+        CERR(cbor_encode_int(&eitem, resp_edns->edns_ext_rcode));
     COND_END
 
 #define COND_OPT_RR(label, code, rr) \
     CONDIF(label, rr) \
-        uint8_t *opt = knot_edns_get_option(rr, code); \
+        uint8_t *opt = dns_packet_edns_option(rr, code); \
         if (!opt) { CERR(cbor_encode_null(&eitem)); } else { \
             int len = knot_edns_opt_get_length(opt);
 
@@ -225,7 +228,7 @@ write_packet(FILE *f, uint32_t fields, dns_packet_t *pkt)
     } COND_END
 
 #define WRITE_UNDERSTOOD_LIST(label, code) \
-    COND_OPT_RR(label, code, req_opt_rr) \
+    COND_OPT_RR(label, code, req_edns) \
             CborEncoder elist; \
             CERR(cbor_encoder_create_array(&eitem, &elist, len)); \
             for (int i = 0; i < knot_edns_opt_get_length(opt); i++) { \
@@ -243,16 +246,16 @@ write_packet(FILE *f, uint32_t fields, dns_packet_t *pkt)
     WRITE_UNDERSTOOD_LIST(req_edns_dhu, 6); // DHU 
     WRITE_UNDERSTOOD_LIST(req_edns_n3u, 7); // N3U 
 
-    COND_OPT_RR(resp_edns_nsid, 3, resp_opt_rr) // NSID
+    COND_OPT_RR(resp_edns_nsid, 3, resp_edns) // NSID
         CERR(cbor_encode_byte_string(&eitem, opt + 2 * sizeof(uint16_t), len));
     COND_OPT_RR_END
 
     CONDIF(edns_client_subnet, 0) // TODO: PARSE and WRITE client subnet information
         uint8_t *opt = NULL;
-        if (resp_opt_rr)
-            opt = knot_edns_get_option(resp_opt_rr, 8); // client subnet from response 
-        if (req_opt_rr && !opt)
-            opt = knot_edns_get_option(req_opt_rr, 8); // client subnet from request 
+        if (resp_edns)
+            opt = dns_packet_edns_option(resp_edns, 8); // client subnet from response 
+        if (req_edns && !opt)
+            opt = dns_packet_edns_option(req_edns, 8); // client subnet from request 
         if (opt) {
             CborEncoder elist;
             CERR(cbor_encoder_create_array(&eitem, &elist, CborIndefiniteLength));
@@ -267,10 +270,10 @@ write_packet(FILE *f, uint32_t fields, dns_packet_t *pkt)
     CONDIF(edns_other, 0) // TODO: traverse all remaining records
         CborEncoder elist;
         CERR(cbor_encoder_create_array(&eitem, &elist, 4));
-        if (req_opt_rr) {
+        if (req_edns) {
             // ...
         }
-        if (resp_opt_rr) {
+        if (resp_edns) {
             // ...
         }
         CERR(cbor_encoder_close_container_checked(&eitem, &elist));
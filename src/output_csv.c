@@ -145,28 +145,28 @@ write_packet(FILE *f, uint32_t fields, int separator, dns_packet_t *pkt)
     // DNS header
 
     COND(id) 
-        WRITE("%d", knot_wire_get_id(pkt->knot_packet->wire));
+        WRITE("%d", knot_wire_get_id(pkt->dns_data));
     COND_END
 
     COND(qtype) 
-        WRITE("%d", knot_pkt_qtype(pkt->knot_packet));
+        WRITE("%d", pkt->qtype);
     COND_END
 
     COND(qclass) 
-        WRITE("%d", knot_pkt_qclass(pkt->knot_packet));
+        WRITE("%d", pkt->qclass);
     COND_END
 
     COND(opcode)
-        WRITE("%d", knot_wire_get_opcode(pkt->knot_packet->wire));
+        WRITE("%d", knot_wire_get_opcode(pkt->dns_data));
     COND_END
 
     COND(rcode)
         if (DNS_PACKET_RESPONSE(pkt)) 
-            WRITE("%d", knot_wire_get_rcode(DNS_PACKET_RESPONSE(pkt)->knot_packet->wire));
+            WRITE("%d", knot_wire_get_rcode(DNS_PACKET_RESPONSE(pkt)->dns_data));
     COND_END
 
 #define WRITEFLAG(type, name)  if (DNS_PACKET_ ## type (pkt)) \
-    WRITE("%d", !! knot_wire_get_ ## name(DNS_PACKET_ ## type (pkt)->knot_packet->wire)); \
+    WRITE("%d", !! knot_wire_get_ ## name(DNS_PACKET_ ## type (pkt)->dns_data)); \
 
     COND(resp_aa) 
         WRITEFLAG(RESPONSE, aa);
@@ -198,7 +198,7 @@ write_packet(FILE *f, uint32_t fields, int separator, dns_packet_t *pkt)
 
     COND(qname) 
         char qname_buf[1024];
-        char *res = knot_dname_to_str(qname_buf, knot_pkt_qname(pkt->knot_packet), sizeof(qname_buf));
+        char *res = knot_dname_to_str(qname_buf, DNS_PACKET_QNAME(pkt), sizeof(qname_buf));
         if (res) {
             WRITE("%s", res);
         } else {
@@ -223,32 +223,35 @@ write_packet(FILE *f, uint32_t fields, int separator, dns_packet_t *pkt)
 
     // EDNS
 
-    const knot_rrset_t *req_opt_rr = (pkt && DNS_PACKET_REQUEST(pkt)) ? DNS_PACKET_REQUEST(pkt)->knot_packet->opt_rr : NULL;
-    const knot_rrset_t *resp_opt_rr = (pkt && DNS_PACKET_RESPONSE(pkt)) ? DNS_PACKET_RESPONSE(pkt)->knot_packet->opt_rr : NULL;
+    // Packets with EDNS (or NULL)
+    const dns_packet_t *req_edns = (pkt && DNS_PACKET_REQUEST(pkt) && DNS_PACKET_REQUEST(pkt)->edns_present) ?
+        DNS_PACKET_REQUEST(pkt) : NULL;
+    const dns_packet_t *resp_edns = (pkt && DNS_PACKET_RESPONSE(pkt) && DNS_PACKET_RESPONSE(pkt)->edns_present) ?
+        DNS_PACKET_RESPONSE(pkt) : NULL;
 
     COND(req_edns_ver) 
-        if (req_opt_rr)
-            WRITE("%d", knot_edns_get_version(req_opt_rr));
+        if (req_edns)
+            WRITE("%d", req_edns->edns_version);
     COND_END
 
     COND(req_edns_udp) 
-        if (req_opt_rr)
-            WRITE("%d", knot_edns_get_payload(req_opt_rr));
+        if (req_edns)
+            WRITE("%d", req_edns->edns_udp_size);
     COND_END
 
     COND(req_edns_do) 
-        if (req_opt_rr)
-            WRITE("%d", !! knot_edns_do(req_opt_rr));
+        if (req_edns)
+            WRITE("%d", !! req_edns->edns_do);
     COND_END
 
     COND(resp_edns_rcode) 
-        if (resp_opt_rr)
-            WRITE("%d", knot_edns_get_ext_rcode(resp_opt_rr));
+        if (resp_edns)
+            WRITE("%d", resp_edns->edns_ext_rcode);
     COND_END
 
 #define WRITE_UNDERSTOOD_LIST(code) \
-    if (req_opt_rr) { \
-        uint8_t *opt = knot_edns_get_option(req_opt_rr, code); \
+    if (req_edns) { \
+        uint8_t *opt = dns_packet_edns_option(req_edns, code); \
         if (opt) { for (int i = 0; i < knot_edns_opt_get_length(opt); i++) { \
             if (i > 0) WRITE( (separator == ',') ? "\\," : "," ); \
             WRITE("%d", (int)((opt + 2 * sizeof(uint16_t) + i)[i])); \
@@ -273,8 +276,8 @@ write_packet(FILE *f, uint32_t fields, int separator, dns_packet_t *pkt)
     COND_END
 
     COND(resp_edns_nsid) 
-        if (resp_opt_rr) {
-            uint8_t *opt = knot_edns_get_option(resp_opt_rr, 3); /* NSID */
+        if (resp_edns) {
+            uint8_t *opt = dns_packet_edns_option(resp_edns, 3); /* NSID */
             if (opt) {
                 p += dns_snescape(p, (outbuf + sizeof(outbuf)) - p, separator,
                                   opt + 2 * sizeof(uint16_t), knot_edns_opt_get_length(opt));
@@ -284,10 +287,10 @@ write_packet(FILE *f, uint32_t fields, int separator, dns_packet_t *pkt)
 
     COND(edns_client_subnet)
         uint8_t *opt = NULL;
-        if (resp_opt_rr)
-            opt = knot_edns_get_option(resp_opt_rr, 8); /* client subnet from response */
-        if (req_opt_rr && !opt)
-            opt = knot_edns_get_option(req_opt_rr, 8); /* client subnet from request */
+        if (resp_edns)
+            opt = dns_packet_edns_option(resp_edns, 8); /* client subnet from response */
+        if (req_edns && !opt)
+            opt = dns_packet_edns_option(req_edns, 8); /* client subnet from request */
         if (opt) {
             // TODO: PARSE and PRINT client subnet information
             // As in: "4,118.71.70/24,0"
@@ -296,10 +299,10 @@ write_packet(FILE *f, uint32_t fields, int separator, dns_packet_t *pkt)
     COND_END
 
     COND(edns_other)
-        const knot_rrset_t *opt_rr = resp_opt_rr;
-        if (req_opt_rr)
-            opt_rr = req_opt_rr; // Prefer request OPT RR
-        if (opt_rr) {
+        const dns_packet_t *edns_pkt = resp_edns;
+        if (req_edns)
+            edns_pkt = req_edns; // Prefer request OPT RR
+        if (edns_pkt) {
             // TODO: PARSE and PRINT options other than used above
         } else { WRITENULL; }
     COND_END
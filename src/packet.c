@@ -31,29 +31,38 @@
 #include "common.h"
 #include "packet.h"
 #include "packet_hash.h"
+#include "packet_decode.h"
 
 struct dns_packet*
-dns_packet_create(void *dns_data, size_t dns_data_size)
+dns_packet_create(struct dns_packet_arena *arena, const void *dns_data, size_t dns_data_size, size_t edns_data_size)
 {
-    struct dns_packet *pkt = xmalloc_zero(sizeof(struct dns_packet));
-    pkt->dns_data = xmalloc_zero(dns_data_size);
-    if (dns_data) {
+    size_t size = sizeof(struct dns_packet) + dns_data_size + edns_data_size;
+    struct dns_packet *pkt = arena ? dns_packet_arena_alloc(arena, size) : xmalloc(size);
+    memset(pkt, 0, sizeof(struct dns_packet));
+    pkt->arena = arena;
+    pkt->dns_data = (uint8_t *)(pkt + 1);
+    if (dns_data)
         memcpy(pkt->dns_data, dns_data, dns_data_size);
-    }
+    else
+        memset(pkt->dns_data, 0, dns_data_size);
     pkt->dns_data_size = dns_data_size;
-    pkt->knot_packet = knot_pkt_new(pkt->dns_data, pkt->dns_data_size, NULL);
-    pkt->memory_size = sizeof(dns_packet_t) + dns_data_size + sizeof(knot_pkt_t);
-    
+    if (edns_data_size > 0) {
+        pkt->edns_data = pkt->dns_data + dns_data_size;
+        pkt->edns_data_size = edns_data_size;
+    }
+    pkt->memory_size = size;
+
     return pkt;
 }
 
 
-dns_ret_t
-dns_packet_create_from_libtrace(libtrace_packet_t *tp, struct dns_packet **pktp)
+/**
+ * Extract the network data of the packet with the libtrace accessors (except for `ts` and `wire_size`).
+ * Slower than `packet_decode.h` but supports all the libtrace link types and protocols.
+ */
+static dns_ret_t
+dns_packet_net_from_libtrace_layers(libtrace_packet_t *tp, struct dns_packet_net *net)
 {
-    assert(tp && pktp);
-    *pktp = NULL;
-
     uint8_t proto;
     uint32_t remaining;
     void *dns_data = NULL;
@@ -75,8 +84,7 @@ dns_packet_create_from_libtrace(libtrace_packet_t *tp, struct dns_packet **pktp)
     uint8_t frag_more;
     frag_offset = trace_get_fragment_offset(tp, &frag_more);
     if ((frag_offset > 0) || (frag_more)) {
-        // fragmented packet
-        // TODO: reassemble IP fragments (very infrequent)
+        // fragmented packet, only reassembled from the single pass decoders (no `net->frag` here)
         return DNS_RET_DROP_FRAGMENTED;
     }
 
@@ -120,109 +128,359 @@ dns_packet_create_from_libtrace(libtrace_packet_t *tp, struct dns_packet **pktp)
             return DNS_RET_DROP_TRANSPORT;
     }
 
-    // Packet struct allocation, DNS data copy and data lengths, create knot packet
-    struct dns_packet *pkt = dns_packet_create(dns_data, remaining);
-
-    pkt->dns_data_size_orig = trace_get_payload_length(tp);
-
-    // Timestamp
-    struct timeval tv = trace_get_timeval(tp);
-    pkt->ts = dns_us_time_from_timeval(&tv);
-
     // Addresses and ports
-    if (!( trace_get_source_address(tp, (struct sockaddr *)&(pkt->src_addr)) &&
-           trace_get_destination_address(tp, (struct sockaddr *)&(pkt->dst_addr))
+    if (!( trace_get_source_address(tp, (struct sockaddr *)&net->src_addr) &&
+           trace_get_destination_address(tp, (struct sockaddr *)&net->dst_addr)
          )) {
-        dns_packet_destroy(pkt);
         return DNS_RET_DROP_NETWORK;
     }
 
-    // Protocol and other net stats
-    pkt->net_protocol = proto;
-    pkt->net_size = trace_get_wire_length(tp);
-    pkt->net_ttl = 0;
-    if (ip_hdr) pkt->net_ttl = ip_hdr->ip_ttl;
-    if (ip6_hdr) pkt->net_ttl = ip6_hdr->hlim;
-    pkt->net_udp_sum = udp_hdr ? ntohs(udp_hdr->check) : 0;
-
-    // Parse and check QNAME count, validity and length
-    int r = knot_pkt_parse_question(pkt->knot_packet);
+    net->protocol = proto;
+    net->ttl = 0;
+    if (ip_hdr) net->ttl = ip_hdr->ip_ttl;
+    if (ip6_hdr) net->ttl = ip6_hdr->hlim;
+    net->udp_sum = udp_hdr ? ntohs(udp_hdr->check) : 0;
+    net->dns_data = dns_data;
+    net->dns_data_size = remaining;
+    net->payload_size = trace_get_payload_length(tp);
+    return DNS_RET_OK;
+}
+
+dns_ret_t
+dns_packet_net_from_libtrace(libtrace_packet_t *tp, struct dns_packet_net *net)
+{
+    assert(tp && net);
+    memset(&net->frag, 0, sizeof(net->frag));
+    memset(&net->tcp, 0, sizeof(net->tcp));
+
+    // Single pass decoding of the common link types
+    libtrace_linktype_t linktype;
+    uint32_t caplen;
+    dns_ret_t r = DNS_RET_ERR;
+    const uint8_t *l2 = trace_get_layer2(tp, &linktype, &caplen);
+    if (l2) {
+        switch (linktype) {
+        case TRACE_TYPE_ETH:
+            r = dns_packet_decode_ether(l2, caplen, net);
+            break;
+        case TRACE_TYPE_LINUX_SLL:
+            r = dns_packet_decode_sll(l2, caplen, net);
+            break;
+        case TRACE_TYPE_NONE:
+            r = dns_packet_decode_raw_ip(l2, caplen, net);
+            break;
+        default:
+            break;
+        }
+    }
+    // Other link types are left to libtrace
+    if (r == DNS_RET_ERR)
+        r = dns_packet_net_from_libtrace_layers(tp, net);
+    if (r != DNS_RET_OK && r != DNS_RET_DROP_FRAGMENTED)
+        return r;
+
+    struct timeval tv = trace_get_timeval(tp);
+    net->ts = dns_us_time_from_timeval(&tv);
+    net->wire_size = trace_get_wire_length(tp);
+    return r;
+}
+
+dns_ret_t
+dns_packet_create_from_libtrace(libtrace_packet_t *tp, struct dns_packet **pktp, struct dns_packet_arena *arena,
+                                uint32_t fields, int compact)
+{
+    assert(tp && pktp);
+    *pktp = NULL;
+
+    struct dns_packet_net net;
+    dns_ret_t r = dns_packet_net_from_libtrace(tp, &net);
     if (r != DNS_RET_OK)
-    {
-        if (r != KNOT_EOK)
-            r = DNS_RET_DROP_MALF;
-        dns_packet_destroy(pkt);
         return r;
-    }
 
-    // Fully parse and check requests
-    if (DNS_PACKET_IS_REQUEST(pkt)) {
-        r = knot_pkt_parse(pkt->knot_packet, 0);
-        if (r != DNS_RET_OK)
-        {
-            if (r == KNOT_ENOMEM)
-                die("Out of memory allocating packet structures.");
-            if (r != KNOT_EOK)
-                r = DNS_RET_DROP_MALF;
-            dns_packet_destroy(pkt);
-            return r;
+    return dns_packet_create_from_net(&net, pktp, arena, fields, compact);
+}
+
+/**
+ * The DNS data extracted by `dns_packet_parse_wire()`, pointing into the parsed data.
+ */
+struct dns_packet_parsed {
+    /** DNS data length */
+    size_t size;
+
+    /** Wire QNAME length, QTYPE and QCLASS (all 0 when there is no question) */
+    uint16_t qname_size;
+    uint16_t qtype;
+    uint16_t qclass;
+
+    /** The OPT RR CLASS, TTL and RDATA, `opt_rdata` NULL when not present or not searched for */
+    uint16_t opt_class;
+    uint32_t opt_ttl;
+    const uint8_t *opt_rdata;
+    uint16_t opt_rdlen;
+};
+
+/**
+ * The output fields that need more of the DNS data than the header. With none of them output,
+ * the requests are not checked beyond the question.
+ */
+#define DNS_PACKET_BODY_FIELDS ((1 << dns_field_qtype) | (1 << dns_field_qclass) | \
+                                (1 << dns_field_qname) | (1 << dns_field_edns))
+
+/**
+ * Check the RRs following the question as `knot_pkt_parse()` does, without parsing their RDATA:
+ * all the RRs must fit, the only OPT RR must be in the additional section and no data may follow
+ * the RRs. With `want_opt` set, the OPT RR is kept in `pp`. Returns DNS_RET_DROP_MALF when malformed.
+ */
+static dns_ret_t
+dns_packet_check_rrs(const uint8_t *data, size_t size, size_t pos, int want_opt, struct dns_packet_parsed *pp)
+{
+    int before = knot_wire_get_ancount(data) + knot_wire_get_nscount(data);
+    int rrs = before + knot_wire_get_arcount(data);
+    const size_t rr_fixed = 3 * sizeof(uint16_t) + sizeof(uint32_t); // TYPE, CLASS, TTL and RDLENGTH
+    int opt_seen = 0;
+    for (int i = 0; i < rrs; i++) {
+        int len = knot_dname_wire_check(data + pos, data + size, data);
+        if (len <= 0 || pos + len + rr_fixed > size)
+            return DNS_RET_DROP_MALF;
+        pos += len;
+        const uint8_t *rr = data + pos;
+        uint16_t rdlen = knot_wire_read_u16(rr + rr_fixed - sizeof(uint16_t));
+        pos += rr_fixed;
+        if (pos + rdlen > size)
+            return DNS_RET_DROP_MALF;
+        if (knot_wire_read_u16(rr) == KNOT_RRTYPE_OPT) {
+            if (i < before || opt_seen)
+                return DNS_RET_DROP_MALF;
+            opt_seen = 1;
+            if (want_opt) {
+                pp->opt_class = knot_wire_read_u16(rr + sizeof(uint16_t));
+                pp->opt_ttl = knot_wire_read_u32(rr + 2 * sizeof(uint16_t));
+                pp->opt_rdata = data + pos;
+                pp->opt_rdlen = rdlen;
+            }
         }
+        pos += rdlen;
     }
+    if (pos < size)
+        return DNS_RET_DROP_MALF; // Trailing data
+    return DNS_RET_OK;
+}
+
+/**
+ * Parse the DNS data as deep as the output `fields` need: the header and the question
+ * are always checked (the question is also used for matching and compacting).
+ * Requests are checked in full (see `dns_packet_check_rrs()`) unless only header fields
+ * are output, their OPT RR is only kept when EDNS fields are output.
+ * The RDATA are never parsed. Returns DNS_RET_OK or the drop reason.
+ */
+static dns_ret_t
+dns_packet_parse_wire(const uint8_t *data, size_t size, uint32_t fields, struct dns_packet_parsed *pp)
+{
+    memset(pp, 0, sizeof(struct dns_packet_parsed));
+    pp->size = size;
+    if (size < KNOT_WIRE_HEADER_SIZE || size > KNOT_WIRE_MAX_PKTSIZE)
+        return DNS_RET_DROP_MALF;
+
+    // Check QNAME count, validity and length
+    size_t pos = KNOT_WIRE_HEADER_SIZE;
+    uint16_t qdcount = knot_wire_get_qdcount(data);
+    if (qdcount > 1)
+        return DNS_RET_DROP_MALF;
+    if (qdcount == 1) {
+        int len = knot_dname_wire_check(data + pos, data + size, NULL);
+        if (len <= 0 || pos + len + 2 * sizeof(uint16_t) > size)
+            return DNS_RET_DROP_MALF;
+        pp->qname_size = len;
+        pos += len;
+        pp->qtype = knot_wire_read_u16(data + pos);
+        pp->qclass = knot_wire_read_u16(data + pos + sizeof(uint16_t));
+        pos += 2 * sizeof(uint16_t);
+    }
+
+    // Check requests in full as before, unless the output does not look past the header
+    if ((fields & DNS_PACKET_BODY_FIELDS) && knot_wire_get_qr(data) == 0)
+        return dns_packet_check_rrs(data, size, pos, fields & (1 << dns_field_edns), pp);
+    return DNS_RET_OK;
+}
+
+/**
+ * The kept length of the DNS data of the parsed packet.
+ */
+static size_t
+dns_packet_kept_size(const struct dns_packet_parsed *pp, int compact)
+{
+    if (!compact)
+        return pp->size;
+    size_t data_size = DNS_PACKET_QNAME_OFFSET;
+    if (pp->qname_size)
+        data_size += pp->qname_size + 2 * sizeof(uint16_t); // QNAME, QTYPE and QCLASS
+    assert(data_size <= pp->size);
+    return data_size;
+}
+
+/**
+ * Fill in the network data and the DNS ID of the packet and compute its key.
+ */
+static void
+dns_packet_set_net(struct dns_packet *pkt, const struct dns_packet_net *net)
+{
+    pkt->dns_data_size_orig = net->payload_size;
+    pkt->ts = net->ts;
+    pkt->src_addr = net->src_addr;
+    pkt->dst_addr = net->dst_addr;
+
+    // Protocol and other net stats
+    pkt->net_protocol = net->protocol;
+    pkt->net_size = net->wire_size;
+    pkt->net_ttl = net->ttl;
+    pkt->net_udp_sum = net->udp_sum;
 
     // DNS ID - aty this point the entire header is present
     pkt->dns_id = knot_wire_get_id(pkt->dns_data);
 
+    // Matching key and its hash, computed only once
+    dns_packet_compute_key(pkt);
+}
+
+/**
+ * Fill in the question and EDNS summary of the packet from the parsed data.
+ */
+static void
+dns_packet_set_summary(struct dns_packet *pkt, const struct dns_packet_parsed *pp)
+{
+    pkt->qname_size = pp->qname_size;
+    pkt->qtype = pp->qtype;
+    pkt->qclass = pp->qclass;
+    if (pp->opt_rdata) {
+        pkt->edns_present = 1;
+        pkt->edns_udp_size = pp->opt_class;
+        pkt->edns_ext_rcode = pp->opt_ttl >> 24;
+        pkt->edns_version = (pp->opt_ttl >> 16) & 0xff;
+        pkt->edns_do = !! (pp->opt_ttl & 0x8000);
+    }
+}
+
+dns_ret_t
+dns_packet_create_from_net(const struct dns_packet_net *net, struct dns_packet **pktp, struct dns_packet_arena *arena,
+                           uint32_t fields, int compact)
+{
+    assert(net && pktp);
+    *pktp = NULL;
+
+    struct dns_packet_parsed pp;
+    dns_ret_t r = dns_packet_parse_wire(net->dns_data, net->dns_data_size, fields, &pp);
+    if (r != DNS_RET_OK)
+        return r;
+
+    // Packet struct allocation with the DNS data and EDNS options copies in the same block
+    size_t data_size = dns_packet_kept_size(&pp, compact);
+    struct dns_packet *pkt = dns_packet_create(arena, net->dns_data, data_size, pp.opt_rdata ? pp.opt_rdlen : 0);
+    if (pp.opt_rdata)
+        memcpy(pkt->edns_data, pp.opt_rdata, pkt->edns_data_size);
+
+    dns_packet_set_net(pkt, net);
+    dns_packet_set_summary(pkt, &pp);
+
     *pktp = pkt;
     return DNS_RET_OK;
 }
 
+dns_ret_t
+dns_packet_create_unparsed(const struct dns_packet_net *net, struct dns_packet **pktp, struct dns_packet_arena *arena)
+{
+    assert(net && pktp);
+    *pktp = NULL;
+    if (net->dns_data_size < KNOT_WIRE_HEADER_SIZE || net->dns_data_size > KNOT_WIRE_MAX_PKTSIZE)
+        return DNS_RET_DROP_MALF;
+
+    struct dns_packet *pkt = dns_packet_create(arena, net->dns_data, net->dns_data_size, 0);
+    dns_packet_set_net(pkt, net);
+    pkt->unparsed = 1;
+
+    *pktp = pkt;
+    return DNS_RET_OK;
+}
+
+dns_ret_t
+dns_packet_parse(struct dns_packet *pkt, uint32_t fields, int compact)
+{
+    assert(pkt && pkt->unparsed);
+
+    struct dns_packet_parsed pp;
+    dns_ret_t r = dns_packet_parse_wire(pkt->dns_data, pkt->dns_data_size, fields, &pp);
+    if (r != DNS_RET_OK)
+        return r;
+
+    // The EDNS options are referenced in the full DNS data, or moved right after the compact ones
+    size_t data_size = dns_packet_kept_size(&pp, compact);
+    if (pp.opt_rdata) {
+        pkt->edns_data = pkt->dns_data + (compact ? data_size : (size_t)(pp.opt_rdata - pkt->dns_data));
+        pkt->edns_data_size = pp.opt_rdlen;
+        memmove(pkt->edns_data, pp.opt_rdata, pp.opt_rdlen);
+    }
+    pkt->dns_data_size = data_size;
+    dns_packet_set_summary(pkt, &pp);
+    pkt->unparsed = 0;
+    return DNS_RET_OK;
+}
+
+uint8_t *
+dns_packet_edns_option(const struct dns_packet *pkt, uint16_t code)
+{
+    const size_t opt_hdr = 2 * sizeof(uint16_t); // Option code and length
+    size_t pos = 0;
+    while (pkt->edns_data && pos + opt_hdr <= pkt->edns_data_size) {
+        uint8_t *opt = pkt->edns_data + pos;
+        size_t len = knot_wire_read_u16(opt + sizeof(uint16_t));
+        if (pos + opt_hdr + len > pkt->edns_data_size)
+            break; // Malformed option list
+        if (knot_wire_read_u16(opt) == code)
+            return opt;
+        pos += opt_hdr + len;
+    }
+    return NULL;
+}
+
 void
 dns_packet_destroy(struct dns_packet *pkt)
 {
     if (pkt->response)
         dns_packet_destroy(pkt->response);
-    knot_pkt_free(&pkt->knot_packet);
-    xfree(pkt->dns_data);
-    xfree(pkt);
+    if (pkt->arena)
+        dns_packet_arena_release(pkt->arena);
+    else
+        xfree(pkt);
 }
 
-dns_hash_value_t
-dns_packet_primary_hash(const dns_packet_t* pkt, dns_hash_value_t param)
+void
+dns_packet_compute_key(struct dns_packet *pkt)
 {
-    assert(pkt && param > 0x100);
-
-    dns_hash_value_t hash = 0;
-    hash += (dns_hash_value_t)(DNS_PACKET_AF(pkt)) << 0;
-    hash += (dns_hash_value_t)(pkt->net_protocol) << 16;
-    // Treat src and dst symmetrically
-    hash += (dns_hash_value_t)(DNS_SOCKADDR_PORT(&pkt->dst_addr)) << 32;
-    hash += (dns_hash_value_t)(DNS_SOCKADDR_PORT(&pkt->src_addr)) << 32;
-    hash += (dns_hash_value_t)(pkt->dns_id) << 48;
-    hash = hash % param;
-
-    for (int i = 0; i < DNS_SOCKADDR_ADDRLEN(&pkt->src_addr) / 4; i++) {
-        // Treat src and dst symmetrically
-        hash += ((dns_hash_value_t)((uint32_t *)(DNS_SOCKADDR_ADDR(&pkt->src_addr)))[i]) << 32;
-        hash += ((dns_hash_value_t)((uint32_t *)(DNS_SOCKADDR_ADDR(&pkt->dst_addr)))[i]) << 32;
-        hash = hash % param;
-    }
-
-    return hash;
+    assert(pkt);
+    struct dns_packet_key *key = &pkt->key;
+
+    memset(key, 0, sizeof(struct dns_packet_key));
+    key->af = DNS_PACKET_AF(pkt);
+    key->net_protocol = pkt->net_protocol;
+    key->dns_id = pkt->dns_id;
+    key->client_port = DNS_PACKET_CLIENT_PORT(pkt);
+    key->server_port = DNS_PACKET_SERVER_PORT(pkt);
+    memcpy(key->client_addr, DNS_PACKET_CLIENT_ADDR(pkt), DNS_PACKET_ADDRLEN(pkt));
+    memcpy(key->server_addr, DNS_PACKET_SERVER_ADDR(pkt), DNS_PACKET_ADDRLEN(pkt));
+    pkt->key_hash = dns_packet_key_hash(key);
 }
 
-
 int
 dns_packet_qname_match(struct dns_packet *request, struct dns_packet *response)
 {
     assert(request && response);
     assert(DNS_PACKET_IS_REQUEST(request) &&
            DNS_PACKET_IS_RESPONSE(response));
-    if (response->knot_packet->qname_size == 1)
+    if (response->qname_size == 1)
         return 1;
-    if (request->knot_packet->qname_size != response->knot_packet->qname_size)
+    if (request->qname_size != response->qname_size)
         return 0;
-    const knot_dname_t *req_q = knot_pkt_qname(request->knot_packet);
-    const knot_dname_t *res_q = knot_pkt_qname(response->knot_packet);
+    const knot_dname_t *req_q = DNS_PACKET_QNAME(request);
+    const knot_dname_t *res_q = DNS_PACKET_QNAME(response);
     if (res_q == NULL && req_q == NULL)
         return 1;
     return (req_q && res_q && knot_dname_is_equal(res_q, req_q));
@@ -233,27 +491,7 @@ dns_packet_primary_match(const struct dns_packet* pkt1, const struct dns_packet*
 {
     assert(pkt1 && pkt2);
 
-    const int addr_len = DNS_SOCKADDR_ADDRLEN(&pkt1->src_addr);
-
-    // Compare AF, proto, DNS ID
-    if (DNS_PACKET_AF(pkt1) != DNS_PACKET_AF(pkt2) ||
-        pkt1->net_protocol != pkt2->net_protocol ||
-        pkt1->dns_id != pkt2->dns_id) return 0;
-
-    if ((!DNS_PACKET_IS_REQUEST(pkt1)) == (!DNS_PACKET_IS_REQUEST(pkt2))) {
-        // Same direction, comapre src-src, dst-dst
-        return (
-            DNS_SOCKADDR_PORT(&pkt1->src_addr) == DNS_SOCKADDR_PORT(&pkt2->src_addr) &&
-            DNS_SOCKADDR_PORT(&pkt1->dst_addr) == DNS_SOCKADDR_PORT(&pkt2->dst_addr) &&
-            memcmp(DNS_SOCKADDR_ADDR(&pkt1->src_addr), DNS_SOCKADDR_ADDR(&pkt2->src_addr), addr_len) == 0 &&
-            memcmp(DNS_SOCKADDR_ADDR(&pkt1->dst_addr), DNS_SOCKADDR_ADDR(&pkt2->dst_addr), addr_len) == 0);
-    } else {
-        // Different directions, compare src-dst and vice versa
-        return (
-            DNS_SOCKADDR_PORT(&pkt1->src_addr) == DNS_SOCKADDR_PORT(&pkt2->dst_addr) &&
-            DNS_SOCKADDR_PORT(&pkt1->dst_addr) == DNS_SOCKADDR_PORT(&pkt2->src_addr) &&
-            memcmp(DNS_SOCKADDR_ADDR(&pkt1->src_addr), DNS_SOCKADDR_ADDR(&pkt2->dst_addr), addr_len) == 0 &&
-            memcmp(DNS_SOCKADDR_ADDR(&pkt1->dst_addr), DNS_SOCKADDR_ADDR(&pkt2->src_addr), addr_len) == 0);
-    }
+    return (pkt1->key_hash == pkt2->key_hash &&
+            memcmp(&pkt1->key, &pkt2->key, sizeof(struct dns_packet_key)) == 0);
 }
 
@@ -31,11 +31,14 @@
 
 #include "common.h"
 #include "packet_hash.h"
+#include "packet_arena.h"
 
 #define DNS_PACKET_FROM_SECNODE(cnodep) (SKIP_BACK(struct dns_packet, secnode, (cnodep)))
 
 /**
  * Main structure storing the packet data and parsed values.
+ * Allocated as a single block together with the DNS data and EDNS options copies
+ * (see `dns_packet_create()`).
  */
 
 struct dns_packet {
@@ -73,7 +76,8 @@ struct dns_packet {
      * The response packet is then owned by this packet. */
     struct dns_packet *response;
 
-    /** DNS data copy, owned by the packet. */
+    /** DNS data copy, stored in the packet allocation right after the struct.
+     * In a compact packet, only the DNS header and the question are kept. */
     uint8_t *dns_data;
 
     /** Actual length of dns_data. */
@@ -82,13 +86,46 @@ struct dns_packet {
     /** Length of the DNS data befora any shortening. */
     size_t dns_data_size_orig;
 
-    /** libknot packet structure for DNS parsing. Owned by the packet.
-     * Should be parsed at least until the question (QNAME, type, class) after creation.
-     * Requests are fully parsed (all RRs). */
-    knot_pkt_t *knot_packet;
+    /** QTYPE and QCLASS (0 when there is no question) */
+    uint16_t qtype, qclass;
+
+    /** Length of the wire QNAME at `DNS_PACKET_QNAME_OFFSET` in `dns_data`, 0 when there is no question */
+    uint16_t qname_size;
+
+    /** Request EDNS summary (responses are only parsed up to the question),
+     * only extracted when EDNS fields are output. Valid only with `edns_present` set. */
+    uint8_t edns_present;
+    uint8_t edns_version;
+    uint8_t edns_do;
+    uint8_t edns_ext_rcode;
+    uint16_t edns_udp_size;
+
+    /** Copy of the request OPT RR RDATA (the EDNS options), stored in the packet allocation after `dns_data`.
+     * NULL when not present or when no EDNS fields are output. */
+    uint8_t *edns_data;
+
+    /** Length of edns_data. */
+    uint16_t edns_data_size;
+
+    /** The arena the packet is allocated from (holding a reference to it),
+     * NULL when allocated on the heap. */
+    struct dns_packet_arena *arena;
 
     /** Estimate of total packet memory size (for resource limiting) */
     size_t memory_size;
+
+    /** Primary matching key, computed by `dns_packet_compute_key()` on creation. */
+    struct dns_packet_key key;
+
+    /** Keyed hash of `key`, used for request/response matching and matcher sharding. */
+    dns_hash_value_t key_hash;
+
+    /** Input sequence number, used to restore the input order after sharded matching. */
+    uint64_t seq;
+
+    /** Set while the DNS data are not parsed yet: only the network data, the DNS ID and the key
+     * are valid (see `dns_packet_create_unparsed()`). */
+    uint8_t unparsed;
 };
 
 
@@ -99,7 +136,7 @@ struct dns_packet {
 #define DNS_PACKET_IS_REQUEST(pkt) (! DNS_PACKET_IS_RESPONSE(pkt))
 
 /** Is the packet DNS response? */
-#define DNS_PACKET_IS_RESPONSE(pkt) (knot_wire_get_qr((pkt)->knot_packet->wire) != 0)
+#define DNS_PACKET_IS_RESPONSE(pkt) (knot_wire_get_qr((pkt)->dns_data) != 0)
 
 /** Return the request part of the query (or NULL if response-only) */
 #define DNS_PACKET_REQUEST(pkt) (DNS_PACKET_IS_REQUEST(pkt) ? (pkt) : NULL)
@@ -107,6 +144,12 @@ struct dns_packet {
 /** Return the response part of the query (or NULL if request-only) */
 #define DNS_PACKET_RESPONSE(pkt) (DNS_PACKET_IS_RESPONSE(pkt) ? (pkt) : (pkt)->response)
 
+/** Offset of the QNAME in the DNS data */
+#define DNS_PACKET_QNAME_OFFSET KNOT_WIRE_HEADER_SIZE
+
+/** Return the wire QNAME of the packet (or NULL if there is no question) */
+#define DNS_PACKET_QNAME(pkt) ((pkt)->qname_size ? (const knot_dname_t *)((pkt)->dns_data + DNS_PACKET_QNAME_OFFSET) : NULL)
+
 /** @} */
 
 /** @name Getters for `struct sockaddr` properties */
@@ -154,22 +197,141 @@ struct dns_packet {
 
 /** @} */
 
+/**
+ * Network and transport layer data of a captured packet, extracted before parsing its DNS data.
+ * Filled in by `dns_packet_create_from_libtrace()` or a decoder of the raw packet data
+ * (see `packet_decode.h`).
+ */
+struct dns_packet_net {
+    /** Timestamp [us since Epoch] */
+    dns_us_time_t ts;
+
+    /** Source and destination addresses and ports, as in `struct dns_packet` */
+    struct sockaddr_in6 src_addr, dst_addr;
+
+    /** Transport layer protocol number */
+    uint8_t protocol;
+
+    /** IPv4 TTL or IPv6 hop limit */
+    uint8_t ttl;
+
+    /** UDP checksum (host order), 0 for other transports */
+    uint16_t udp_sum;
+
+    /** Length of the packet on the wire */
+    size_t wire_size;
+
+    /** The captured DNS data (after any TCP length prefix), not owned */
+    const uint8_t *dns_data;
+
+    /** Captured length of `dns_data` */
+    size_t dns_data_size;
+
+    /** Length of the transport payload on the wire (including any TCP length prefix) */
+    size_t payload_size;
+
+    /** A fragment of an IP packet, filled in (with the addresses, `protocol` and `ttl`)
+     * when the decoder returns DNS_RET_DROP_FRAGMENTED (see `struct dns_defrag`). */
+    struct {
+        /** IPv4 identification or IPv6 fragment identification */
+        uint32_t id;
+        /** Offset of the fragment data in the IP payload */
+        uint32_t offset;
+        /** Set when more fragments follow */
+        uint8_t more;
+        /** The fragment data, not owned. NULL when not captured in full. */
+        const uint8_t *data;
+        /** Length of the fragment data */
+        size_t size;
+    } frag;
+
+    /** A TCP segment, filled in by the single pass decoders for TCP (see `struct dns_tcp`),
+     * `data` is NULL otherwise. */
+    struct {
+        /** Sequence number of the segment */
+        uint32_t seq;
+        /** TCP flags (`DNS_TCP_*`) */
+        uint8_t flags;
+        /** The captured segment payload (the DNS messages with their length prefixes), not owned */
+        const uint8_t *data;
+        /** Captured length of `data`, `payload_size` on the wire */
+        size_t size;
+    } tcp;
+};
+
 /**
  * Allocate and initialise `struct dns_packet` from given data.
- * The data is copied (need not dtay valid afterwards).
- * Initializes knot_packet but no parsing is done.
- * When dns_data == NULL allocates new block.
+ * The struct, the DNS data copy and space for `edns_data_size` bytes of EDNS options
+ * are allocated as a single block from the given arena (or the heap when NULL),
+ * freed by `dns_packet_destroy()`.
+ * The data is copied (need not stay valid afterwards), no parsing is done.
+ * When dns_data == NULL the DNS data are zeroed.
  */
 struct dns_packet*
-dns_packet_create(void *dns_data, size_t dns_data_size);
+dns_packet_create(struct dns_packet_arena *arena, const void *dns_data, size_t dns_data_size, size_t edns_data_size);
 
 /**
  * Create `dns_packet` from a given `libtrace_packet_t`.
+ * The DNS data are only parsed as deep as the output fields need: the header and the question
+ * are always checked and extracted into the `dns_packet`, the RRs of requests are checked
+ * to fit (without parsing their RDATA) unless only header fields are output, and the request
+ * OPT RR is only kept when EDNS fields are output.
  * Copies DNS data from the packet, so the libtrace_packet_t is free to be reused.
  * The new packet address is stored in pktp when successfull (DNS_RET_OK).
+ * `fields` is the bitmap of the output fields (`1 << dns_field_*`) to extract.
+ * With `compact` set, only the DNS header and the question are copied
+ * (all the output fields are then served from the packet struct, the kept DNS data
+ * and the EDNS options copy).
+ * The packet is allocated from `arena` (or the heap when NULL).
+ * Extracts the network data with libtrace, see `dns_packet_create_from_net()`.
+ */
+dns_ret_t
+dns_packet_create_from_libtrace(libtrace_packet_t *tp, struct dns_packet **pktp, struct dns_packet_arena *arena,
+                                uint32_t fields, int compact);
+
+/**
+ * Create `dns_packet` from the given network data, parsing the DNS data
+ * as `dns_packet_create_from_libtrace()` does. Copies the DNS data, so they
+ * are free to be reused when this returns.
+ */
+dns_ret_t
+dns_packet_create_from_net(const struct dns_packet_net *net, struct dns_packet **pktp, struct dns_packet_arena *arena,
+                           uint32_t fields, int compact);
+
+/**
+ * Extract the network data of a `libtrace_packet_t`, decoding the common link types
+ * in a single pass (see `packet_decode.h`) and the others with libtrace.
+ * `net->dns_data` points into the libtrace packet.
+ * For IP fragments decoded in a single pass, returns DNS_RET_DROP_FRAGMENTED with
+ * `net->frag` filled in (see `struct dns_defrag`).
  */
 dns_ret_t
-dns_packet_create_from_libtrace(libtrace_packet_t *tp, struct dns_packet **pktp);
+dns_packet_net_from_libtrace(libtrace_packet_t *tp, struct dns_packet_net *net);
+
+/**
+ * Create an unparsed `dns_packet` from the given network data, copying all the DNS data.
+ * Only checks that the DNS header is present, the DNS ID and the key are filled in
+ * so the packet can be shed or sharded, the rest is left to `dns_packet_parse()`
+ * (possibly in another thread).
+ */
+dns_ret_t
+dns_packet_create_unparsed(const struct dns_packet_net *net, struct dns_packet **pktp, struct dns_packet_arena *arena);
+
+/**
+ * Parse the DNS data of an unparsed packet as `dns_packet_create_from_libtrace()` does,
+ * in place: the DNS data are shortened and the EDNS options kept within the allocation.
+ * On error, the packet is left unparsed for the caller to destroy.
+ */
+dns_ret_t
+dns_packet_parse(struct dns_packet *pkt, uint32_t fields, int compact);
+
+/**
+ * Find the EDNS option with the given code in the request EDNS options copy.
+ * Returns a pointer to the option (starting with the option code and length, as `knot_edns_get_option()`)
+ * or NULL when not found.
+ */
+uint8_t *
+dns_packet_edns_option(const struct dns_packet *pkt, uint16_t code);
 
 /**
  * Free a given packet and its owned data.
@@ -178,13 +340,13 @@ void
 dns_packet_destroy(struct dns_packet *pkt);
 
 /**
- * Compute a packet hash function parameterized by `param`, caching the value.
- * `param` is used as a modulus - make sure it is large enough.
- * Uses IPver, TCP/UDP, both port numbers (summetrically), both IPs (summetrically), DNS ID.
- * Does not use QNAME.
+ * Compute the primary key of the packet (IPver, TCP/UDP, both ports, both IPs, DNS ID),
+ * normalized to the request direction (client and server side), and its keyed hash,
+ * caching both in the packet. Does not use QNAME.
+ * Needs the addresses, ports, protocol and DNS ID to be set.
  */
-dns_hash_value_t
-dns_packet_primary_hash(const dns_packet_t* pkt, dns_hash_value_t param);
+void
+dns_packet_compute_key(struct dns_packet *pkt);
 
 /**
  * Compare two packets as request+response by teir QNAME.
@@ -198,8 +360,7 @@ dns_packet_qname_match(struct dns_packet *request, struct dns_packet *response);
 
 /**
  * Compare two packets by their (IPver, TCP/UDP, both port numbers, both IPs and DNS ID).
- * Takes into account which of the packets are request and response (if same type,
- * compares src1 to src2, dest1 to dest2, if different type, src1 to dest2, dest1 to src2).
+ * Compares the cached direction-normalized keys, so a request matches its response.
  * Return true when they match, false otherwise.
  */
 int
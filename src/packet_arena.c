@@ -0,0 +1,75 @@
+/* 
+ *  Copyright (C) 2016 CZ.NIC, z.s.p.o.
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdlib.h>
+#include <assert.h>
+#include <pthread.h>
+
+#include "packet_arena.h"
+#include <ucw/mempool.h>
+
+/** Free arenas kept for reuse, shared by all the threads */
+static clist dns_packet_arena_free_list = { .head = { &dns_packet_arena_free_list.head, &dns_packet_arena_free_list.head } };
+static size_t dns_packet_arena_free_count = 0;
+static pthread_mutex_t dns_packet_arena_free_lock = PTHREAD_MUTEX_INITIALIZER;
+
+struct dns_packet_arena *
+dns_packet_arena_create(void)
+{
+    pthread_mutex_lock(&dns_packet_arena_free_lock);
+    struct dns_packet_arena *arena = clist_remove_head(&dns_packet_arena_free_list);
+    if (arena)
+        dns_packet_arena_free_count --;
+    pthread_mutex_unlock(&dns_packet_arena_free_lock);
+
+    if (!arena) {
+        arena = xmalloc_zero(sizeof(struct dns_packet_arena));
+        arena->pool = mp_new(DNS_PACKET_ARENA_CHUNK_SIZE);
+    }
+    atomic_init(&arena->refcount, 1);
+    return arena;
+}
+
+void *
+dns_packet_arena_alloc(struct dns_packet_arena *arena, size_t size)
+{
+    assert(arena && atomic_load_explicit(&arena->refcount, memory_order_relaxed) > 0);
+    atomic_fetch_add_explicit(&arena->refcount, 1, memory_order_relaxed);
+    return mp_alloc(arena->pool, size);
+}
+
+void
+dns_packet_arena_release(struct dns_packet_arena *arena)
+{
+    assert(arena);
+    // Release ordering makes all the uses of the allocations happen before the flush
+    if (atomic_fetch_sub_explicit(&arena->refcount, 1, memory_order_acq_rel) != 1)
+        return;
+
+    mp_flush(arena->pool);
+    pthread_mutex_lock(&dns_packet_arena_free_lock);
+    if (dns_packet_arena_free_count < DNS_PACKET_ARENA_MAX_FREE) {
+        clist_add_tail(&dns_packet_arena_free_list, &arena->node);
+        dns_packet_arena_free_count ++;
+        arena = NULL;
+    }
+    pthread_mutex_unlock(&dns_packet_arena_free_lock);
+    if (arena) {
+        mp_delete(arena->pool);
+        free(arena);
+    }
+}
@@ -0,0 +1,79 @@
+/* 
+ *  Copyright (C) 2016 CZ.NIC, z.s.p.o.
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef DNSCOL_PACKET_ARENA_H
+#define DNSCOL_PACKET_ARENA_H
+
+#include <stdatomic.h>
+
+#include "common.h"
+
+/**
+ * \file packet_arena.h
+ * Reference-counted bump allocation arenas for packets.
+ */
+
+struct mempool;
+
+/** Chunk size of the arena mempools */
+#define DNS_PACKET_ARENA_CHUNK_SIZE 65536
+
+/** Maximum number of free arenas kept for reuse */
+#define DNS_PACKET_ARENA_MAX_FREE 64
+
+/**
+ * A mempool the packets of one input frame are allocated from.
+ *
+ * Only the creating thread allocates from the arena. Every allocation holds a reference,
+ * the creator holds one more until it calls `dns_packet_arena_release()`. Freeing
+ * an allocation just drops its reference (from any thread), and the whole arena
+ * is flushed and returned for reuse in one operation when the last reference is gone.
+ * Packets outliving their frame (e.g. in the matching window) keep the arena alive,
+ * so the memory of a frame is reclaimed in bulk once its last packet leaves the output.
+ */
+struct dns_packet_arena {
+    /** Node in the list of free arenas */
+    cnode node;
+
+    /** The memory pool, owned */
+    struct mempool *pool;
+
+    /** Number of live allocations + 1 for the creator */
+    atomic_uint refcount;
+};
+
+/**
+ * Get an empty arena (reused or newly allocated), holding a reference for the caller.
+ */
+struct dns_packet_arena *
+dns_packet_arena_create(void);
+
+/**
+ * Allocate a block from the arena, taking a reference. Only the thread creating
+ * the arena may allocate, and only until it releases its reference.
+ */
+void *
+dns_packet_arena_alloc(struct dns_packet_arena *arena, size_t size);
+
+/**
+ * Drop a reference (of an allocation or the creator) to the arena.
+ * Any thread may drop a reference, the last one returns the arena for reuse.
+ */
+void
+dns_packet_arena_release(struct dns_packet_arena *arena);
+
+#endif /* DNSCOL_PACKET_ARENA_H */
@@ -0,0 +1,365 @@
+/*
+ *  Copyright (C) 2016 CZ.NIC, z.s.p.o.
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <string.h>
+#include <netinet/in.h>
+
+#include "packet_decode.h"
+
+#define DNS_ETHERTYPE_IPV4 0x0800
+#define DNS_ETHERTYPE_IPV6 0x86DD
+#define DNS_ETHERTYPE_VLAN 0x8100
+#define DNS_ETHERTYPE_QINQ 0x88A8
+#define DNS_ETHERTYPE_QINQ_OLD 0x9100
+#define DNS_ETHERTYPE_MPLS 0x8847
+#define DNS_ETHERTYPE_MPLS_MULTICAST 0x8848
+#define DNS_ETHERTYPE_PPPOE_SESSION 0x8864
+
+/** PPP protocols of the PPPoE session payload */
+#define DNS_PPP_IPV4 0x0021
+#define DNS_PPP_IPV6 0x0057
+
+/** Pcap link types (LINKTYPE_*, mostly equal to DLT_*) */
+#define DNS_DLT_NULL 0
+#define DNS_DLT_EN10MB 1
+#define DNS_DLT_RAW 12
+#define DNS_DLT_RAW_OPENBSD 14
+#define DNS_DLT_LINKTYPE_RAW 101
+#define DNS_DLT_LOOP 108
+#define DNS_DLT_LINUX_SLL 113
+#define DNS_DLT_IPV4 228
+#define DNS_DLT_IPV6 229
+
+/** Size of the address family header of DLT_NULL and DLT_LOOP */
+#define DNS_NULL_HEADER_SIZE 4
+
+#define DNS_ETHER_HEADER_SIZE 14
+#define DNS_VLAN_TAG_SIZE 4
+#define DNS_MPLS_LABEL_SIZE 4
+/** PPPoE session header with the PPP protocol */
+#define DNS_PPPOE_HEADER_SIZE 8
+#define DNS_SLL_HEADER_SIZE 16
+#define DNS_IPV4_HEADER_SIZE 20
+#define DNS_IPV6_HEADER_SIZE 40
+#define DNS_UDP_HEADER_SIZE 8
+#define DNS_TCP_HEADER_SIZE 20
+#define DNS_ICMP_HEADER_SIZE 8
+
+dns_ret_t
+dns_packet_decode_transport(const uint8_t *data, size_t caplen, size_t len, struct dns_packet_net *net)
+{
+    net->tcp.data = NULL;
+    switch (net->protocol) {
+    case IPPROTO_UDP:
+        if (caplen < DNS_UDP_HEADER_SIZE || len < DNS_UDP_HEADER_SIZE)
+            return DNS_RET_DROP_NETWORK;
+        net->src_addr.sin6_port = htons(knot_wire_read_u16(data));
+        net->dst_addr.sin6_port = htons(knot_wire_read_u16(data + 2));
+        net->udp_sum = knot_wire_read_u16(data + 6);
+        net->dns_data = data + DNS_UDP_HEADER_SIZE;
+        net->payload_size = len - DNS_UDP_HEADER_SIZE;
+        net->dns_data_size = caplen - DNS_UDP_HEADER_SIZE;
+        break;
+
+    case IPPROTO_TCP:
+        if (caplen < DNS_TCP_HEADER_SIZE || len < DNS_TCP_HEADER_SIZE)
+            return DNS_RET_DROP_NETWORK;
+        size_t hdr_size = (data[12] >> 4) * 4;
+        if (hdr_size < DNS_TCP_HEADER_SIZE || caplen < hdr_size || len < hdr_size)
+            return DNS_RET_DROP_NETWORK;
+        net->src_addr.sin6_port = htons(knot_wire_read_u16(data));
+        net->dst_addr.sin6_port = htons(knot_wire_read_u16(data + 2));
+        net->udp_sum = 0;
+        net->payload_size = len - hdr_size;
+        // The segment for the stream reassembly, the captured data may contain link layer padding
+        net->tcp.seq = knot_wire_read_u32(data + 4);
+        net->tcp.flags = data[13];
+        net->tcp.data = data + hdr_size;
+        net->tcp.size = MIN(caplen, len) - hdr_size;
+        // Without the reassembly, exactly one DNS message per segment (no SYN/FIN, as with libtrace),
+        // verified by its length prefix
+        if ((data[13] & (DNS_TCP_SYN | DNS_TCP_FIN)) || net->payload_size < sizeof(uint16_t))
+            return DNS_RET_DROP_TRANSPORT;
+        if (caplen < hdr_size + sizeof(uint16_t))
+            return DNS_RET_DROP_NETWORK;
+        size_t message_size = knot_wire_read_u16(data + hdr_size);
+        if (message_size + sizeof(uint16_t) != net->payload_size)
+            return DNS_RET_DROP_TRANSPORT;
+        net->dns_data = data + hdr_size + sizeof(uint16_t);
+        net->dns_data_size = caplen - hdr_size - sizeof(uint16_t);
+        break;
+
+    case IPPROTO_ICMP:
+    case IPPROTO_ICMPV6:
+        // As with libtrace: the DNS data follow the ICMP header (the quoted packet of the error
+        // messages, so mostly dropped as malformed), no ports
+        net->udp_sum = 0;
+        if (caplen < DNS_ICMP_HEADER_SIZE || len < DNS_ICMP_HEADER_SIZE) {
+            net->dns_data = data;
+            net->payload_size = 0;
+            net->dns_data_size = 0;
+            return DNS_RET_OK;
+        }
+        net->dns_data = data + DNS_ICMP_HEADER_SIZE;
+        net->payload_size = len - DNS_ICMP_HEADER_SIZE;
+        net->dns_data_size = caplen - DNS_ICMP_HEADER_SIZE;
+        break;
+
+    default:
+        return DNS_RET_DROP_TRANSPORT;
+    }
+    // The captured data may contain link layer padding
+    net->dns_data_size = MIN(net->dns_data_size, len - (net->dns_data - data));
+    return DNS_RET_OK;
+}
+
+/**
+ * Decode the IPv4 packet at `data` and its transport header.
+ */
+static dns_ret_t
+dns_packet_decode_ipv4(const uint8_t *data, size_t caplen, struct dns_packet_net *net)
+{
+    if (caplen < DNS_IPV4_HEADER_SIZE || (data[0] >> 4) != 4)
+        return DNS_RET_DROP_NETWORK;
+    size_t hdr_size = (data[0] & 0x0f) * 4;
+    size_t total_size = knot_wire_read_u16(data + 2);
+    if (hdr_size < DNS_IPV4_HEADER_SIZE || caplen < hdr_size || total_size < hdr_size)
+        return DNS_RET_DROP_NETWORK;
+
+    struct sockaddr_in *src = (struct sockaddr_in *)&net->src_addr, *dst = (struct sockaddr_in *)&net->dst_addr;
+    memset(&net->src_addr, 0, sizeof(net->src_addr));
+    memset(&net->dst_addr, 0, sizeof(net->dst_addr));
+    src->sin_family = AF_INET;
+    dst->sin_family = AF_INET;
+    memcpy(&src->sin_addr, data + 12, sizeof(src->sin_addr));
+    memcpy(&dst->sin_addr, data + 16, sizeof(dst->sin_addr));
+    net->ttl = data[8];
+    net->protocol = data[9];
+
+    // More fragments flag or a fragment offset
+    uint16_t frag = knot_wire_read_u16(data + 6);
+    if (frag & 0x3fff) {
+        net->frag.id = knot_wire_read_u16(data + 4);
+        net->frag.offset = (frag & 0x1fff) * 8;
+        net->frag.more = !! (frag & 0x2000);
+        net->frag.data = (caplen >= total_size) ? data + hdr_size : NULL;
+        net->frag.size = total_size - hdr_size;
+        return DNS_RET_DROP_FRAGMENTED;
+    }
+
+    return dns_packet_decode_transport(data + hdr_size, caplen - hdr_size, total_size - hdr_size, net);
+}
+
+/**
+ * Decode the IPv6 packet at `data`, skipping any extension headers, and its transport header.
+ */
+static dns_ret_t
+dns_packet_decode_ipv6(const uint8_t *data, size_t caplen, struct dns_packet_net *net)
+{
+    if (caplen < DNS_IPV6_HEADER_SIZE || (data[0] >> 4) != 6)
+        return DNS_RET_DROP_NETWORK;
+    size_t payload_size = knot_wire_read_u16(data + 4);
+
+    memset(&net->src_addr, 0, sizeof(net->src_addr));
+    memset(&net->dst_addr, 0, sizeof(net->dst_addr));
+    net->src_addr.sin6_family = AF_INET6;
+    net->dst_addr.sin6_family = AF_INET6;
+    memcpy(&net->src_addr.sin6_addr, data + 8, sizeof(net->src_addr.sin6_addr));
+    memcpy(&net->dst_addr.sin6_addr, data + 24, sizeof(net->dst_addr.sin6_addr));
+    net->ttl = data[7];
+
+    uint8_t next = data[6];
+    size_t offset = DNS_IPV6_HEADER_SIZE;
+    while (1) {
+        size_t ext_size;
+        switch (next) {
+        case IPPROTO_HOPOPTS:
+        case IPPROTO_ROUTING:
+        case IPPROTO_DSTOPTS:
+            if (caplen < offset + 8)
+                return DNS_RET_DROP_NETWORK;
+            ext_size = (data[offset + 1] + 1) * 8;
+            break;
+        case IPPROTO_FRAGMENT:
+            if (caplen < offset + 8)
+                return DNS_RET_DROP_NETWORK;
+            // Fragment offset or more fragments flag, only atomic fragments pass
+            uint16_t frag = knot_wire_read_u16(data + offset + 2);
+            if (frag & 0xfff9) {
+                size_t frag_start = offset + 8;
+                if (frag_start - DNS_IPV6_HEADER_SIZE > payload_size)
+                    return DNS_RET_DROP_NETWORK;
+                net->protocol = data[offset];
+                net->frag.id = knot_wire_read_u32(data + offset + 4);
+                net->frag.offset = frag & 0xfff8;
+                net->frag.more = frag & 0x0001;
+                net->frag.size = payload_size - (frag_start - DNS_IPV6_HEADER_SIZE);
+                net->frag.data = (caplen >= frag_start + net->frag.size) ? data + frag_start : NULL;
+                return DNS_RET_DROP_FRAGMENTED;
+            }
+            ext_size = 8;
+            break;
+        case IPPROTO_AH:
+            if (caplen < offset + 8)
+                return DNS_RET_DROP_NETWORK;
+            ext_size = (data[offset + 1] + 2) * 4;
+            break;
+        default:
+            ext_size = 0;
+        }
+        if (ext_size == 0)
+            break;
+        next = data[offset];
+        offset += ext_size;
+        if (offset > caplen || offset - DNS_IPV6_HEADER_SIZE > payload_size)
+            return DNS_RET_DROP_NETWORK;
+    }
+    net->protocol = next;
+
+    return dns_packet_decode_transport(data + offset, caplen - offset,
+                                       payload_size - (offset - DNS_IPV6_HEADER_SIZE), net);
+}
+
+/**
+ * Decode the IP packet of the given ethertype, also carried over MPLS or in a PPPoE session.
+ * Other ethertypes carry no IP packet (as for libtrace, no transport layer is found).
+ */
+static dns_ret_t
+dns_packet_decode_ethertype(uint16_t ethertype, const uint8_t *data, size_t caplen, struct dns_packet_net *net)
+{
+    switch (ethertype) {
+    case DNS_ETHERTYPE_IPV4:
+        return dns_packet_decode_ipv4(data, caplen, net);
+    case DNS_ETHERTYPE_IPV6:
+        return dns_packet_decode_ipv6(data, caplen, net);
+    case DNS_ETHERTYPE_MPLS:
+    case DNS_ETHERTYPE_MPLS_MULTICAST:
+        // Any number of labels up to the bottom of the stack, the IP version tells the payload
+        while (1) {
+            if (caplen < DNS_MPLS_LABEL_SIZE)
+                return DNS_RET_DROP_NETWORK;
+            int bottom = data[2] & 0x01;
+            data += DNS_MPLS_LABEL_SIZE;
+            caplen -= DNS_MPLS_LABEL_SIZE;
+            if (bottom)
+                return dns_packet_decode_raw_ip(data, caplen, net);
+        }
+    case DNS_ETHERTYPE_PPPOE_SESSION:
+        if (caplen < DNS_PPPOE_HEADER_SIZE)
+            return DNS_RET_DROP_NETWORK;
+        switch (knot_wire_read_u16(data + 6)) {
+        case DNS_PPP_IPV4:
+            return dns_packet_decode_ipv4(data + DNS_PPPOE_HEADER_SIZE, caplen - DNS_PPPOE_HEADER_SIZE, net);
+        case DNS_PPP_IPV6:
+            return dns_packet_decode_ipv6(data + DNS_PPPOE_HEADER_SIZE, caplen - DNS_PPPOE_HEADER_SIZE, net);
+        default:
+            return DNS_RET_DROP_NETWORK;
+        }
+    default:
+        return DNS_RET_DROP_NETWORK;
+    }
+}
+
+dns_ret_t
+dns_packet_decode_ether(const uint8_t *data, size_t caplen, struct dns_packet_net *net)
+{
+    if (caplen < DNS_ETHER_HEADER_SIZE)
+        return DNS_RET_DROP_NETWORK;
+    uint16_t ethertype = knot_wire_read_u16(data + 12);
+    data += DNS_ETHER_HEADER_SIZE;
+    caplen -= DNS_ETHER_HEADER_SIZE;
+
+    // 802.1Q VLAN tags, any number of them (QinQ)
+    while (ethertype == DNS_ETHERTYPE_VLAN || ethertype == DNS_ETHERTYPE_QINQ ||
+           ethertype == DNS_ETHERTYPE_QINQ_OLD) {
+        if (caplen < DNS_VLAN_TAG_SIZE)
+            return DNS_RET_DROP_NETWORK;
+        ethertype = knot_wire_read_u16(data + 2);
+        data += DNS_VLAN_TAG_SIZE;
+        caplen -= DNS_VLAN_TAG_SIZE;
+    }
+
+    return dns_packet_decode_ethertype(ethertype, data, caplen, net);
+}
+
+dns_ret_t
+dns_packet_decode_sll(const uint8_t *data, size_t caplen, struct dns_packet_net *net)
+{
+    if (caplen < DNS_SLL_HEADER_SIZE)
+        return DNS_RET_DROP_NETWORK;
+    uint16_t ethertype = knot_wire_read_u16(data + 14);
+    return dns_packet_decode_ethertype(ethertype, data + DNS_SLL_HEADER_SIZE, caplen - DNS_SLL_HEADER_SIZE, net);
+}
+
+dns_ret_t
+dns_packet_decode_raw_ip(const uint8_t *data, size_t caplen, struct dns_packet_net *net)
+{
+    if (caplen < 1)
+        return DNS_RET_DROP_NETWORK;
+    switch (data[0] >> 4) {
+    case 4:
+        return dns_packet_decode_ipv4(data, caplen, net);
+    case 6:
+        return dns_packet_decode_ipv6(data, caplen, net);
+    default:
+        return DNS_RET_DROP_NETWORK;
+    }
+}
+
+int
+dns_packet_decode_dlt_supported(int dlt)
+{
+    switch (dlt) {
+    case DNS_DLT_NULL:
+    case DNS_DLT_EN10MB:
+    case DNS_DLT_RAW:
+    case DNS_DLT_RAW_OPENBSD:
+    case DNS_DLT_LINKTYPE_RAW:
+    case DNS_DLT_LOOP:
+    case DNS_DLT_LINUX_SLL:
+    case DNS_DLT_IPV4:
+    case DNS_DLT_IPV6:
+        return 1;
+    default:
+        return 0;
+    }
+}
+
+dns_ret_t
+dns_packet_decode_dlt(int dlt, const uint8_t *data, size_t caplen, struct dns_packet_net *net)
+{
+    switch (dlt) {
+    case DNS_DLT_EN10MB:
+        return dns_packet_decode_ether(data, caplen, net);
+    case DNS_DLT_LINUX_SLL:
+        return dns_packet_decode_sll(data, caplen, net);
+    case DNS_DLT_RAW:
+    case DNS_DLT_RAW_OPENBSD:
+    case DNS_DLT_LINKTYPE_RAW:
+    case DNS_DLT_IPV4:
+    case DNS_DLT_IPV6:
+        return dns_packet_decode_raw_ip(data, caplen, net);
+    case DNS_DLT_NULL:
+    case DNS_DLT_LOOP:
+        // Address family in the host or network byte order, the IP version tells the same
+        if (caplen < DNS_NULL_HEADER_SIZE)
+            return DNS_RET_DROP_NETWORK;
+        return dns_packet_decode_raw_ip(data + DNS_NULL_HEADER_SIZE, caplen - DNS_NULL_HEADER_SIZE, net);
+    default:
+        return DNS_RET_DROP_NETWORK;
+    }
+}
@@ -0,0 +1,82 @@
+/*
+ *  Copyright (C) 2016 CZ.NIC, z.s.p.o.
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef DNSCOL_PACKET_DECODE_H
+#define DNSCOL_PACKET_DECODE_H
+
+/**
+ * \file packet_decode.h
+ * Decoding of the link, network and transport layers of raw packet data.
+ */
+
+#include "common.h"
+#include "packet.h"
+
+/** TCP flags (in the 14th header byte, `net->tcp.flags`) */
+#define DNS_TCP_FIN 0x01
+#define DNS_TCP_SYN 0x02
+#define DNS_TCP_RST 0x04
+
+/**
+ * Decode an Ethernet frame of `caplen` captured bytes down to the DNS data in a single pass,
+ * reading the headers in place. Skips any 802.1Q/802.1ad VLAN tags, MPLS labels, PPPoE session
+ * headers and IPv6 extension headers.
+ * Fills in all of `net` except `ts` and `wire_size`, `net->dns_data` points into `data`.
+ * Returns DNS_RET_OK or the drop reason as `dns_packet_create_from_libtrace()`, with the
+ * ICMP payload taken as the DNS data as libtrace does.
+ * For IP fragments, returns DNS_RET_DROP_FRAGMENTED with the addresses, `protocol`, `ttl`
+ * and `frag` filled in.
+ */
+dns_ret_t
+dns_packet_decode_ether(const uint8_t *data, size_t caplen, struct dns_packet_net *net);
+
+/**
+ * Decode a Linux cooked capture (SLL) packet as `dns_packet_decode_ether()`.
+ */
+dns_ret_t
+dns_packet_decode_sll(const uint8_t *data, size_t caplen, struct dns_packet_net *net);
+
+/**
+ * Decode a raw IPv4 or IPv6 packet as `dns_packet_decode_ether()`.
+ */
+dns_ret_t
+dns_packet_decode_raw_ip(const uint8_t *data, size_t caplen, struct dns_packet_net *net);
+
+/**
+ * Decode the UDP, TCP or ICMP header at `data` with `caplen` bytes captured and `len` bytes
+ * of the IP payload on the wire, pointing `net->dns_data` at the DNS data.
+ * Uses `net->protocol`, fills in the ports and the transport and DNS data fields.
+ * For TCP, also fills in `net->tcp` (even when dropping the segment as not being exactly
+ * one DNS message), `net->tcp.data` is NULL for the other transports.
+ */
+dns_ret_t
+dns_packet_decode_transport(const uint8_t *data, size_t caplen, size_t len, struct dns_packet_net *net);
+
+/**
+ * Is the pcap link type (`LINKTYPE_*` of the pcap and pcapng files) supported by `dns_packet_decode_dlt()`?
+ */
+int
+dns_packet_decode_dlt_supported(int dlt);
+
+/**
+ * Decode a packet of the given pcap link type as `dns_packet_decode_ether()`.
+ * Returns DNS_RET_DROP_NETWORK for unsupported link types.
+ */
+dns_ret_t
+dns_packet_decode_dlt(int dlt, const uint8_t *data, size_t caplen, struct dns_packet_net *net);
+
+#endif /* DNSCOL_PACKET_DECODE_H */
@@ -0,0 +1,92 @@
+/* 
+ *  Copyright (C) 2016 CZ.NIC, z.s.p.o.
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+
+#include "packet_dedup.h"
+#include "packet_hash.h"
+
+/**
+ * The network data of a packet fingerprint.
+ * Unused address bytes (IPv4) are zero, so the struct can be hashed as a whole.
+ */
+struct dns_dedup_key {
+    uint8_t src_addr[16];
+    uint8_t dst_addr[16];
+    uint16_t src_port;
+    uint16_t dst_port;
+    uint16_t udp_sum;
+    uint8_t af;
+    uint8_t protocol;
+    uint32_t payload_size;
+    uint32_t dns_data_size;
+};
+
+struct dns_dedup *
+dns_dedup_create(struct dns_config *conf)
+{
+    struct dns_dedup *dd = xmalloc_zero(sizeof(struct dns_dedup));
+    dd->slots = xmalloc_zero(DNS_DEDUP_SLOTS * sizeof(struct dns_dedup_slot));
+    dd->window = dns_fsec_to_us_time(conf->input_dedup_window_sec);
+    return dd;
+}
+
+void
+dns_dedup_destroy(struct dns_dedup *dd)
+{
+    free(dd->slots);
+    free(dd);
+}
+
+int
+dns_dedup_check(struct dns_dedup *dd, const struct dns_packet_net *net)
+{
+    struct dns_dedup_key key;
+    memset(&key, 0, sizeof(key));
+    key.af = DNS_SOCKADDR_AF(&net->src_addr);
+    key.protocol = net->protocol;
+    key.src_port = net->src_addr.sin6_port;
+    key.dst_port = net->dst_addr.sin6_port;
+    key.udp_sum = net->udp_sum;
+    key.payload_size = net->payload_size;
+    key.dns_data_size = net->dns_data_size;
+    memcpy(key.src_addr, DNS_SOCKADDR_ADDR(&net->src_addr), DNS_SOCKADDR_ADDRLEN(&net->src_addr));
+    memcpy(key.dst_addr, DNS_SOCKADDR_ADDR(&net->dst_addr), DNS_SOCKADDR_ADDRLEN(&net->dst_addr));
+    // Odd multiplier, so the combination stays a good hash of both parts
+    dns_hash_value_t hash = dns_hash_data(&key, sizeof(key)) ^
+                            (dns_hash_data(net->dns_data, net->dns_data_size) * 0x9e3779b97f4a7c15ULL);
+
+    dd->checked ++;
+    struct dns_dedup_slot *slot = &dd->slots[hash & (DNS_DEDUP_SLOTS - 1)];
+    if (slot->hash == hash && net->ts <= slot->ts + dd->window && slot->ts <= net->ts + dd->window) {
+        // Keep the time of the first copy, so even a burst of copies stays within the window
+        dd->duplicates ++;
+        return 1;
+    }
+    slot->hash = hash;
+    slot->ts = net->ts;
+    return 0;
+}
+
+void
+dns_dedup_report(struct dns_dedup *dd, const char *name)
+{
+    msg(L_INFO, "%s dedup: %"PRIu64" duplicates of %"PRIu64" packets (%.3lg%%)",
+        name, dd->duplicates, dd->checked, dd->checked ? 100.0 * dd->duplicates / dd->checked : 0.0);
+}
@@ -0,0 +1,89 @@
+/* 
+ *  Copyright (C) 2016 CZ.NIC, z.s.p.o.
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef DNSCOL_PACKET_DEDUP_H
+#define DNSCOL_PACKET_DEDUP_H
+
+#include "common.h"
+#include "config.h"
+#include "packet.h"
+
+/**
+ * \file packet_dedup.h
+ * Suppression of duplicate captured packets.
+ */
+
+/** Number of the fingerprint slots (a power of two) */
+#define DNS_DEDUP_SLOTS (1 << 17)
+
+/**
+ * A fingerprint of a recently seen packet.
+ */
+struct dns_dedup_slot {
+    dns_hash_value_t hash;
+    dns_us_time_t ts;
+};
+
+/**
+ * Duplicate packet filter of one input thread, for captures seeing some packets twice
+ * (e.g. SPAN ports mirroring both directions, bonded links).
+ *
+ * Every packet is fingerprinted by a keyed hash of its network data (the addresses, ports,
+ * transport, lengths and UDP checksum) and its DNS data, ignoring the link layer and the TTL.
+ * A packet with the same fingerprint as a packet seen at most the window before (or after,
+ * allowing for capture jitter) is a duplicate. The fingerprints are kept in a direct-mapped
+ * table, overwriting on collisions, so the check is O(1) and a duplicate may rarely be missed,
+ * but a unique packet is never dropped (up to 64-bit hash collisions within the window).
+ */
+struct dns_dedup {
+    /** The fingerprint table of `DNS_DEDUP_SLOTS` slots, owned */
+    struct dns_dedup_slot *slots;
+
+    /** Maximum time between a packet and its duplicate */
+    dns_us_time_t window;
+
+    /** Statistics: checked packets and dropped duplicates */
+    uint64_t checked;
+    uint64_t duplicates;
+};
+
+/**
+ * Create a duplicate filter with the configured window.
+ */
+struct dns_dedup *
+dns_dedup_create(struct dns_config *conf);
+
+/**
+ * Free the filter.
+ */
+void
+dns_dedup_destroy(struct dns_dedup *dd);
+
+/**
+ * Check the packet described by `net` (with `ts` set and `dns_data` valid), remembering it.
+ * Returns 1 when it is a duplicate of a recently seen packet, 0 otherwise.
+ */
+int
+dns_dedup_check(struct dns_dedup *dd, const struct dns_packet_net *net);
+
+/**
+ * Log the duplicate statistics.
+ */
+void
+dns_dedup_report(struct dns_dedup *dd, const char *name);
+
+#endif /* DNSCOL_PACKET_DEDUP_H */
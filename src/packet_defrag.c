@@ -0,0 +1,241 @@
+/* 
+ *  Copyright (C) 2016 CZ.NIC, z.s.p.o.
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <inttypes.h>
+#include <netinet/in.h>
+
+#include "packet_defrag.h"
+#include "packet_decode.h"
+#include "packet_hash.h"
+
+/** Allocation granularity of the entry payload buffers */
+#define DNS_DEFRAG_ALLOC_STEP 512
+
+struct dns_defrag *
+dns_defrag_create(struct dns_config *conf)
+{
+    struct dns_defrag *df = xmalloc_zero(sizeof(struct dns_defrag));
+    df->max_memory = conf->input_defrag_memory;
+    df->timeout = dns_fsec_to_us_time(conf->input_defrag_timeout_sec);
+    clist_init(&df->entries);
+
+    // About one chain per entry fitting into the memory limit
+    size_t buckets = 64;
+    while (buckets < df->max_memory / sizeof(struct dns_defrag_entry))
+        buckets *= 2;
+    df->buckets = xmalloc_zero(buckets * sizeof(struct dns_defrag_entry *));
+    df->mask = buckets - 1;
+    return df;
+}
+
+/**
+ * Free the entry, which must not be in the table.
+ */
+static void
+dns_defrag_entry_free(struct dns_defrag *df, struct dns_defrag_entry *e)
+{
+    df->memory -= sizeof(struct dns_defrag_entry) + e->capacity;
+    free(e->data);
+    free(e);
+}
+
+/**
+ * Remove the entry from the table (not freeing it).
+ */
+static void
+dns_defrag_remove(struct dns_defrag *df, struct dns_defrag_entry *e)
+{
+    struct dns_defrag_entry **ep = &df->buckets[dns_hash_data(&e->key, sizeof(e->key)) & df->mask];
+    while (*ep != e)
+        ep = &(*ep)->next;
+    *ep = e->next;
+    clist_remove(&e->node);
+    df->pending --;
+}
+
+void
+dns_defrag_destroy(struct dns_defrag *df)
+{
+    struct dns_defrag_entry *e;
+    while ((e = clist_head(&df->entries))) {
+        dns_defrag_remove(df, e);
+        dns_defrag_entry_free(df, e);
+    }
+    if (df->done)
+        dns_defrag_entry_free(df, df->done);
+    assert(df->memory == 0);
+    free(df->buckets);
+    free(df);
+}
+
+/**
+ * Evict the oldest entry.
+ */
+static void
+dns_defrag_evict_oldest(struct dns_defrag *df, uint64_t *counter)
+{
+    struct dns_defrag_entry *e = clist_head(&df->entries);
+    assert(e);
+    dns_defrag_remove(df, e);
+    dns_defrag_entry_free(df, e);
+    (*counter) ++;
+}
+
+/**
+ * Drop the invalid fragment and its whole entry (if any).
+ */
+static dns_ret_t
+dns_defrag_drop(struct dns_defrag *df, struct dns_defrag_entry *e)
+{
+    if (e) {
+        dns_defrag_remove(df, e);
+        dns_defrag_entry_free(df, e);
+    }
+    df->dropped_invalid ++;
+    return DNS_RET_DROP_FRAGMENTED;
+}
+
+/**
+ * Find the entry for the key or create a new one, evicting the oldest entries
+ * over the memory limit. Returns NULL when even an empty entry does not fit.
+ */
+static struct dns_defrag_entry *
+dns_defrag_get(struct dns_defrag *df, const struct dns_defrag_key *key, const struct dns_packet_net *net)
+{
+    struct dns_defrag_entry **bucket = &df->buckets[dns_hash_data(key, sizeof(*key)) & df->mask];
+    for (struct dns_defrag_entry *e = *bucket; e; e = e->next)
+        if (memcmp(&e->key, key, sizeof(*key)) == 0)
+            return e;
+
+    if (sizeof(struct dns_defrag_entry) > df->max_memory)
+        return NULL;
+    while (df->memory + sizeof(struct dns_defrag_entry) > df->max_memory)
+        dns_defrag_evict_oldest(df, &df->evicted_memory);
+    struct dns_defrag_entry *e = xmalloc_zero(sizeof(struct dns_defrag_entry));
+    e->key = *key;
+    e->ts = net->ts;
+    e->net = *net;
+    e->next = *bucket;
+    *bucket = e;
+    clist_add_tail(&df->entries, &e->node);
+    df->memory += sizeof(struct dns_defrag_entry);
+    df->pending ++;
+    return e;
+}
+
+/**
+ * Grow the entry payload buffer to hold `size` bytes, evicting the oldest other entries
+ * over the memory limit. Returns 0 when the buffer can not grow.
+ */
+static int
+dns_defrag_reserve(struct dns_defrag *df, struct dns_defrag_entry *e, size_t size)
+{
+    if (size <= e->capacity)
+        return 1;
+    size_t capacity = (size + DNS_DEFRAG_ALLOC_STEP - 1) / DNS_DEFRAG_ALLOC_STEP * DNS_DEFRAG_ALLOC_STEP;
+    size_t growth = capacity - e->capacity;
+    while (df->memory + growth > df->max_memory) {
+        if (clist_head(&df->entries) == &e->node)
+            return 0; // Only this entry is left
+        dns_defrag_evict_oldest(df, &df->evicted_memory);
+    }
+    e->data = xrealloc(e->data, capacity);
+    e->capacity = capacity;
+    df->memory += growth;
+    return 1;
+}
+
+dns_ret_t
+dns_defrag_add(struct dns_defrag *df, struct dns_packet_net *net)
+{
+    if (df->done) {
+        dns_defrag_entry_free(df, df->done);
+        df->done = NULL;
+    }
+
+    // Expire the old entries by the packet time
+    struct dns_defrag_entry *old;
+    while ((old = clist_head(&df->entries)) && old->ts + df->timeout < net->ts)
+        dns_defrag_evict_oldest(df, &df->evicted_timeout);
+
+    size_t offset = net->frag.offset, end = offset + net->frag.size;
+    if (!net->frag.data || end > DNS_DEFRAG_MAX_SIZE ||
+        (net->frag.more && (net->frag.size == 0 || net->frag.size % DNS_DEFRAG_BLOCK != 0)))
+        return dns_defrag_drop(df, NULL);
+
+    struct dns_defrag_key key;
+    memset(&key, 0, sizeof(key));
+    key.af = DNS_SOCKADDR_AF(&net->src_addr);
+    key.protocol = net->protocol;
+    key.id = net->frag.id;
+    memcpy(key.src_addr, DNS_SOCKADDR_ADDR(&net->src_addr), DNS_SOCKADDR_ADDRLEN(&net->src_addr));
+    memcpy(key.dst_addr, DNS_SOCKADDR_ADDR(&net->dst_addr), DNS_SOCKADDR_ADDRLEN(&net->dst_addr));
+    struct dns_defrag_entry *e = dns_defrag_get(df, &key, net);
+    if (!e)
+        return dns_defrag_drop(df, NULL);
+
+    // The total size is only known from the last fragment, and must stay consistent
+    if (!net->frag.more) {
+        if ((e->size && e->size != end) || e->end > end)
+            return dns_defrag_drop(df, e);
+        e->size = end;
+    }
+    if (e->size && end > e->size)
+        return dns_defrag_drop(df, e);
+    e->end = MAX(e->end, end);
+    if (!dns_defrag_reserve(df, e, end))
+        return dns_defrag_drop(df, e);
+
+    // Copy the data (overlaps are overwritten), mark the blocks
+    memcpy(e->data + offset, net->frag.data, net->frag.size);
+    for (size_t b = offset / DNS_DEFRAG_BLOCK; b * DNS_DEFRAG_BLOCK < end; b++) {
+        if (!(e->received[b / 8] & (1 << (b % 8)))) {
+            e->received[b / 8] |= 1 << (b % 8);
+            e->blocks ++;
+        }
+    }
+    if (offset == 0)
+        e->ttl = net->ttl;
+    e->wire_size += net->wire_size;
+
+    if (!e->size || e->blocks < (e->size + DNS_DEFRAG_BLOCK - 1) / DNS_DEFRAG_BLOCK)
+        return DNS_RET_DROP_FRAGMENTED;
+
+    // Complete: decode the transport from the reassembled payload, freed on the next call
+    dns_defrag_remove(df, e);
+    df->done = e;
+    df->reassembled ++;
+    dns_us_time_t ts = net->ts;
+    *net = e->net;
+    net->ts = ts;
+    net->ttl = e->ttl;
+    net->wire_size = e->wire_size;
+    memset(&net->frag, 0, sizeof(net->frag));
+    return dns_packet_decode_transport(e->data, e->size, e->size, net);
+}
+
+void
+dns_defrag_report(struct dns_defrag *df, const char *name)
+{
+    msg(L_INFO, "%s defrag: %"PRIu64" reassembled, %"PRIu64" pending (%zu kB), evicted %"PRIu64" on timeout, "
+        "%"PRIu64" on memory limit, %"PRIu64" invalid fragments",
+        name, df->reassembled, df->pending, df->memory / 1024, df->evicted_timeout, df->evicted_memory,
+        df->dropped_invalid);
+}
@@ -0,0 +1,155 @@
+/* 
+ *  Copyright (C) 2016 CZ.NIC, z.s.p.o.
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef DNSCOL_PACKET_DEFRAG_H
+#define DNSCOL_PACKET_DEFRAG_H
+
+#include "common.h"
+#include "config.h"
+#include "packet.h"
+
+/**
+ * \file packet_defrag.h
+ * IPv4 and IPv6 fragment reassembly.
+ */
+
+/** Maximum IP payload size of a reassembled packet */
+#define DNS_DEFRAG_MAX_SIZE 65535
+
+/** Reassembly granularity (fragment offset unit) */
+#define DNS_DEFRAG_BLOCK 8
+
+/**
+ * Identification of the fragments of one IP packet.
+ * Unused address bytes (IPv4) are zero, so the keys can be compared with `memcmp()`.
+ */
+struct dns_defrag_key {
+    uint8_t src_addr[16];
+    uint8_t dst_addr[16];
+    uint32_t id;
+    uint8_t af;
+    uint8_t protocol;
+};
+
+/**
+ * A packet being reassembled.
+ */
+struct dns_defrag_entry {
+    /** Node in the list of entries, oldest first */
+    cnode node;
+
+    /** Next entry in the hash chain */
+    struct dns_defrag_entry *next;
+
+    struct dns_defrag_key key;
+
+    /** Time of the first received fragment */
+    dns_us_time_t ts;
+
+    /** Network data of the first received fragment (the addresses and the protocol) */
+    struct dns_packet_net net;
+
+    /** TTL of the first fragment (offset 0) */
+    uint8_t ttl;
+
+    /** Total payload length, known from the last fragment (0 until then) */
+    size_t size;
+
+    /** Largest end offset of the received fragments */
+    size_t end;
+
+    /** Sum of the wire lengths of the fragments */
+    size_t wire_size;
+
+    /** Number of the received payload blocks */
+    size_t blocks;
+
+    /** The payload, `capacity` bytes allocated, owned */
+    uint8_t *data;
+    size_t capacity;
+
+    /** Bitmap of the received payload blocks */
+    uint8_t received[DNS_DEFRAG_MAX_SIZE / DNS_DEFRAG_BLOCK / 8 + 1];
+};
+
+/**
+ * Fragment reassembly table of one input thread.
+ *
+ * Fragments are collected per (addresses, protocol, IP ID) until the whole IP payload
+ * is present, then the transport header is decoded from the reassembled payload.
+ * Entries older than the timeout (in packet time) are evicted when further fragments
+ * arrive, the oldest entries are also evicted to keep the memory below the cap.
+ * Unfragmented packets never reach the table.
+ */
+struct dns_defrag {
+    /** Hash chains, `mask + 1` of them, owned */
+    struct dns_defrag_entry **buckets;
+    size_t mask;
+
+    /** All the entries, oldest first */
+    clist entries;
+
+    /** Memory used by the entries and the limit */
+    size_t memory;
+    size_t max_memory;
+
+    /** Maximum age of an entry */
+    dns_us_time_t timeout;
+
+    /** The last reassembled entry, the reassembled packet data point into it (freed on the next call) */
+    struct dns_defrag_entry *done;
+
+    /** Number of entries */
+    uint64_t pending;
+
+    /** Statistics: reassembled packets, entries evicted on timeout and memory limit,
+     * fragments dropped as invalid (inconsistent, overlong or not captured in full) */
+    uint64_t reassembled;
+    uint64_t evicted_timeout;
+    uint64_t evicted_memory;
+    uint64_t dropped_invalid;
+};
+
+/**
+ * Create a reassembly table with the configured memory limit and timeout.
+ */
+struct dns_defrag *
+dns_defrag_create(struct dns_config *conf);
+
+/**
+ * Free the table with all the pending fragments.
+ */
+void
+dns_defrag_destroy(struct dns_defrag *df);
+
+/**
+ * Add the fragment described by `net` (as filled in by a decoder returning DNS_RET_DROP_FRAGMENTED,
+ * with `ts` and `wire_size` set). Returns DNS_RET_OK with `net` describing the reassembled packet
+ * when this was the last missing fragment (`net->dns_data` valid until the next call),
+ * DNS_RET_DROP_FRAGMENTED when the fragment was stored (or dropped), or the transport decoding
+ * drop reason of the reassembled packet.
+ */
+dns_ret_t
+dns_defrag_add(struct dns_defrag *df, struct dns_packet_net *net);
+
+/**
+ * Log the reassembly statistics.
+ */
+void
+dns_defrag_report(struct dns_defrag *df, const char *name);
+
+#endif /* DNSCOL_PACKET_DEFRAG_H */
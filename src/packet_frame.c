@@ -22,6 +22,7 @@
 
 #include "packet_frame.h"
 #include "packet.h"
+#include "packet_arena.h"
 
 struct dns_packet_frame *
 dns_packet_frame_create(dns_us_time_t time_start, dns_us_time_t time_end)
@@ -33,6 +34,9 @@ dns_packet_frame_create(dns_us_time_t time_start, dns_us_time_t time_end)
     frame->count = 0;
     frame->size = 0;
     frame->type = 0;
+    frame->shard = 0;
+    frame->matcher_time = DNS_NO_TIME;
+    frame->arena = NULL;
     return frame;
 }
 
@@ -52,6 +56,8 @@ dns_packet_frame_destroy(struct dns_packet_frame *frame)
     CLIST_FOR_EACH_DELSAFE(struct dns_packet *, pkt, frame->packets, tmp) {
         dns_packet_destroy(pkt);
     }
+    if (frame->arena)
+        dns_packet_arena_release(frame->arena);
     free(frame);
 }
 
@@ -48,6 +48,19 @@ struct dns_packet_frame {
 
     /** Size of the contained data (for memory limiting) */
     size_t size;
+
+    /** Index of the matcher shard or the AF_PACKET capture thread that produced the frame
+     * (only used with sharded matching and AF_PACKET capture). */
+    int shard;
+
+    /** The arena the input allocates the frame packets from, NULL for other frames.
+     * The frame holds a reference to it until destroyed, the packets hold their own
+     * references (see `struct dns_packet_arena`). */
+    struct dns_packet_arena *arena;
+
+    /** Time of the producing matcher when the frame was output, no later packet leaves
+     * the matcher before this time (only used with sharded matching). */
+    dns_us_time_t matcher_time;
 };
 
 /**
@@ -19,144 +19,419 @@
 #include <stdio.h>
 #include <string.h>
 #include <assert.h>
+#include <endian.h>
+#include <unistd.h>
+#include <sys/time.h>
 
 #include "packet.h"
 #include "packet_hash.h"
 
+/** Is the slot in use? */
+#define DNS_SLOT_USED(s) ((s)->first != NULL)
+
+/** Distance of slot at index `i` from its home slot in table `t` */
+#define DNS_SLOT_DIST(t, s, i) (((i) - ((s)->hash_value & ((t)->capacity - 1))) & ((t)->capacity - 1))
+
+/** Is a resize in progress? */
+#define DNS_HASH_MIGRATING(h) ((h)->old.capacity > 0)
+
+/** The process secret key of the packet key hash */
+static uint64_t dns_packet_hash_secret[2];
+
+void
+dns_packet_hash_init_secret(void)
+{
+    FILE *f = fopen("/dev/urandom", "rb");
+    if ((!f) || (fread(dns_packet_hash_secret, sizeof(dns_packet_hash_secret), 1, f) != 1)) {
+        msg(L_WARN, "Can not read /dev/urandom, using a weak packet hash secret");
+        struct timeval tv;
+        gettimeofday(&tv, NULL);
+        dns_packet_hash_secret[0] = ((uint64_t)tv.tv_sec << 20) ^ tv.tv_usec ^ ((uint64_t)getpid() << 40);
+        dns_packet_hash_secret[1] = (uint64_t)random() ^ ((uint64_t)random() << 31);
+    }
+    if (f)
+        fclose(f);
+}
+
+#define DNS_ROTL64(x, b) (uint64_t)(((x) << (b)) | ((x) >> (64 - (b))))
+
+#define DNS_SIPROUND(v0, v1, v2, v3) do { \
+        v0 += v1; v1 = DNS_ROTL64(v1, 13); v1 ^= v0; v0 = DNS_ROTL64(v0, 32); \
+        v2 += v3; v3 = DNS_ROTL64(v3, 16); v3 ^= v2; \
+        v0 += v3; v3 = DNS_ROTL64(v3, 21); v3 ^= v0; \
+        v2 += v1; v1 = DNS_ROTL64(v1, 17); v1 ^= v2; v2 = DNS_ROTL64(v2, 32); \
+    } while (0)
+
+/**
+ * SipHash-1-3 of `len` bytes of `data` with the 128-bit key `k`.
+ */
+static uint64_t
+dns_siphash13(const uint64_t k[2], const uint8_t *data, size_t len)
+{
+    uint64_t v0 = k[0] ^ 0x736f6d6570736575ULL;
+    uint64_t v1 = k[1] ^ 0x646f72616e646f6dULL;
+    uint64_t v2 = k[0] ^ 0x6c7967656e657261ULL;
+    uint64_t v3 = k[1] ^ 0x7465646279746573ULL;
+    const uint8_t *end = data + (len & ~(size_t)7);
+    uint64_t m;
+
+    for (; data < end; data += 8) {
+        memcpy(&m, data, 8);
+        m = le64toh(m);
+        v3 ^= m;
+        DNS_SIPROUND(v0, v1, v2, v3);
+        v0 ^= m;
+    }
+
+    m = ((uint64_t)len) << 56;
+    for (size_t i = 0; i < (len & 7); i++)
+        m |= ((uint64_t)data[i]) << (8 * i);
+    v3 ^= m;
+    DNS_SIPROUND(v0, v1, v2, v3);
+    v0 ^= m;
+
+    v2 ^= 0xff;
+    DNS_SIPROUND(v0, v1, v2, v3);
+    DNS_SIPROUND(v0, v1, v2, v3);
+    DNS_SIPROUND(v0, v1, v2, v3);
+    return v0 ^ v1 ^ v2 ^ v3;
+}
+
+dns_hash_value_t
+dns_packet_key_hash(const struct dns_packet_key *key)
+{
+    return dns_siphash13(dns_packet_hash_secret, (const uint8_t *)key, sizeof(struct dns_packet_key));
+}
+
+dns_hash_value_t
+dns_hash_data(const void *data, size_t len)
+{
+    return dns_siphash13(dns_packet_hash_secret, data, len);
+}
+
+/**
+ * Return the smallest power of two at least `n` (and at least 2).
+ */
+static size_t
+dns_packet_hash_round_capacity(size_t n)
+{
+    size_t c = 2;
+    while (c < n)
+        c <<= 1;
+    return c;
+}
+
+_Static_assert(DNS_PACKET_HASH_SLOT_ALIGN % sizeof(struct dns_packet_hash_slot) == 0,
+               "dns_packet_hash_slot does not divide the cache line");
+
+/**
+ * Allocate a zeroed array of `capacity` slots aligned to the cache line,
+ * so no slot straddles two cache lines.
+ */
+static struct dns_packet_hash_slot *
+dns_packet_hash_alloc_slots(size_t capacity)
+{
+    void *data;
+    if (posix_memalign(&data, DNS_PACKET_HASH_SLOT_ALIGN, capacity * sizeof(struct dns_packet_hash_slot)) != 0)
+        die("Out of memory allocating %zu hash slots", capacity);
+    memset(data, 0, capacity * sizeof(struct dns_packet_hash_slot));
+    return data;
+}
+
 struct dns_packet_hash *
-dns_packet_hash_create(size_t capacity, dns_hash_value_t seed)
+dns_packet_hash_create(size_t capacity)
 {
     struct dns_packet_hash *h = xmalloc_zero(sizeof(struct dns_packet_hash));
-    h->capacity = capacity;
-    h->min_capacity = capacity;
+    h->table.capacity = dns_packet_hash_round_capacity(capacity);
+    h->table.used = 0;
+    h->table.data = dns_packet_hash_alloc_slots(h->table.capacity);
+    h->old.capacity = 0;
+    h->old.data = NULL;
+    h->min_capacity = h->table.capacity;
     h->buckets = 0;
-    if (seed == 0) {
-        seed = random();
-#if RAND_MAX < (1 << 33)
-        seed += random() << 32;
-#endif
-    }
-    h->seed = seed;
-    h->data = xmalloc_zero(h->capacity * sizeof(struct dns_packet_hash_bucket*));
     return h;
 }
 
 void
 dns_packet_hash_destroy(struct dns_packet_hash *h)
 {
-    for (dns_hash_value_t i = 0; i < h->capacity; i++)
-        for (struct dns_packet_hash_bucket *b = h->data[i]; b;) {
-            struct dns_packet_hash_bucket *t = b->next;
-            free(b);
-            b = t;
-        }
-    free(h->data);
+    free(h->table.data);
+    free(h->old.data);
     free(h);
 }
 
 /**
- * Resize the hashtable to given size (but not smaller than min_capacity). 
+ * Append the packet to the slot packet list.
+ */
+static inline void
+dns_packet_hash_slot_append(struct dns_packet_hash_slot *s, struct dns_packet *p)
+{
+    p->secnode.next = NULL;
+    if (s->first) {
+        cnode *last = s->first->secnode.prev;
+        p->secnode.prev = last;
+        last->next = &p->secnode;
+        s->first->secnode.prev = &p->secnode;
+    } else {
+        p->secnode.prev = &p->secnode;
+        s->first = p;
+    }
+}
+
+/**
+ * Unlink the packet from the slot packet list, leaving the slot unused when it was the last one.
+ */
+static inline void
+dns_packet_hash_slot_unlink(struct dns_packet_hash_slot *s, struct dns_packet *p)
+{
+    cnode *prev = p->secnode.prev, *next = p->secnode.next;
+    if (p == s->first) {
+        s->first = next ? DNS_PACKET_FROM_SECNODE(next) : NULL;
+        if (next)
+            next->prev = prev; // The last packet
+        return;
+    }
+    prev->next = next;
+    if (next)
+        next->prev = prev;
+    else
+        s->first->secnode.prev = prev; // Removing the last packet
+}
+
+/**
+ * Place the slot `s` (not in the table) with a new key in the table, Robin Hood style:
+ * take over any slot with a shorter probe distance and continue placing the evicted one.
+ * The placement starts at index `i` at the probe distance `dist` from the home slot,
+ * where a failed lookup of the key stopped (or at the home slot).
+ * The contents of `s` are undefined afterwards.
+ */
+static void
+dns_packet_hash_place_at(struct dns_packet_hash_table *t, struct dns_packet_hash_slot *s, size_t i, size_t dist)
+{
+    struct dns_packet_hash_slot tmp;
+    size_t mask = t->capacity - 1;
+
+    t->used ++;
+    while (1) {
+        struct dns_packet_hash_slot *cur = &t->data[i];
+        if (!DNS_SLOT_USED(cur)) {
+            *cur = *s;
+            return;
+        }
+        size_t cur_dist = DNS_SLOT_DIST(t, cur, i);
+        if (cur_dist < dist) {
+            // Swap the carried slot with the current one
+            tmp = *cur;
+            *cur = *s;
+            *s = tmp;
+            dist = cur_dist;
+        }
+        i = (i + 1) & mask;
+        dist ++;
+    }
+}
+
+/**
+ * Place the slot `s` starting at its home slot, see dns_packet_hash_place_at().
+ */
+static inline void
+dns_packet_hash_place(struct dns_packet_hash_table *t, struct dns_packet_hash_slot *s)
+{
+    dns_packet_hash_place_at(t, s, s->hash_value & (t->capacity - 1), 0);
+}
+
+/**
+ * Find the slot for the given key in the table, or NULL when not present.
+ * A failed lookup sets `stop` and `stop_dist` to where the key would be placed,
+ * so an insert does not probe the table twice.
+ */
+static struct dns_packet_hash_slot *
+dns_packet_hash_table_probe(struct dns_packet_hash_table *t, const struct dns_packet_key *key, dns_hash_value_t hash_value,
+                            size_t *stop, size_t *stop_dist)
+{
+    size_t mask = t->capacity - 1;
+    size_t i = hash_value & mask;
+    for (size_t dist = 0; ; dist++, i = (i + 1) & mask) {
+        struct dns_packet_hash_slot *s = &t->data[i];
+        // Robin Hood invariant: the key would have displaced any slot closer to its home
+        if ((!DNS_SLOT_USED(s)) || (DNS_SLOT_DIST(t, s, i) < dist)) {
+            *stop = i;
+            *stop_dist = dist;
+            return NULL;
+        }
+        if ((s->hash_value == hash_value) && (memcmp(&s->first->key, key, sizeof(struct dns_packet_key)) == 0))
+            return s;
+    }
+}
+
+/**
+ * Find the slot for the given key in the table, or NULL when not present.
+ */
+static struct dns_packet_hash_slot *
+dns_packet_hash_table_find(struct dns_packet_hash_table *t, const struct dns_packet_key *key, dns_hash_value_t hash_value)
+{
+    size_t stop, stop_dist;
+    if (t->used == 0)
+        return NULL;
+    return dns_packet_hash_table_probe(t, key, hash_value, &stop, &stop_dist);
+}
+
+/**
+ * Mark the table slot unused, shifting back the following displaced slots.
+ * Only ever moves slots towards lower indices (modulo capacity).
+ */
+static void
+dns_packet_hash_table_delete(struct dns_packet_hash_table *t, struct dns_packet_hash_slot *s)
+{
+    size_t mask = t->capacity - 1;
+    size_t i = s - t->data;
+    while (1) {
+        size_t next = (i + 1) & mask;
+        struct dns_packet_hash_slot *ns = &t->data[next];
+        if ((!DNS_SLOT_USED(ns)) || (DNS_SLOT_DIST(t, ns, next) == 0))
+            break;
+        t->data[i] = *ns;
+        i = next;
+    }
+    t->data[i].first = NULL;
+    t->used --;
+}
+
+/**
+ * Move up to `steps` old table positions to the current table, freeing the old table when done.
+ *
+ * The old slots before `migrate_pos` are all unused: nothing is ever inserted into the old
+ * table and the backward shift deletion only moves slots to lower positions, stopping at an unused slot.
+ * The migrated position is therefore re-checked after a deletion shifted another slot into it.
+ */
+static void
+dns_packet_hash_migrate(struct dns_packet_hash *h, size_t steps)
+{
+    if (!DNS_HASH_MIGRATING(h))
+        return;
+    while ((steps-- > 0) && (h->migrate_pos < h->old.capacity)) {
+        struct dns_packet_hash_slot *s = &h->old.data[h->migrate_pos];
+        if (!DNS_SLOT_USED(s)) {
+            h->migrate_pos ++;
+            continue;
+        }
+        struct dns_packet_hash_slot tmp = *s;
+        dns_packet_hash_table_delete(&h->old, s);
+        dns_packet_hash_place(&h->table, &tmp);
+    }
+    if (h->migrate_pos >= h->old.capacity || h->old.used == 0) {
+        assert(h->old.used == 0);
+        free(h->old.data);
+        h->old.data = NULL;
+        h->old.capacity = 0;
+        h->migrate_pos = 0;
+    }
+}
+
+/**
+ * Start resizing the hashtable to given size (rounded up to a power of two, but not smaller than min_capacity).
+ * The contents are moved over by the following operations. Any previous resize is finished first.
  */
 static void
 dns_packet_hash_resize(struct dns_packet_hash *h, size_t new_capacity)
 {
+    new_capacity = dns_packet_hash_round_capacity(new_capacity);
     if (new_capacity < h->min_capacity)
         new_capacity = h->min_capacity;
-    if (new_capacity == h->capacity)
+    if (new_capacity == h->table.capacity)
         return;
 
-    struct dns_packet_hash_bucket **new_data = xmalloc_zero(new_capacity * sizeof(struct dns_packet_hash_bucket*));
-    for (dns_hash_value_t i = 0; i < h->capacity; i++)
-        for (struct dns_packet_hash_bucket *b = h->data[i]; b;) {
-            struct dns_packet_hash_bucket *t = b->next;
-            dns_hash_value_t mod_hash = b->hash_value % new_capacity;
-            b->next = new_data[mod_hash];
-            b->prevp = &new_data[mod_hash];
-            new_data[mod_hash] = b;
-            b = t;
-        }
-    free(h->data);
-    h->data = new_data;
-    h->capacity = new_capacity;
+    dns_packet_hash_migrate(h, SIZE_MAX);
+    h->old = h->table;
+    h->migrate_pos = 0;
+    h->table.capacity = new_capacity;
+    h->table.used = 0;
+    h->table.data = dns_packet_hash_alloc_slots(new_capacity);
 }
 
 /**
- * Find a bucket for packet p.
- * Returns pointer to pointer to p's bucket in the linked list of buckets,
- * so it is suitable for both bucket inserion and bucket removal.
- * Returns with *ret==NULL when no such bucket (but you can insert it there).
- * Never returns NULL.
+ * Find the slot for the given key in any of the tables, or NULL when not present.
  */
-static struct dns_packet_hash_bucket **
-dns_packet_hash_find_bucket(struct dns_packet_hash *h, struct dns_packet *p, dns_hash_value_t hash_value)
-{
-    struct dns_packet_hash_bucket **bp;
-    for (bp = &h->data[hash_value % h->capacity]; *bp; bp = &((*bp)->next)) {
-        struct dns_packet *first_packet = DNS_PACKET_FROM_SECNODE(clist_head(&(*bp)->packets));
-        assert(first_packet); // Buckets should never be empty
-        if (((*bp)->hash_value == hash_value) && (dns_packet_primary_match(p, first_packet)))
-            return bp;
-    }
-    return bp;
+static struct dns_packet_hash_slot *
+dns_packet_hash_find_slot(struct dns_packet_hash *h, const struct dns_packet_key *key, dns_hash_value_t hash_value)
+{
+    struct dns_packet_hash_slot *s = dns_packet_hash_table_find(&h->table, key, hash_value);
+    if ((!s) && DNS_HASH_MIGRATING(h))
+        s = dns_packet_hash_table_find(&h->old, key, hash_value);
+    return s;
+}
+
+/**
+ * Mark the slot (in any of the tables) unused and shrink the table if sparse enough.
+ * No shrinking is started during a resize.
+ */
+static void
+dns_packet_hash_delete_slot(struct dns_packet_hash *h, struct dns_packet_hash_slot *s)
+{
+    if (DNS_HASH_MIGRATING(h) && (s >= h->old.data) && (s < h->old.data + h->old.capacity))
+        dns_packet_hash_table_delete(&h->old, s);
+    else
+        dns_packet_hash_table_delete(&h->table, s);
+
+    h->buckets --;
+    if ((!DNS_HASH_MIGRATING(h)) && (h->buckets < h->table.capacity * DNS_PACKET_HASH_MIN_PERCENT / 100))
+        dns_packet_hash_resize(h, h->buckets * 100 / DNS_PACKET_HASH_BEST_PERCENT);
 }
 
 void
 dns_packet_hash_insert_packet(struct dns_packet_hash *h, struct dns_packet *p)
 {
-    dns_hash_value_t hash_value = dns_packet_primary_hash(p, h->seed);
-    struct dns_packet_hash_bucket **bp = dns_packet_hash_find_bucket(h, p, hash_value);
-    struct dns_packet_hash_bucket *b = *bp;
+    dns_packet_hash_migrate(h, DNS_PACKET_HASH_MIGRATE_STEP);
 
-    if (!b) {
-        b = xmalloc_zero(sizeof(struct dns_packet_hash_bucket));
-        b->hash_value = hash_value;
-        clist_init(&b->packets);
+    if ((h->table.used + 1) > h->table.capacity * DNS_PACKET_HASH_MAX_PERCENT / 100)
+        dns_packet_hash_resize(h, (h->buckets + 1) * 100 / DNS_PACKET_HASH_BEST_PERCENT);
 
-        b->next = NULL;
-        *bp = b;
-        h->buckets ++;
-        if (h->buckets > h->capacity * DNS_PACKET_HASH_MAX_PERCENT / 100)
-            dns_packet_hash_resize(h, h->buckets * 100 / DNS_PACKET_HASH_BEST_PERCENT);
+    size_t stop, stop_dist;
+    struct dns_packet_hash_slot *s = dns_packet_hash_table_probe(&h->table, &p->key, p->key_hash, &stop, &stop_dist);
+    if ((!s) && DNS_HASH_MIGRATING(h))
+        s = dns_packet_hash_table_find(&h->old, &p->key, p->key_hash);
+    if (s) {
+        dns_packet_hash_slot_append(s, p);
+        return;
     }
 
-    clist_add_head(&b->packets, &p->secnode);
+    struct dns_packet_hash_slot ns;
+    ns.hash_value = p->key_hash;
+    ns.first = NULL;
+    dns_packet_hash_slot_append(&ns, p);
+    dns_packet_hash_place_at(&h->table, &ns, stop, stop_dist);
+    h->buckets ++;
 }
 
 /**
-* Remove the given packet from the given hash bucket, removing the bucket if empty.
-* NB: Assumes the packet *is* in the hash and in the bucket.
+* Remove the given packet from the given slot, freeing the slot if empty.
+* NB: Assumes the packet *is* in the hash and in the slot.
 */
 static void
-dns_packet_hash_remove_from_bucket(struct dns_packet_hash *h, struct dns_packet *p, struct dns_packet_hash_bucket **bp)
+dns_packet_hash_remove_from_slot(struct dns_packet_hash *h, struct dns_packet *p, struct dns_packet_hash_slot *s)
 {
-    assert(h && p && bp && (*bp));
-    struct dns_packet_hash_bucket *b = *bp;
+    assert(h && p && s && DNS_SLOT_USED(s));
 
-    clist_remove(&p->secnode);
-    if (clist_empty(&b->packets)) {
-        *bp = b->next;
-        free(b);
-        h->buckets --;
-        if (h->buckets < h->capacity * DNS_PACKET_HASH_MIN_PERCENT / 100)
-            dns_packet_hash_resize(h, h->buckets * 100 / DNS_PACKET_HASH_BEST_PERCENT);
-    }      
+    dns_packet_hash_slot_unlink(s, p);
+    if (!DNS_SLOT_USED(s))
+        dns_packet_hash_delete_slot(h, s);
 }
 
 struct dns_packet *
 dns_packet_hash_get_match(struct dns_packet_hash *h, struct dns_packet *p, int match_qname)
 {
-    dns_hash_value_t hash_value = dns_packet_primary_hash(p, h->seed);
-    struct dns_packet_hash_bucket **bp = dns_packet_hash_find_bucket(h, p, hash_value);
-    if (!*bp)
+    dns_packet_hash_migrate(h, DNS_PACKET_HASH_MIGRATE_STEP);
+
+    struct dns_packet_hash_slot *s = dns_packet_hash_find_slot(h, &p->key, p->key_hash);
+    if (!s)
         return NULL;
 
-    // Search the bucket oldest-to-newest
+    // Search the slot oldest-to-newest
     int cnt = 0;
-    cnode *secnode;
-    CLIST_WALK(secnode, (*bp)->packets) {
+    for (cnode *secnode = &s->first->secnode; secnode; secnode = secnode->next) {
         struct dns_packet *req = DNS_PACKET_FROM_SECNODE(secnode);
         if ((!match_qname) || dns_packet_qname_match(req, p)) {
-            dns_packet_hash_remove_from_bucket(h, req, bp);
+            dns_packet_hash_remove_from_slot(h, req, s);
             return req;
         }
         // Check for very long lists (a potential DOS vector)
@@ -175,8 +450,9 @@ dns_packet_hash_get_match(struct dns_packet_hash *h, struct dns_packet *p, int m
 void
 dns_packet_hash_remove_packet(struct dns_packet_hash *h, struct dns_packet *p)
 {
-    dns_hash_value_t hash_value = dns_packet_primary_hash(p, h->seed);
-    struct dns_packet_hash_bucket **bp = dns_packet_hash_find_bucket(h, p, hash_value);
-    assert(*bp);
-    dns_packet_hash_remove_from_bucket(h, p, bp);
+    dns_packet_hash_migrate(h, DNS_PACKET_HASH_MIGRATE_STEP);
+
+    struct dns_packet_hash_slot *s = dns_packet_hash_find_slot(h, &p->key, p->key_hash);
+    assert(s);
+    dns_packet_hash_remove_from_slot(h, p, s);
 }
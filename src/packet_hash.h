@@ -32,67 +32,138 @@
 typedef uint64_t dns_hash_value_t;
 
 /**
- * Hash bucket with a linked list of packets with the same key.
- * Every bucket needs to be nonempty (to have data to compare)!
+ * Compact primary matching key of a packet: everything but QNAME.
+ * Normalized to the request direction, so a request and its response have equal keys.
+ * Unused address bytes (IPv4) are zero, so the keys can be compared with `memcmp()`.
  */
-struct dns_packet_hash_bucket {
-    /** Hash value before modulo */
+struct dns_packet_key {
+    /** Client address (IPv4 in the first 4 bytes) */
+    uint8_t client_addr[16];
+    /** Server address (IPv4 in the first 4 bytes) */
+    uint8_t server_addr[16];
+    /** Client port in host byte order */
+    uint16_t client_port;
+    /** Server port in host byte order */
+    uint16_t server_port;
+    /** DNS ID */
+    uint16_t dns_id;
+    /** Address family (AF_INET or AF_INET6) */
+    uint8_t af;
+    /** Transport protocol number */
+    uint8_t net_protocol;
+};
+
+/**
+ * Open-addressing hash table slot holding all the packets with the same key.
+ * A used slot is never empty and its packet list is sorted by arrival (oldest first).
+ * Probes only compare the full hash values, the key of the first packet is only
+ * compared on a hash match (where the packet is accessed anyway).
+ * The slot is 16 bytes on 64-bit systems, four slots per cache line.
+ */
+struct dns_packet_hash_slot {
+    /** Full hash value of the key, `hash_value & mask` is the home slot */
     dns_hash_value_t hash_value;
-    /** Next bucket with the same hash */
-    struct dns_packet_hash_bucket *next;
-    /** Location of the pointer to this in the prev bucket or hash table */
-    struct dns_packet_hash_bucket **prevp;
-    /** Circular list of packets.
-     * This is assumed to be nonempty so we can compare primary keys of packets. 
-     * The list is sorted by timestamp in ascending order */
-    clist packets;
+    /** First packet of the list, threaded through `secnode`: NULL-terminated by `next`,
+     * the `prev` of the first packet points to the last one. The slot does not hold a list
+     * head the packets would point to, so the slots are moved around without touching
+     * the packets. `first == NULL` marks an unused slot. */
+    struct dns_packet *first;
 };
 
-#define DNS_PACKET_HASH_MIN_PERCENT 25
+/** Alignment of the slot arrays, the slots do not straddle cache lines */
+#define DNS_PACKET_HASH_SLOT_ALIGN 64
+
+/** Load (in percent of capacity) below which the table shrinks.
+ * Kept well below the load after a grow (under 37.5%) so that bursty traffic does not
+ * make the table oscillate between growing and shrinking. */
+#define DNS_PACKET_HASH_MIN_PERCENT 10
+/** Target load (in percent of capacity) after a resize (before rounding up to a power of two) */
 #define DNS_PACKET_HASH_BEST_PERCENT 50
+/** Load (in percent of capacity) above which the table grows */
 #define DNS_PACKET_HASH_MAX_PERCENT 75
 
+/** Number of old table slots migrated by every hash operation during a resize.
+ * Large enough for the migration to finish before the new table fills up
+ * (also when shrinking to a quarter of the size). */
+#define DNS_PACKET_HASH_MIGRATE_STEP 64
+
 /** Maximum number of packets in a hash bucket to search for a matching QNAME
  * (prevents one type of DoS, in normal traffic even 1-2 should suffice) */
 #define DNS_PACKET_HASH_MAX_SEARCH 32
 
 /**
- * Hash table structure.
- * Only hashes by primary DNS key (everything but QNAME).
+ * A single open-addressing table, Robin Hood hashing with linear probing and backward shift deletion.
  */
-struct dns_packet_hash {
-    /** Hash table size and modulo */
+struct dns_packet_hash_table {
+    /** Table size (a power of two, 0 for no table) */
     size_t capacity;
+    /** Number of used slots (distinct keys) */
+    size_t used;
+    /** The slots */
+    struct dns_packet_hash_slot *data;
+};
+
+/**
+ * Hash table structure, only hashes by primary DNS key (everything but QNAME).
+ *
+ * Resizing is incremental: a new table is allocated and every following hash operation
+ * moves up to `DNS_PACKET_HASH_MIGRATE_STEP` slots from the old table to the new one.
+ * While the migration runs, new keys go to the new table and lookups check both tables.
+ * Every key is in at most one of the tables.
+ */
+struct dns_packet_hash {
+    /** The current table */
+    struct dns_packet_hash_table table;
+    /** The table being migrated from (capacity 0 when not resizing) */
+    struct dns_packet_hash_table old;
+    /** Next old table slot to migrate, all the old slots before it are unused */
+    size_t migrate_pos;
     /** Initial and minimal capacity. */
     size_t min_capacity;
-    /** Number of buckets in the table */
+    /** Number of distinct keys in both tables */
     size_t buckets;
-    /** Seed for hash functions */
-    dns_hash_value_t seed;
-    /** Hash table itself */
-    struct dns_packet_hash_bucket **data;
 };
 
 /**
- * Allocate new hash table with given initial (and minimal) capacity. If seed==0, generate a random one.
+ * Set a random secret key for `dns_packet_key_hash()`.
+ * Call once at startup before any packets are created.
+ */
+void
+dns_packet_hash_init_secret(void);
+
+/**
+ * Keyed hash (SipHash-1-3) of a packet key with the process secret.
+ * Not predictable without the secret, so the hash collisions can not be forced from the network.
+ */
+dns_hash_value_t
+dns_packet_key_hash(const struct dns_packet_key *key);
+
+/**
+ * Keyed hash (SipHash-1-3) of arbitrary data with the process secret, as `dns_packet_key_hash()`.
+ */
+dns_hash_value_t
+dns_hash_data(const void *data, size_t len);
+
+/**
+ * Allocate new hash table with given initial (and minimal) capacity, rounded up to a power of two.
  */
 struct dns_packet_hash *
-dns_packet_hash_create(size_t capacity, dns_hash_value_t seed);
+dns_packet_hash_create(size_t capacity);
 
 /**
- * Free all hash data including the buckets. Does not free the contained packets.
+ * Free all hash data. Does not free the contained packets.
  */
 void
 dns_packet_hash_destroy(struct dns_packet_hash *h);
 
 /**
- * Insert the packet into the hash, creating a new bucket if necessary
+ * Insert the packet into the hash as the newest packet with its key, using a new slot if necessary
  */
 void
 dns_packet_hash_insert_packet(struct dns_packet_hash *h, struct dns_packet *p);
 
 /**
- * Remove the packet from the hash, deleting its bucket if empty
+ * Remove the packet from the hash, freeing its slot if empty
  */
 void
 dns_packet_hash_remove_packet(struct dns_packet_hash *h, struct dns_packet *p);
@@ -105,11 +176,4 @@ dns_packet_hash_remove_packet(struct dns_packet_hash *h, struct dns_packet *p);
 struct dns_packet *
 dns_packet_hash_get_match(struct dns_packet_hash *h, struct dns_packet *p, int match_qname);
 
-/**
-* Remove the given packet from the hash, removing the bucket if empty.
-* Assumes the packet *is* in the hash!
-*/
-void
-dns_packet_hash_remove_packet(struct dns_packet_hash *h, struct dns_packet *p);
-
 #endif /* DNSCOL_HASH_H */
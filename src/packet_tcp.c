@@ -0,0 +1,331 @@
+/* 
+ *  Copyright (C) 2016 CZ.NIC, z.s.p.o.
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <inttypes.h>
+
+#include "packet_tcp.h"
+#include "packet_decode.h"
+#include "packet_hash.h"
+
+/** Size of the DNS message length prefix */
+#define DNS_TCP_PREFIX_SIZE sizeof(uint16_t)
+
+struct dns_tcp *
+dns_tcp_create(struct dns_config *conf)
+{
+    struct dns_tcp *tcp = xmalloc_zero(sizeof(struct dns_tcp));
+    tcp->max_memory = conf->input_tcp_memory;
+    tcp->timeout = dns_fsec_to_us_time(conf->input_tcp_timeout_sec);
+    clist_init(&tcp->flows);
+
+    // About one chain per flow fitting into the memory limit
+    size_t buckets = 64;
+    while (buckets < tcp->max_memory / sizeof(struct dns_tcp_flow))
+        buckets *= 2;
+    tcp->buckets = xmalloc_zero(buckets * sizeof(struct dns_tcp_flow *));
+    tcp->mask = buckets - 1;
+    return tcp;
+}
+
+/**
+ * Drop the incomplete message of the flow (if any).
+ */
+static void
+dns_tcp_flow_reset(struct dns_tcp *tcp, struct dns_tcp_flow *f)
+{
+    tcp->memory -= f->capacity;
+    free(f->buffer);
+    f->buffer = NULL;
+    f->buffered = 0;
+    f->capacity = 0;
+}
+
+/**
+ * Remove the flow from the table and free it.
+ */
+static void
+dns_tcp_flow_remove(struct dns_tcp *tcp, struct dns_tcp_flow *f)
+{
+    struct dns_tcp_flow **fp = &tcp->buckets[f->hash & tcp->mask];
+    while (*fp != f)
+        fp = &(*fp)->next;
+    *fp = f->next;
+    clist_remove(&f->node);
+    dns_tcp_flow_reset(tcp, f);
+    tcp->memory -= sizeof(struct dns_tcp_flow);
+    tcp->active --;
+    free(f);
+}
+
+/**
+ * Free the buffer of the last returned message.
+ */
+static void
+dns_tcp_release_done(struct dns_tcp *tcp)
+{
+    if (tcp->done) {
+        tcp->memory -= tcp->done_capacity;
+        free(tcp->done);
+        tcp->done = NULL;
+        tcp->done_capacity = 0;
+    }
+}
+
+/**
+ * Finish splitting the current segment, removing its flow when closing.
+ */
+static void
+dns_tcp_finish_segment(struct dns_tcp *tcp)
+{
+    if (tcp->flow && tcp->closing) {
+        dns_tcp_flow_remove(tcp, tcp->flow);
+        tcp->closed ++;
+    }
+    tcp->flow = NULL;
+    tcp->closing = 0;
+    tcp->data = NULL;
+    tcp->size = 0;
+}
+
+void
+dns_tcp_destroy(struct dns_tcp *tcp)
+{
+    dns_tcp_finish_segment(tcp);
+    dns_tcp_release_done(tcp);
+    struct dns_tcp_flow *f;
+    while ((f = clist_head(&tcp->flows)))
+        dns_tcp_flow_remove(tcp, f);
+    assert(tcp->memory == 0);
+    free(tcp->buckets);
+    free(tcp);
+}
+
+/**
+ * Evict the least recently active flow.
+ */
+static void
+dns_tcp_evict_oldest(struct dns_tcp *tcp, uint64_t *counter)
+{
+    struct dns_tcp_flow *f = clist_head(&tcp->flows);
+    assert(f);
+    dns_tcp_flow_remove(tcp, f);
+    (*counter) ++;
+}
+
+/**
+ * Find the flow for the key, or create a new one expecting `seq` when `create` is set, evicting
+ * the least recently active flows over the memory limit. Returns NULL when not found or not fitting.
+ */
+static struct dns_tcp_flow *
+dns_tcp_get(struct dns_tcp *tcp, const struct dns_tcp_key *key, int create, uint32_t seq)
+{
+    dns_hash_value_t hash = dns_hash_data(key, sizeof(*key));
+    struct dns_tcp_flow **bucket = &tcp->buckets[hash & tcp->mask];
+    for (struct dns_tcp_flow *f = *bucket; f; f = f->next)
+        if (f->hash == hash && memcmp(&f->key, key, sizeof(*key)) == 0)
+            return f;
+
+    if (!create || sizeof(struct dns_tcp_flow) > tcp->max_memory)
+        return NULL;
+    while (tcp->memory + sizeof(struct dns_tcp_flow) > tcp->max_memory)
+        dns_tcp_evict_oldest(tcp, &tcp->evicted_memory);
+    struct dns_tcp_flow *f = xmalloc_zero(sizeof(struct dns_tcp_flow));
+    f->key = *key;
+    f->hash = hash;
+    f->next_seq = seq;
+    f->next = *bucket;
+    *bucket = f;
+    clist_add_tail(&tcp->flows, &f->node);
+    tcp->memory += sizeof(struct dns_tcp_flow);
+    tcp->active ++;
+    return f;
+}
+
+/**
+ * Grow the flow buffer to `size` bytes, evicting the least recently active other flows
+ * over the memory limit. Returns 0 when the buffer can not grow.
+ */
+static int
+dns_tcp_reserve(struct dns_tcp *tcp, struct dns_tcp_flow *f, size_t size)
+{
+    if (size <= f->capacity)
+        return 1;
+    size_t growth = size - f->capacity;
+    while (tcp->memory + growth > tcp->max_memory) {
+        if (clist_head(&tcp->flows) == &f->node)
+            return 0; // Only this flow is left
+        dns_tcp_evict_oldest(tcp, &tcp->evicted_memory);
+    }
+    f->buffer = xrealloc(f->buffer, size);
+    f->capacity = size;
+    tcp->memory += growth;
+    return 1;
+}
+
+/**
+ * Drop the incomplete message and the rest of the segment, the next segment of the flow
+ * is assumed to start with a message.
+ */
+static void
+dns_tcp_resync(struct dns_tcp *tcp, struct dns_tcp_flow *f)
+{
+    dns_tcp_flow_reset(tcp, f);
+    tcp->data = NULL;
+    tcp->size = 0;
+    tcp->resyncs ++;
+}
+
+void
+dns_tcp_add(struct dns_tcp *tcp, const struct dns_packet_net *net)
+{
+    dns_tcp_finish_segment(tcp);
+    dns_tcp_release_done(tcp);
+
+    // Expire the idle flows by the packet time
+    struct dns_tcp_flow *old;
+    while ((old = clist_head(&tcp->flows)) && old->ts + tcp->timeout < net->ts)
+        dns_tcp_evict_oldest(tcp, &tcp->evicted_timeout);
+
+    uint8_t flags = net->tcp.flags;
+    // The SYN takes one sequence number before the data
+    uint32_t seq = net->tcp.seq + !!(flags & DNS_TCP_SYN);
+    size_t size = net->payload_size;
+
+    struct dns_tcp_key key;
+    memset(&key, 0, sizeof(key));
+    key.af = DNS_SOCKADDR_AF(&net->src_addr);
+    key.src_port = net->src_addr.sin6_port;
+    key.dst_port = net->dst_addr.sin6_port;
+    memcpy(key.src_addr, DNS_SOCKADDR_ADDR(&net->src_addr), DNS_SOCKADDR_ADDRLEN(&net->src_addr));
+    memcpy(key.dst_addr, DNS_SOCKADDR_ADDR(&net->dst_addr), DNS_SOCKADDR_ADDRLEN(&net->dst_addr));
+    // Bare ACKs, FINs and RSTs need not create a flow, other flows may be picked up mid-connection
+    struct dns_tcp_flow *f = dns_tcp_get(tcp, &key, size > 0 || (flags & DNS_TCP_SYN), seq);
+    if (!f)
+        return;
+    if (flags & DNS_TCP_SYN) {
+        // A new connection (possibly reusing the ports of an old one)
+        dns_tcp_flow_reset(tcp, f);
+        f->next_seq = seq;
+    }
+    f->ts = net->ts;
+    clist_remove(&f->node);
+    clist_add_tail(&tcp->flows, &f->node);
+
+    tcp->flow = f;
+    tcp->net = *net;
+    tcp->closing = !! (flags & (DNS_TCP_FIN | DNS_TCP_RST));
+
+    if ((int32_t)(seq - f->next_seq) > 0) {
+        // Missed some data, any incomplete message is lost
+        dns_tcp_resync(tcp, f);
+        f->next_seq = seq;
+    }
+    // Skip the retransmitted data
+    size_t skip = (uint32_t)(f->next_seq - seq);
+    if (skip >= size)
+        return;
+    f->next_seq = seq + size;
+    if (net->tcp.size < size) {
+        // Not captured in full
+        dns_tcp_resync(tcp, f);
+        return;
+    }
+    tcp->data = net->tcp.data + skip;
+    tcp->size = size - skip;
+}
+
+/**
+ * Describe the message at `data` of `len` bytes (without the length prefix) in `net`.
+ */
+static dns_ret_t
+dns_tcp_message(struct dns_tcp *tcp, struct dns_packet_net *net, const uint8_t *data, size_t len)
+{
+    *net = tcp->net;
+    net->dns_data = data;
+    net->dns_data_size = len;
+    net->payload_size = len + DNS_TCP_PREFIX_SIZE;
+    tcp->messages ++;
+    return DNS_RET_OK;
+}
+
+dns_ret_t
+dns_tcp_next(struct dns_tcp *tcp, struct dns_packet_net *net)
+{
+    dns_tcp_release_done(tcp);
+    struct dns_tcp_flow *f = tcp->flow;
+
+    while (tcp->size > 0) {
+        if (!f->buffer && tcp->size >= DNS_TCP_PREFIX_SIZE) {
+            // A message at the start of the data, returned in place when complete
+            size_t len = knot_wire_read_u16(tcp->data);
+            if (len < KNOT_WIRE_HEADER_SIZE) {
+                dns_tcp_resync(tcp, f);
+                break;
+            }
+            if (tcp->size >= DNS_TCP_PREFIX_SIZE + len) {
+                const uint8_t *data = tcp->data + DNS_TCP_PREFIX_SIZE;
+                tcp->data += DNS_TCP_PREFIX_SIZE + len;
+                tcp->size -= DNS_TCP_PREFIX_SIZE + len;
+                return dns_tcp_message(tcp, net, data, len);
+            }
+        }
+
+        // A message spanning segments, collected in the flow buffer (the length prefix first)
+        size_t target = DNS_TCP_PREFIX_SIZE;
+        if (f->buffered >= DNS_TCP_PREFIX_SIZE)
+            target += knot_wire_read_u16(f->buffer);
+        if (!dns_tcp_reserve(tcp, f, target)) {
+            dns_tcp_resync(tcp, f);
+            break;
+        }
+        size_t n = MIN(target - f->buffered, tcp->size);
+        memcpy(f->buffer + f->buffered, tcp->data, n);
+        f->buffered += n;
+        tcp->data += n;
+        tcp->size -= n;
+        if (f->buffered == DNS_TCP_PREFIX_SIZE) {
+            if (knot_wire_read_u16(f->buffer) < KNOT_WIRE_HEADER_SIZE)
+                dns_tcp_resync(tcp, f);
+            continue;
+        }
+        if (f->buffered < target)
+            continue;
+
+        // Complete, the buffer is freed on the next call
+        tcp->done = f->buffer;
+        tcp->done_capacity = f->capacity;
+        f->buffer = NULL;
+        f->buffered = 0;
+        f->capacity = 0;
+        return dns_tcp_message(tcp, net, tcp->done + DNS_TCP_PREFIX_SIZE, target - DNS_TCP_PREFIX_SIZE);
+    }
+
+    dns_tcp_finish_segment(tcp);
+    return DNS_RET_EOF;
+}
+
+void
+dns_tcp_report(struct dns_tcp *tcp, const char *name)
+{
+    msg(L_INFO, "%s tcp: %"PRIu64" messages, %"PRIu64" flows (%zu kB), %"PRIu64" resyncs, %"PRIu64" closed, "
+        "expired %"PRIu64" on timeout, %"PRIu64" on memory limit",
+        name, tcp->messages, tcp->active, tcp->memory / 1024, tcp->resyncs, tcp->closed,
+        tcp->evicted_timeout, tcp->evicted_memory);
+}
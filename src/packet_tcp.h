@@ -0,0 +1,168 @@
+/* 
+ *  Copyright (C) 2016 CZ.NIC, z.s.p.o.
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef DNSCOL_PACKET_TCP_H
+#define DNSCOL_PACKET_TCP_H
+
+#include "common.h"
+#include "config.h"
+#include "packet.h"
+
+/**
+ * \file packet_tcp.h
+ * TCP stream reassembly into DNS messages.
+ */
+
+/** Maximum size of a DNS message over TCP with its length prefix */
+#define DNS_TCP_MAX_MESSAGE (65535 + 2)
+
+/**
+ * Identification of one direction of a TCP connection.
+ * Unused address bytes (IPv4) are zero, so the keys can be compared with `memcmp()`.
+ */
+struct dns_tcp_key {
+    uint8_t src_addr[16];
+    uint8_t dst_addr[16];
+    uint16_t src_port;
+    uint16_t dst_port;
+    uint8_t af;
+};
+
+/**
+ * One direction of a TCP connection. Kept small, as most flows only ever carry messages
+ * that fit into single segments: the buffer is only allocated for a message spanning segments.
+ */
+struct dns_tcp_flow {
+    /** Node in the list of flows, least recently active first */
+    cnode node;
+
+    /** Next flow in the hash chain */
+    struct dns_tcp_flow *next;
+
+    struct dns_tcp_key key;
+
+    /** Hash of the key */
+    dns_hash_value_t hash;
+
+    /** Time of the last segment */
+    dns_us_time_t ts;
+
+    /** Sequence number of the next expected payload byte */
+    uint32_t next_seq;
+
+    /** The incomplete message (with its length prefix), `buffered` bytes of `capacity`
+     * received so far, owned. NULL when the stream is at a message boundary. */
+    uint8_t *buffer;
+    uint32_t buffered;
+    uint32_t capacity;
+};
+
+/**
+ * TCP reassembly table of one input thread.
+ *
+ * Every direction of every TCP connection is tracked by a flow holding the next expected
+ * sequence number. The segments of a flow are taken in sequence, retransmitted data
+ * are skipped, and the payload is split into the length-prefixed DNS messages:
+ * the messages contained in a segment are returned in place, only a message spanning
+ * segments is collected in the flow buffer (of at most `DNS_TCP_MAX_MESSAGE` bytes).
+ *
+ * Out-of-order segments are not buffered: a gap in the sequence (a lost or reordered
+ * segment, or data not captured in full) drops the incomplete message and the stream
+ * is resynchronised assuming the next segment starts with a message, as for the flows
+ * picked up in the middle of a connection. Length prefixes shorter than a DNS header
+ * also resynchronise, other misaligned messages are dropped as malformed by the parsing.
+ *
+ * Flows are removed on FIN or RST, the flows idle for longer than the timeout
+ * (in packet time) are expired whenever a segment arrives, and the least recently
+ * active flows are evicted to keep the memory below the cap.
+ */
+struct dns_tcp {
+    /** Hash chains, `mask + 1` of them, owned */
+    struct dns_tcp_flow **buckets;
+    size_t mask;
+
+    /** All the flows, least recently active first */
+    clist flows;
+
+    /** Memory used by the flows and the limit */
+    size_t memory;
+    size_t max_memory;
+
+    /** Maximum idle time of a flow */
+    dns_us_time_t timeout;
+
+    /** The segment being split by `dns_tcp_next()`: its flow, network data and the rest of its payload */
+    struct dns_tcp_flow *flow;
+    struct dns_packet_net net;
+    const uint8_t *data;
+    size_t size;
+
+    /** Remove `flow` once the segment is split (FIN or RST) */
+    int closing;
+
+    /** The buffer of the last message returned from a flow buffer (freed on the next call) */
+    uint8_t *done;
+    size_t done_capacity;
+
+    /** Number of flows */
+    uint64_t active;
+
+    /** Statistics: returned messages, resynchronisations (on a sequence gap, data not captured
+     * in full, an invalid length prefix or a message over the memory limit), flows closed,
+     * expired on timeout and evicted on memory limit */
+    uint64_t messages;
+    uint64_t resyncs;
+    uint64_t closed;
+    uint64_t evicted_timeout;
+    uint64_t evicted_memory;
+};
+
+/**
+ * Create a reassembly table with the configured memory limit and idle timeout.
+ */
+struct dns_tcp *
+dns_tcp_create(struct dns_config *conf);
+
+/**
+ * Free the table with all the flows.
+ */
+void
+dns_tcp_destroy(struct dns_tcp *tcp);
+
+/**
+ * Add the TCP segment described by `net` (as filled in by a decoder, with `ts`, `wire_size`
+ * and `tcp` set). The DNS messages completed by the segment are then returned by `dns_tcp_next()`.
+ * The segment data must stay valid until then.
+ */
+void
+dns_tcp_add(struct dns_tcp *tcp, const struct dns_packet_net *net);
+
+/**
+ * Return the next DNS message of the last added segment in `net` (the network data of the segment,
+ * `dns_data` pointing to the message after its length prefix and valid until the next call).
+ * Returns DNS_RET_EOF when there are no more complete messages in the segment.
+ */
+dns_ret_t
+dns_tcp_next(struct dns_tcp *tcp, struct dns_packet_net *net);
+
+/**
+ * Log the reassembly statistics.
+ */
+void
+dns_tcp_report(struct dns_tcp *tcp, const char *name);
+
+#endif /* DNSCOL_PACKET_TCP_H */
@@ -0,0 +1,634 @@
+/* 
+ *  Copyright (C) 2016 CZ.NIC, z.s.p.o.
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#define _GNU_SOURCE // pipe2()
+
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <signal.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <pcap/pcap.h>
+
+#include "pcap_reader.h"
+#include "packet_decode.h"
+
+/** Read buffer size for the decompressed input (grows for larger pcapng blocks) */
+#define DNS_PCAP_READ_BUFFER_SIZE (4 << 20)
+
+/** Largest accepted record or block, larger ones mean a corrupted file */
+#define DNS_PCAP_MAX_RECORD_SIZE (64 << 20)
+
+/** The consumed part of the mapping is released in steps of this size */
+#define DNS_PCAP_RELEASE_STEP (64 << 20)
+
+/** Number of consecutive valid record headers identifying a record boundary when splitting */
+#define DNS_PCAP_SPLIT_CHAIN 8
+
+/** Maximal timestamp difference of consecutive records accepted when splitting */
+#define DNS_PCAP_SPLIT_MAX_TS_STEP (3600LL * 1000000)
+
+#define DNS_PCAP_MAGIC_US 0xa1b2c3d4
+#define DNS_PCAP_MAGIC_NS 0xa1b23c4d
+#define DNS_PCAP_HEADER_SIZE 24
+#define DNS_PCAP_RECORD_HEADER_SIZE 16
+
+#define DNS_PCAPNG_SHB 0x0A0D0D0A
+#define DNS_PCAPNG_IDB 0x00000001
+#define DNS_PCAPNG_PB 0x00000002
+#define DNS_PCAPNG_SPB 0x00000003
+#define DNS_PCAPNG_EPB 0x00000006
+#define DNS_PCAPNG_BYTE_ORDER_MAGIC 0x1A2B3C4D
+#define DNS_PCAPNG_OPT_IF_TSRESOL 9
+
+/**
+ * Decompressors by the file magic.
+ */
+static const struct {
+    const char *magic;
+    size_t magic_len;
+    const char *command;
+} dns_pcap_decompressors[] = {
+    { "\x1f\x8b", 2, "gzip" },
+    { "BZh", 3, "bzip2" },
+    { "\xfd" "7zXZ\x00", 6, "xz" },
+    { "\x28\xb5\x2f\xfd", 4, "zstd" },
+    { "\x89LZO", 4, "lzop" },
+    { NULL, 0, NULL },
+};
+
+static uint32_t
+dns_pcap_u32(const struct dns_pcap_reader *r, const uint8_t *p)
+{
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return r->swapped ? __builtin_bswap32(v) : v;
+}
+
+static uint16_t
+dns_pcap_u16(const struct dns_pcap_reader *r, const uint8_t *p)
+{
+    uint16_t v;
+    memcpy(&v, p, sizeof(v));
+    return r->swapped ? __builtin_bswap16(v) : v;
+}
+
+/**
+ * Run the decompressor reading the file on its stdin, return its output pipe.
+ * The pipe and the input files are close-on-exec, so a decompressor started by another
+ * reader thread never holds the write end of this pipe (and the reader never sees EOF).
+ */
+static int
+dns_pcap_start_decompressor(const char *command, int in_fd, pid_t *pidp)
+{
+    int pipefds[2];
+    if (pipe2(pipefds, O_CLOEXEC) != 0) {
+        perror("pipe2 in dns_pcap_start_decompressor()");
+        die("pipe2() error");
+    }
+    pid_t subpid = fork();
+    if (subpid < 0) {
+        perror("fork in dns_pcap_start_decompressor()");
+        die("fork() error");
+    }
+    if (subpid == 0) {
+        // Subprocess
+        // New process group - ignore sigint
+        setpgid(0, 0);
+        if (dup2(in_fd, 0) < 0 || dup2(pipefds[1], 1) < 0) {
+            perror("dup2 in dns_pcap_start_decompressor() in subprocess");
+            die("dup2() error");
+        }
+        // Close all fds except for (0, 1, 2)
+        for (int fdi = 3; fdi < FOPEN_MAX; fdi++)
+            close(fdi);
+        execlp(command, command, "-dc", (char *)NULL);
+        perror("exec in dns_pcap_start_decompressor() in subprocess");
+        die("failed to exec: \"%s\" \"-dc\"", command);
+    }
+    // Master process
+    if (close(pipefds[1]) != 0) {
+        perror("close in dns_pcap_start_decompressor()");
+        die("close() error");
+    }
+    *pidp = subpid;
+    return pipefds[0];
+}
+
+/**
+ * Make at least `size` unprocessed bytes available at `r->data + r->start`,
+ * reading more decompressed data when needed. Returns 0 when the input ends before.
+ */
+static int
+dns_pcap_ensure(struct dns_pcap_reader *r, size_t size)
+{
+    if (r->end - r->start >= size)
+        return 1;
+    if (r->map || r->eof)
+        return 0;
+
+    // Move the unprocessed data to the buffer start, grow it for large blocks
+    memmove(r->data, r->data + r->start, r->end - r->start);
+    r->end -= r->start;
+    r->start = 0;
+    if (size > r->data_size) {
+        r->data_size = MAX(size, 2 * r->data_size);
+        r->data = xrealloc(r->data, r->data_size);
+    }
+    // Fill the whole buffer, the decompressor runs in the meantime
+    while (r->end < r->data_size && !r->eof) {
+        ssize_t n = read(r->pipe_fd, r->data + r->end, r->data_size - r->end);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            die("Error reading decompressed '%s': %s", r->path, strerror(errno));
+        }
+        if (n == 0)
+            r->eof = 1;
+        r->end += n;
+    }
+    return r->end - r->start >= size;
+}
+
+/**
+ * Release the already processed part of the mapping from the process memory
+ * (the pages stay in the page cache).
+ */
+static void
+dns_pcap_release(struct dns_pcap_reader *r)
+{
+    if (!r->map || r->start < r->released + DNS_PCAP_RELEASE_STEP)
+        return;
+    size_t page = sysconf(_SC_PAGESIZE);
+    size_t until = r->start / page * page;
+    madvise(r->map + r->released, until - r->released, MADV_DONTNEED);
+    r->released = until;
+}
+
+/**
+ * Add an interface with the given link type, compiling the filter for it.
+ */
+static void
+dns_pcap_add_interface(struct dns_pcap_reader *r, int linktype, uint64_t ts_units)
+{
+    r->interfaces = xrealloc(r->interfaces, (r->interface_count + 1) * sizeof(struct dns_pcap_interface));
+    struct dns_pcap_interface *iface = &r->interfaces[r->interface_count++];
+    iface->linktype = linktype;
+    iface->ts_units = ts_units;
+    iface->filter = NULL;
+    if (!r->bpf_string || strlen(r->bpf_string) == 0 || !dns_packet_decode_dlt_supported(linktype))
+        return;
+
+    pcap_t *dead = pcap_open_dead(linktype, r->snaplen > 0 ? r->snaplen : 262144);
+    if (!dead)
+        die("FATAL: libpcap allocation error!");
+    iface->filter = xmalloc_zero(sizeof(struct bpf_program));
+    if (pcap_compile(dead, iface->filter, r->bpf_string, 1, PCAP_NETMASK_UNKNOWN) < 0)
+        die("Error compiling filter '%s' for '%s': %s", r->bpf_string, r->path, pcap_geterr(dead));
+    pcap_close(dead);
+}
+
+static void
+dns_pcap_clear_interfaces(struct dns_pcap_reader *r)
+{
+    for (int i = 0; i < r->interface_count; i++) {
+        if (r->interfaces[i].filter) {
+            pcap_freecode(r->interfaces[i].filter);
+            free(r->interfaces[i].filter);
+        }
+    }
+    free(r->interfaces);
+    r->interfaces = NULL;
+    r->interface_count = 0;
+}
+
+/**
+ * Check the link types of the pcapng interfaces described before the first packet,
+ * without consuming the blocks. Returns 0 when any of them is not supported,
+ * so the whole file is left to libtrace. Interfaces described after the first packet
+ * are rare, the packets of such interfaces with an unsupported link type are skipped.
+ * Corrupted blocks are left to be reported when read.
+ */
+static int
+dns_pcap_pcapng_linktypes_supported(struct dns_pcap_reader *r)
+{
+    int swapped = r->swapped, supported = 1;
+    size_t pos = 0;
+    while (dns_pcap_ensure(r, pos + 12)) {
+        const uint8_t *p = r->data + r->start + pos;
+        uint32_t type;
+        memcpy(&type, p, sizeof(type));
+        if (type == DNS_PCAPNG_SHB) {
+            uint32_t bom;
+            memcpy(&bom, p + 8, sizeof(bom));
+            r->swapped = (bom != DNS_PCAPNG_BYTE_ORDER_MAGIC);
+        } else {
+            type = dns_pcap_u32(r, p);
+        }
+        uint32_t len = dns_pcap_u32(r, p + 4);
+        if (len < 12 || len % 4 != 0 || len > DNS_PCAP_MAX_RECORD_SIZE ||
+            type == DNS_PCAPNG_EPB || type == DNS_PCAPNG_PB || type == DNS_PCAPNG_SPB)
+            break;
+        if (type == DNS_PCAPNG_IDB && len >= 20 &&
+            !dns_packet_decode_dlt_supported(dns_pcap_u16(r, p + 8))) {
+            supported = 0;
+            break;
+        }
+        pos += len;
+    }
+    r->swapped = swapped;
+    return supported;
+}
+
+/**
+ * Read the file header (pcap) or the first section header (pcapng).
+ * Returns 0 when the file is not supported.
+ */
+static int
+dns_pcap_read_header(struct dns_pcap_reader *r)
+{
+    if (!dns_pcap_ensure(r, DNS_PCAP_HEADER_SIZE))
+        return 0;
+    const uint8_t *p = r->data + r->start;
+    uint32_t magic;
+    memcpy(&magic, p, sizeof(magic));
+
+    if (magic == DNS_PCAPNG_SHB) {
+        // The section header is parsed as any other block
+        r->pcapng = 1;
+        return dns_pcap_pcapng_linktypes_supported(r);
+    }
+
+    uint64_t ts_units;
+    if (magic == DNS_PCAP_MAGIC_US || magic == __builtin_bswap32(DNS_PCAP_MAGIC_US))
+        ts_units = 1000000;
+    else if (magic == DNS_PCAP_MAGIC_NS || magic == __builtin_bswap32(DNS_PCAP_MAGIC_NS))
+        ts_units = 1000000000;
+    else
+        return 0;
+    r->swapped = (magic != DNS_PCAP_MAGIC_US && magic != DNS_PCAP_MAGIC_NS);
+    // The upper bits carry the FCS length
+    int linktype = dns_pcap_u32(r, p + 20) & 0xffff;
+    if (!dns_packet_decode_dlt_supported(linktype))
+        return 0;
+    dns_pcap_add_interface(r, linktype, ts_units);
+    r->file_snaplen = dns_pcap_u32(r, p + 16);
+    r->file_ts_units = ts_units;
+    r->start += DNS_PCAP_HEADER_SIZE;
+    return 1;
+}
+
+struct dns_pcap_reader *
+dns_pcap_reader_open(const char *path, const char *bpf_string, int snaplen)
+{
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        return NULL;
+    struct stat st;
+    uint8_t magic[8] = {0};
+    if (fstat(fd, &st) < 0 || !S_ISREG(st.st_mode) || pread(fd, magic, sizeof(magic), 0) < 4) {
+        close(fd);
+        return NULL;
+    }
+
+    struct dns_pcap_reader *r = xmalloc_zero(sizeof(struct dns_pcap_reader));
+    r->path = strdup(path);
+    r->fd = fd;
+    r->pipe_fd = -1;
+    r->bpf_string = strdup(bpf_string ? bpf_string : "");
+    r->snaplen = snaplen;
+
+    const char *command = NULL;
+    for (int i = 0; dns_pcap_decompressors[i].magic; i++)
+        if (memcmp(magic, dns_pcap_decompressors[i].magic, dns_pcap_decompressors[i].magic_len) == 0)
+            command = dns_pcap_decompressors[i].command;
+
+    if (command) {
+        r->pipe_fd = dns_pcap_start_decompressor(command, fd, &r->decompressor);
+        r->data_size = DNS_PCAP_READ_BUFFER_SIZE;
+        r->data = xmalloc(r->data_size);
+    } else if (st.st_size > 0) {
+        void *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (map == MAP_FAILED) {
+            msg(L_DEBUG, "Can not mmap '%s': %s", path, strerror(errno));
+            dns_pcap_reader_destroy(r);
+            return NULL;
+        }
+        madvise(map, st.st_size, MADV_SEQUENTIAL);
+        r->map = map;
+        r->map_size = st.st_size;
+        r->data = r->map;
+        r->data_size = r->end = r->map_size;
+    }
+
+    if (!dns_pcap_read_header(r)) {
+        dns_pcap_reader_destroy(r);
+        return NULL;
+    }
+    msg(L_DEBUG, "Reading %s file '%s' natively%s%s", r->pcapng ? "pcapng" : "pcap", path,
+        command ? ", decompressing with " : "", command ? command : "");
+    return r;
+}
+
+void
+dns_pcap_reader_destroy(struct dns_pcap_reader *r)
+{
+    if (r->map)
+        munmap(r->map, r->map_size);
+    else
+        free(r->data);
+    if (r->decompressor > 0) {
+        // Stop the decompressor when not at the end of its output
+        close(r->pipe_fd);
+        int status;
+        if (!r->eof)
+            kill(r->decompressor, SIGTERM);
+        if (waitpid(r->decompressor, &status, 0) < 0)
+            msg(L_ERROR, "Error waiting for the decompressor of '%s': %s", r->path, strerror(errno));
+        else if (r->eof && WIFEXITED(status) && WEXITSTATUS(status) != 0)
+            msg(L_ERROR, "Decompressor of '%s' exited with error status %d", r->path, WEXITSTATUS(status));
+    }
+    if (r->unsupported > 0)
+        msg(L_WARN, "Skipped %"PRIu64" packets of unsupported link types in '%s'", r->unsupported, r->path);
+    dns_pcap_clear_interfaces(r);
+    close(r->fd);
+    free(r->bpf_string);
+    free(r->path);
+    free(r);
+}
+
+/**
+ * Convert a timestamp in the given units per second.
+ */
+static dns_us_time_t
+dns_pcap_ts(uint64_t ts, uint64_t units)
+{
+    if (units == 1000000)
+        return ts;
+    uint64_t frac = ts % units;
+    // Avoid overflows for fine resolutions
+    uint64_t us = (units <= 1000000000000ULL) ? frac * 1000000 / units : frac / (units / 1000000);
+    return (dns_us_time_t)(ts / units) * 1000000 + us;
+}
+
+/**
+ * Read the next record of a pcap file, setting `*ifacep` to its interface.
+ */
+static dns_ret_t
+dns_pcap_next_pcap(struct dns_pcap_reader *r, struct dns_pcap_record *rec, const struct dns_pcap_interface **ifacep)
+{
+    if (!dns_pcap_ensure(r, DNS_PCAP_RECORD_HEADER_SIZE)) {
+        if (r->end != r->start) {
+            msg(L_ERROR, "Truncated record header at the end of '%s'", r->path);
+            return DNS_RET_ERR;
+        }
+        return DNS_RET_EOF;
+    }
+    const uint8_t *p = r->data + r->start;
+    uint32_t caplen = dns_pcap_u32(r, p + 8);
+    if (caplen > DNS_PCAP_MAX_RECORD_SIZE) {
+        msg(L_ERROR, "Corrupted record (length %u) in '%s'", caplen, r->path);
+        return DNS_RET_ERR;
+    }
+    if (!dns_pcap_ensure(r, DNS_PCAP_RECORD_HEADER_SIZE + caplen)) {
+        msg(L_ERROR, "Truncated record at the end of '%s'", r->path);
+        return DNS_RET_ERR;
+    }
+    p = r->data + r->start;
+    const struct dns_pcap_interface *iface = &r->interfaces[0];
+    rec->ts = (dns_us_time_t)dns_pcap_u32(r, p) * 1000000 +
+              dns_pcap_u32(r, p + 4) * 1000000ULL / iface->ts_units;
+    rec->caplen = caplen;
+    rec->wirelen = dns_pcap_u32(r, p + 12);
+    rec->linktype = iface->linktype;
+    rec->data = p + DNS_PCAP_RECORD_HEADER_SIZE;
+    r->start += DNS_PCAP_RECORD_HEADER_SIZE + caplen;
+    *ifacep = iface;
+    return DNS_RET_OK;
+}
+
+/**
+ * Parse the options of an interface description block for the timestamp resolution.
+ */
+static uint64_t
+dns_pcap_idb_ts_units(struct dns_pcap_reader *r, const uint8_t *opts, size_t len)
+{
+    uint64_t units = 1000000;
+    size_t pos = 0;
+    while (pos + 4 <= len) {
+        uint16_t code = dns_pcap_u16(r, opts + pos);
+        uint16_t opt_len = dns_pcap_u16(r, opts + pos + 2);
+        if (code == 0 || pos + 4 + opt_len > len)
+            break;
+        if (code == DNS_PCAPNG_OPT_IF_TSRESOL && opt_len >= 1) {
+            uint8_t res = opts[pos + 4];
+            uint64_t base = (res & 0x80) ? 2 : 10;
+            units = 1;
+            for (int i = 0; i < (res & 0x7f) && units < (1ULL << 60); i++)
+                units *= base;
+        }
+        pos += 4 + ((opt_len + 3) & ~3);
+    }
+    return units;
+}
+
+/**
+ * Read blocks of a pcapng file until the next packet, setting `*ifacep` to its interface.
+ */
+static dns_ret_t
+dns_pcap_next_pcapng(struct dns_pcap_reader *r, struct dns_pcap_record *rec, const struct dns_pcap_interface **ifacep)
+{
+    while (1) {
+        if (!dns_pcap_ensure(r, 12)) {
+            if (r->end != r->start) {
+                msg(L_ERROR, "Truncated block header at the end of '%s'", r->path);
+                return DNS_RET_ERR;
+            }
+            return DNS_RET_EOF;
+        }
+        const uint8_t *p = r->data + r->start;
+        uint32_t type;
+        memcpy(&type, p, sizeof(type));
+        if (type == DNS_PCAPNG_SHB) {
+            // New section, possibly in another byte order
+            uint32_t bom;
+            memcpy(&bom, p + 8, sizeof(bom));
+            if (bom != DNS_PCAPNG_BYTE_ORDER_MAGIC && bom != __builtin_bswap32(DNS_PCAPNG_BYTE_ORDER_MAGIC)) {
+                msg(L_ERROR, "Corrupted section header in '%s'", r->path);
+                return DNS_RET_ERR;
+            }
+            r->swapped = (bom != DNS_PCAPNG_BYTE_ORDER_MAGIC);
+            dns_pcap_clear_interfaces(r);
+        } else {
+            type = dns_pcap_u32(r, p);
+        }
+        uint32_t len = dns_pcap_u32(r, p + 4);
+        if (len < 12 || len % 4 != 0 || len > DNS_PCAP_MAX_RECORD_SIZE) {
+            msg(L_ERROR, "Corrupted block (length %u) in '%s'", len, r->path);
+            return DNS_RET_ERR;
+        }
+        if (!dns_pcap_ensure(r, len)) {
+            msg(L_ERROR, "Truncated block at the end of '%s'", r->path);
+            return DNS_RET_ERR;
+        }
+        p = r->data + r->start;
+        r->start += len;
+        size_t body = len - 12; // Without the type and both lengths
+
+        uint32_t ifid, caplen, wirelen, hdr;
+        uint64_t ts;
+        switch (type) {
+        case DNS_PCAPNG_IDB:
+            if (body < 8)
+                goto corrupted;
+            dns_pcap_add_interface(r, dns_pcap_u16(r, p + 8), dns_pcap_idb_ts_units(r, p + 16, body - 8));
+            continue;
+        case DNS_PCAPNG_EPB:
+        case DNS_PCAPNG_PB:
+            if (body < 20)
+                goto corrupted;
+            ifid = (type == DNS_PCAPNG_EPB) ? dns_pcap_u32(r, p + 8) : dns_pcap_u16(r, p + 8);
+            ts = ((uint64_t)dns_pcap_u32(r, p + 12) << 32) | dns_pcap_u32(r, p + 16);
+            caplen = dns_pcap_u32(r, p + 20);
+            wirelen = dns_pcap_u32(r, p + 24);
+            hdr = 28;
+            break;
+        case DNS_PCAPNG_SPB:
+            if (body < 4)
+                goto corrupted;
+            ifid = 0;
+            ts = 0;
+            wirelen = dns_pcap_u32(r, p + 8);
+            caplen = MIN(wirelen, len - 16);
+            hdr = 12;
+            break;
+        default:
+            continue; // Statistics, name resolution etc.
+        }
+        if (caplen > len - hdr - 4 || ifid >= (uint32_t)r->interface_count)
+            goto corrupted;
+
+        const struct dns_pcap_interface *iface = &r->interfaces[ifid];
+        rec->ts = dns_pcap_ts(ts, iface->ts_units);
+        rec->caplen = caplen;
+        rec->wirelen = wirelen;
+        rec->linktype = iface->linktype;
+        rec->data = p + hdr;
+        *ifacep = iface;
+        return DNS_RET_OK;
+    }
+
+corrupted:
+    msg(L_ERROR, "Corrupted packet block in '%s'", r->path);
+    return DNS_RET_ERR;
+}
+
+/**
+ * Is there a chain of valid record headers starting at `pos`,
+ * `DNS_PCAP_SPLIT_CHAIN` long or up to the end of the file?
+ */
+static int
+dns_pcap_valid_chain(struct dns_pcap_reader *r, size_t pos)
+{
+    uint32_t max_caplen = r->file_snaplen > 0 ? r->file_snaplen : DNS_PCAP_MAX_RECORD_SIZE;
+    dns_us_time_t prev_ts = DNS_NO_TIME;
+    for (int i = 0; i < DNS_PCAP_SPLIT_CHAIN; i++) {
+        if (pos == r->map_size)
+            return 1;
+        if (pos + DNS_PCAP_RECORD_HEADER_SIZE > r->map_size)
+            return 0;
+        const uint8_t *p = r->map + pos;
+        uint32_t frac = dns_pcap_u32(r, p + 4);
+        uint32_t caplen = dns_pcap_u32(r, p + 8);
+        uint32_t wirelen = dns_pcap_u32(r, p + 12);
+        // Empty records are rejected as runs of zero bytes in the packet data look like them
+        if (frac >= r->file_ts_units || caplen == 0 || caplen > max_caplen || caplen > wirelen ||
+            wirelen > DNS_PCAP_MAX_RECORD_SIZE)
+            return 0;
+        dns_us_time_t ts = (dns_us_time_t)dns_pcap_u32(r, p) * 1000000 + frac * 1000000ULL / r->file_ts_units;
+        if (prev_ts != DNS_NO_TIME && (ts < prev_ts - DNS_PCAP_SPLIT_MAX_TS_STEP || ts > prev_ts + DNS_PCAP_SPLIT_MAX_TS_STEP))
+            return 0;
+        prev_ts = ts;
+        pos += DNS_PCAP_RECORD_HEADER_SIZE + caplen;
+    }
+    return 1;
+}
+
+int
+dns_pcap_reader_split(struct dns_pcap_reader *r, size_t chunk_size, size_t **boundsp)
+{
+    if (!r->map || r->pcapng || chunk_size == 0)
+        return 0;
+    size_t max_count = (r->map_size - r->start) / chunk_size + 1;
+    size_t *bounds = xmalloc((max_count + 1) * sizeof(size_t));
+    int count = 0;
+    bounds[0] = r->start;
+    for (size_t nominal = r->start + chunk_size; nominal < r->map_size; nominal += chunk_size) {
+        // Only scan up to the next nominal boundary, joining the chunk with the next one otherwise
+        size_t pos = MAX(nominal, bounds[count] + 1);
+        size_t limit = MIN(nominal + chunk_size, r->map_size);
+        while (pos < limit && !dns_pcap_valid_chain(r, pos))
+            pos++;
+        if (pos < limit)
+            bounds[++count] = pos;
+    }
+    bounds[++count] = r->map_size;
+    *boundsp = bounds;
+    return count;
+}
+
+void
+dns_pcap_reader_set_range(struct dns_pcap_reader *r, size_t start, size_t end)
+{
+    assert(r->map && !r->pcapng && start <= end && end <= r->map_size);
+    r->start = start;
+    r->end = end;
+    size_t page = sysconf(_SC_PAGESIZE);
+    r->released = start / page * page;
+}
+
+dns_ret_t
+dns_pcap_reader_next(struct dns_pcap_reader *r, struct dns_pcap_record *rec)
+{
+    while (1) {
+        dns_pcap_release(r);
+        const struct dns_pcap_interface *iface = NULL;
+        dns_ret_t ret = r->pcapng ? dns_pcap_next_pcapng(r, rec, &iface) : dns_pcap_next_pcap(r, rec, &iface);
+        if (ret != DNS_RET_OK)
+            return ret;
+
+        if (!dns_packet_decode_dlt_supported(rec->linktype)) {
+            r->unsupported ++;
+            continue;
+        }
+        if (r->snaplen > 0)
+            rec->caplen = MIN(rec->caplen, (uint32_t)r->snaplen);
+        if (iface->filter) {
+            struct pcap_pkthdr hdr = { .caplen = rec->caplen, .len = rec->wirelen };
+            if (!pcap_offline_filter(iface->filter, &hdr, rec->data))
+                continue;
+        }
+        return DNS_RET_OK;
+    }
+}
@@ -0,0 +1,166 @@
+/* 
+ *  Copyright (C) 2016 CZ.NIC, z.s.p.o.
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef DNSCOL_PCAP_READER_H
+#define DNSCOL_PCAP_READER_H
+
+/**
+ * \file pcap_reader.h
+ * Native reader of pcap and pcapng capture files for offline input.
+ */
+
+#include <sys/types.h>
+
+#include "common.h"
+
+/**
+ * Interface of a pcap or pcapng file (pcap files have just one).
+ */
+struct dns_pcap_interface {
+    /** Link type (`LINKTYPE_*`) */
+    int linktype;
+
+    /** Timestamp units per second */
+    uint64_t ts_units;
+
+    /** Compiled input filter for the link type, NULL for no filtering. Owned. */
+    struct bpf_program *filter;
+};
+
+/**
+ * Reader of a pcap or pcapng file.
+ *
+ * Uncompressed files are mmapped (with `MADV_SEQUENTIAL`) and the packets are returned
+ * as slices of the mapping, without any copying. Compressed files (gzip, bzip2, xz, zstd
+ * and lzop by their magic) are decompressed by the respective tool in a subprocess,
+ * so the decompression runs in parallel with the parsing, and read from its pipe
+ * into a large buffer.
+ */
+struct dns_pcap_reader {
+    /** File path, owned. */
+    char *path;
+
+    /** The file descriptor */
+    int fd;
+
+    /** The mapped file, NULL when reading from a decompressor */
+    uint8_t *map;
+
+    /** The size of the mapped file */
+    size_t map_size;
+
+    /** Decompressor subprocess (0 for none) and its output pipe */
+    pid_t decompressor;
+    int pipe_fd;
+
+    /** The readable data: the whole mapping or the read buffer of the given size */
+    uint8_t *data;
+    size_t data_size;
+
+    /** The unprocessed bytes are `data[start..end)` */
+    size_t start, end;
+
+    /** Set when the decompressor output is at its end */
+    int eof;
+
+    /** The start of the mapping not yet released from the process memory */
+    size_t released;
+
+    /** Is the file pcapng? */
+    int pcapng;
+
+    /** Is the (current section of the) file in the other byte order? */
+    int swapped;
+
+    /** Interfaces of the file (current section for pcapng) */
+    struct dns_pcap_interface *interfaces;
+    int interface_count;
+
+    /** The input filter (owned) and snaplen used for its compilation */
+    char *bpf_string;
+    int snaplen;
+
+    /** Number of packets skipped for an unsupported link type */
+    uint64_t unsupported;
+
+    /** The snaplen and timestamp units from the pcap file header (not for pcapng) */
+    uint32_t file_snaplen;
+    uint64_t file_ts_units;
+};
+
+/**
+ * A packet read from the file, valid until the next read.
+ */
+struct dns_pcap_record {
+    /** Timestamp */
+    dns_us_time_t ts;
+
+    /** Link type of the packet data (`LINKTYPE_*`) */
+    int linktype;
+
+    /** Captured packet data, not owned */
+    const uint8_t *data;
+
+    /** Captured and original length */
+    uint32_t caplen, wirelen;
+};
+
+/**
+ * Open a pcap or pcapng file (possibly compressed) for reading.
+ * The packets not matching the BPF filter (if not empty) are skipped.
+ * Returns NULL when the file can not be opened, is not in a supported format or has
+ * a link type not supported by `dns_packet_decode_dlt()` (left to libtrace to read or report).
+ * For pcapng, the link types of the interfaces described before the first packet are checked.
+ */
+struct dns_pcap_reader *
+dns_pcap_reader_open(const char *path, const char *bpf_string, int snaplen);
+
+/**
+ * Read the next packet into `rec`.
+ * Returns DNS_RET_OK, DNS_RET_EOF at the end of the file or DNS_RET_ERR
+ * on a corrupted or truncated file (with a message logged).
+ */
+dns_ret_t
+dns_pcap_reader_next(struct dns_pcap_reader *r, struct dns_pcap_record *rec);
+
+/**
+ * Split a mapped (uncompressed) pcap file into chunks of about `chunk_size` bytes
+ * at record boundaries, to be read independently with `dns_pcap_reader_set_range()`.
+ * The boundaries are found by scanning from the nominal chunk offsets for a chain
+ * of valid record headers (sane non-zero lengths and timestamps), a chunk without any is joined
+ * with the following one. Stores the `count + 1` boundaries (from the first record
+ * to the file end) into a new array in `*boundsp` and returns the number of chunks,
+ * or 0 when the file can not be split (pcapng or compressed).
+ */
+int
+dns_pcap_reader_split(struct dns_pcap_reader *r, size_t chunk_size, size_t **boundsp);
+
+/**
+ * Limit the reading to the records in the file range `[start, end)`, which must start
+ * and end at record boundaries found by `dns_pcap_reader_split()`. Must be called
+ * before reading any records.
+ */
+void
+dns_pcap_reader_set_range(struct dns_pcap_reader *r, size_t start, size_t end);
+
+/**
+ * Close the file, stop any decompressor and free the reader.
+ */
+void
+dns_pcap_reader_destroy(struct dns_pcap_reader *r);
+
+#endif /* DNSCOL_PCAP_READER_H */
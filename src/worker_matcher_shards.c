@@ -0,0 +1,304 @@
+/*
+ *  Copyright (C) 2016 CZ.NIC, z.s.p.o.
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <assert.h>
+#include <pthread.h>
+
+#include "packet_frame.h"
+#include "frame_queue.h"
+#include "worker_packet_matcher.h"
+#include "worker_matcher_shards.h"
+#include "packet.h"
+
+struct dns_worker_matcher_shards *
+dns_worker_matcher_shards_create(struct dns_config *conf, struct dns_frame_queue *in, struct dns_frame_queue *out)
+{
+    assert(in && conf->match_threads >= 1);
+    struct dns_worker_matcher_shards *ms = xmalloc_zero(sizeof(struct dns_worker_matcher_shards));
+    ms->in = in;
+    ms->out = out;
+    ms->count = conf->match_threads;
+    ms->next_seq = 0;
+    ms->outframe = NULL;
+    ms->current_time = DNS_NO_TIME;
+    ms->matching_duration = dns_fsec_to_us_time(conf->match_window_sec);
+    ms->frame_max_duration = dns_fsec_to_us_time(conf->max_frame_duration_sec);
+    ms->frame_max_size = conf->max_frame_size;
+    pthread_mutex_init(&ms->running, NULL);
+
+    // All the shards output to one queue, the only one with multiple producers
+    ms->shard_out = dns_frame_queue_create(conf->max_queue_len * ms->count, conf->max_queue_size * ms->count,
+                                           DNS_QUEUE_BLOCK);
+    ms->shard_in = xmalloc_zero(ms->count * sizeof(struct dns_frame_queue *));
+    ms->matchers = xmalloc_zero(ms->count * sizeof(struct dns_worker_packet_matcher *));
+    ms->pending = xmalloc_zero(ms->count * sizeof(clist));
+    ms->progress = xmalloc_zero(ms->count * sizeof(dns_us_time_t));
+    ms->finished = xmalloc_zero(ms->count * sizeof(int));
+    for (int i = 0; i < ms->count; i++) {
+        ms->shard_in[i] = dns_frame_queue_create_spsc(conf->max_queue_len, conf->max_queue_size, DNS_QUEUE_BLOCK);
+        ms->matchers[i] = dns_worker_packet_matcher_create(conf, ms->shard_in[i], ms->shard_out);
+        ms->matchers[i]->shard = i;
+        clist_init(&ms->pending[i]);
+        ms->progress[i] = DNS_NO_TIME;
+        ms->finished[i] = 0;
+    }
+    return ms;
+}
+
+void
+dns_worker_matcher_shards_destroy(struct dns_worker_matcher_shards *ms)
+{
+    if (pthread_mutex_trylock(&ms->running) != 0)
+        die("destroying a running sharded matcher");
+    pthread_mutex_unlock(&ms->running);
+    pthread_mutex_destroy(&ms->running);
+    for (int i = 0; i < ms->count; i++) {
+        dns_worker_packet_matcher_destroy(ms->matchers[i]);
+        dns_frame_queue_destroy(ms->shard_in[i]);
+        assert(clist_empty(&ms->pending[i]));
+    }
+    dns_frame_queue_destroy(ms->shard_out);
+    free(ms->shard_in);
+    free(ms->matchers);
+    free(ms->pending);
+    free(ms->progress);
+    free(ms->finished);
+    free(ms);
+}
+
+
+/**
+ * Split the input frames between the shards, numbering the packets in their input order.
+ * Every shard receives a frame (possibly empty) for every input frame.
+ */
+static void*
+dns_worker_matcher_shards_dispatch_main(void *shards)
+{
+    struct dns_worker_matcher_shards *ms = shards;
+    struct dns_packet_frame **frames = alloca(ms->count * sizeof(struct dns_packet_frame *));
+    int run = 1;
+    while (run) {
+        struct dns_packet_frame *f = dns_frame_queue_dequeue(ms->in);
+        for (int i = 0; i < ms->count; i++) {
+            frames[i] = dns_packet_frame_create(f->time_start, f->time_end);
+            frames[i]->type = f->type;
+        }
+        struct dns_packet *pkt;
+        while ((pkt = clist_remove_head(&f->packets))) {
+            pkt->seq = ms->next_seq ++;
+            // The low hash bits select the hash table slot, use the high ones
+            int i = (pkt->key_hash >> 32) % ms->count;
+            dns_packet_frame_append_packet(frames[i], pkt);
+        }
+        if (f->type == 1)
+            run = 0;
+        dns_packet_frame_destroy(f);
+        for (int i = 0; i < ms->count; i++)
+            dns_frame_queue_enqueue(ms->shard_in[i], frames[i]); // Hand over ownership
+    }
+    return NULL;
+}
+
+
+/**
+ * Outputs the current merged frame and creates a new one.
+ */
+static void
+dns_worker_matcher_shards_output_frame(struct dns_worker_matcher_shards *ms)
+{
+    struct dns_packet_frame *new_frame = dns_packet_frame_create(ms->outframe->time_end, ms->outframe->time_end);
+    dns_frame_queue_enqueue(ms->out, ms->outframe); // Hand over ownership
+    ms->outframe = new_frame;
+}
+
+/**
+ * Advance the time of the merged stream, closing the frames exactly as a single matcher
+ * would (see `dns_worker_packet_matcher_advance_time_to()`).
+ */
+static void
+dns_worker_matcher_shards_advance_time_to(struct dns_worker_matcher_shards *ms, dns_us_time_t time)
+{
+    assert(ms->outframe && ms->current_time != DNS_NO_TIME);
+    while (ms->current_time < time) {
+        dns_us_time_t ev_time = ms->outframe->time_start + ms->frame_max_duration + ms->matching_duration;
+        if (ev_time > time) {
+            ms->current_time = time;
+        } else {
+            assert(ms->outframe->time_end <= ev_time - ms->matching_duration);
+            ms->outframe->time_end = ev_time - ms->matching_duration;
+            ms->current_time = ev_time;
+            dns_worker_matcher_shards_output_frame(ms);
+        }
+    }
+}
+
+/**
+ * Append a packet leaving a shard to the merged stream.
+ * In a single matcher, the packet would leave at its exit time.
+ */
+static void
+dns_worker_matcher_shards_append_packet(struct dns_worker_matcher_shards *ms, struct dns_packet *pkt)
+{
+    dns_worker_matcher_shards_advance_time_to(ms, dns_worker_packet_matcher_exit_time(ms->matchers[0], pkt));
+    if (ms->outframe->size + pkt->memory_size > ms->frame_max_size)
+        dns_worker_matcher_shards_output_frame(ms);
+    dns_us_time_t time_end = ms->outframe->time_end;
+    dns_packet_frame_append_packet(ms->outframe, pkt);
+    if (ms->matchers[0]->early_release)
+        ms->outframe->time_end = MAX(time_end, MIN(pkt->ts, ms->current_time - ms->matching_duration));
+}
+
+/**
+ * Compare the packets by the order of leaving a single matcher: by the exit time and then
+ * by the input order of the packet causing the exit (the response for early released matched requests).
+ */
+static int
+dns_worker_matcher_shards_exit_before(struct dns_worker_matcher_shards *ms, struct dns_packet *p1, struct dns_packet *p2)
+{
+    dns_us_time_t e1 = dns_worker_packet_matcher_exit_time(ms->matchers[0], p1);
+    dns_us_time_t e2 = dns_worker_packet_matcher_exit_time(ms->matchers[0], p2);
+    if (e1 != e2)
+        return e1 < e2;
+    int early = ms->matchers[0]->early_release;
+    uint64_t s1 = (early && p1->response) ? p1->response->seq : p1->seq;
+    uint64_t s2 = (early && p2->response) ? p2->response->seq : p2->seq;
+    return s1 < s2;
+}
+
+/**
+ * Move all the packets that can not be preceded by any future shard output
+ * to the merged stream, in the order they would leave a single matcher.
+ * Any future packet of a shard leaves at its last reported matcher time or later,
+ * so packets exiting strictly before the minimum of such times over all the running
+ * shards are safe to release.
+ */
+static void
+dns_worker_matcher_shards_release(struct dns_worker_matcher_shards *ms)
+{
+    int all_finished = 1;
+    dns_us_time_t watermark = DNS_NO_TIME;
+    for (int i = 0; i < ms->count; i++) {
+        if (ms->finished[i])
+            continue;
+        all_finished = 0;
+        if (ms->progress[i] == DNS_NO_TIME)
+            return; // Nothing known about this shard yet
+        if (watermark == DNS_NO_TIME || ms->progress[i] < watermark)
+            watermark = ms->progress[i];
+    }
+
+    while (1) {
+        int best = -1;
+        struct dns_packet *best_pkt = NULL;
+        for (int i = 0; i < ms->count; i++) {
+            struct dns_packet *pkt = clist_head(&ms->pending[i]);
+            if (!pkt || (!all_finished &&
+                         dns_worker_packet_matcher_exit_time(ms->matchers[0], pkt) >= watermark))
+                continue;
+            if (!best_pkt || dns_worker_matcher_shards_exit_before(ms, pkt, best_pkt)) {
+                best = i;
+                best_pkt = pkt;
+            }
+        }
+        if (best < 0)
+            break;
+        clist_remove_head(&ms->pending[best]);
+        dns_worker_matcher_shards_append_packet(ms, best_pkt);
+    }
+
+    if (!all_finished)
+        dns_worker_matcher_shards_advance_time_to(ms, watermark);
+}
+
+static void*
+dns_worker_matcher_shards_merge_main(void *shards)
+{
+    struct dns_worker_matcher_shards *ms = shards;
+    int running_shards = ms->count;
+    dns_us_time_t final_time = DNS_NO_TIME;
+
+    while (running_shards > 0) {
+        struct dns_packet_frame *f = dns_frame_queue_dequeue(ms->shard_out);
+        int i = f->shard;
+        assert(i >= 0 && i < ms->count && !ms->finished[i]);
+        if (f->type == 1) {
+            assert(f->count == 0);
+            ms->finished[i] = 1;
+            running_shards --;
+            if (final_time == DNS_NO_TIME || f->time_start > final_time)
+                final_time = f->time_start;
+        } else {
+            if (!ms->outframe) { // The first frame of any of the shards
+                assert(f->time_start != DNS_NO_TIME);
+                ms->outframe = dns_packet_frame_create(f->time_start, f->time_start);
+                ms->current_time = f->time_start;
+            }
+            clist_add_list_tail(&ms->pending[i], &f->packets);
+            f->count = 0;
+            ms->progress[i] = f->matcher_time;
+        }
+        dns_packet_frame_destroy(f);
+        if (ms->outframe)
+            dns_worker_matcher_shards_release(ms);
+    }
+
+    // Flush the last frame as a single matcher would
+    if (ms->outframe) {
+        if (final_time != DNS_NO_TIME)
+            dns_worker_matcher_shards_advance_time_to(ms, final_time);
+        dns_frame_queue_enqueue(ms->out, ms->outframe);
+        ms->outframe = NULL;
+    }
+    dns_frame_queue_enqueue(ms->out, dns_packet_frame_create_final(ms->current_time));
+    return NULL;
+}
+
+void
+dns_worker_matcher_shards_finish(struct dns_worker_matcher_shards *ms)
+{
+    int r = pthread_join(ms->dispatch_thread, NULL);
+    assert(r == 0);
+    for (int i = 0; i < ms->count; i++)
+        dns_worker_packet_matcher_finish(ms->matchers[i]);
+    r = pthread_join(ms->merge_thread, NULL);
+    assert(r == 0);
+    pthread_mutex_unlock(&ms->running);
+    for (int i = 0; i < ms->count; i++) {
+        char name[32];
+        snprintf(name, sizeof(name), "shard-%d-in", i);
+        dns_frame_queue_report(ms->shard_in[i], name);
+    }
+    dns_frame_queue_report(ms->shard_out, "shards-out");
+    msg(L_DEBUG, "Sharded packet matcher stopped and joined");
+}
+
+void
+dns_worker_matcher_shards_start(struct dns_worker_matcher_shards *ms)
+{
+    if (pthread_mutex_trylock(&ms->running) != 0)
+        die("starting a running sharded matcher");
+    for (int i = 0; i < ms->count; i++)
+        dns_worker_packet_matcher_start(ms->matchers[i]);
+    int r = pthread_create(&ms->merge_thread, NULL, dns_worker_matcher_shards_merge_main, ms);
+    assert(r == 0);
+    r = pthread_create(&ms->dispatch_thread, NULL, dns_worker_matcher_shards_dispatch_main, ms);
+    assert(r == 0);
+    msg(L_DEBUG, "Sharded packet matcher started (%d shards)", ms->count);
+}
@@ -0,0 +1,120 @@
+/*
+ *  Copyright (C) 2016 CZ.NIC, z.s.p.o.
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef DNSCOL_WORKER_MATCHER_SHARDS_H
+#define DNSCOL_WORKER_MATCHER_SHARDS_H
+
+#include "common.h"
+#include "config.h"
+
+/**
+ * \file worker_matcher_shards.h
+ * Request/response matching split over several matcher threads.
+ */
+
+struct dns_frame_queue;
+struct dns_packet_frame;
+struct dns_worker_packet_matcher;
+
+/**
+ * A group of packet matchers working on disjoint subsets of the traffic.
+ *
+ * A dispatcher thread splits every input frame into one frame per shard by a
+ * direction-symmetric flow hash (so a request and its response always meet in the same shard),
+ * numbering the packets in input order. Every shard gets every frame (possibly empty),
+ * so all shards advance their time in lockstep.
+ *
+ * A merger thread collects the shard outputs from a shared queue and re-assembles
+ * them into a single stream of frames, packet by packet in the order they would leave
+ * a single matcher, using the same frame splitting rules. For time-ordered input,
+ * the resulting stream is identical to the output of a single matcher.
+ */
+struct dns_worker_matcher_shards {
+    /** Input and output queue. Output may be NULL (discard). */
+    struct dns_frame_queue *in, *out;
+
+    /** Number of shards. */
+    int count;
+
+    /** The shard matchers, owned. */
+    struct dns_worker_packet_matcher **matchers;
+
+    /** Per-shard input queues, owned. */
+    struct dns_frame_queue **shard_in;
+
+    /** Queue shared by all the shard outputs, owned. */
+    struct dns_frame_queue *shard_out;
+
+    /** The dispatching and merging threads. */
+    pthread_t dispatch_thread, merge_thread;
+
+    /** The mutex indicating that the threads are started and running. */
+    pthread_mutex_t running;
+
+    /** Sequence number of the next dispatched packet. */
+    uint64_t next_seq;
+
+    /** Per-shard lists of packets waiting to be merged. */
+    clist *pending;
+
+    /** Per-shard matcher time of the last received frame (DNS_NO_TIME before the first one). */
+    dns_us_time_t *progress;
+
+    /** Per-shard flag of having received the final frame. */
+    int *finished;
+
+    /** The length of the window for finding matches */
+    dns_us_time_t matching_duration;
+
+    /** Maximum packet frame duration */
+    dns_us_time_t frame_max_duration;
+
+    /** Maximum packet frame size in bytes */
+    int frame_max_size;
+
+    /** Currently written frame */
+    struct dns_packet_frame *outframe;
+
+    /** Matching time of the merged stream (same meaning as in a single matcher) */
+    dns_us_time_t current_time;
+};
+
+/**
+ * Create a sharded packet matcher with `conf->match_threads` shards. The output queue is optional.
+ */
+struct dns_worker_matcher_shards *
+dns_worker_matcher_shards_create(struct dns_config *conf, struct dns_frame_queue *in, struct dns_frame_queue *out);
+
+/**
+ * Wait for all the threads of the sharded matcher to stop.
+ */
+void
+dns_worker_matcher_shards_finish(struct dns_worker_matcher_shards *ms);
+
+/**
+ * Destroy the sharded matcher struct, the threads must not be running!
+ */
+void
+dns_worker_matcher_shards_destroy(struct dns_worker_matcher_shards *ms);
+
+/**
+ * Start the dispatcher, shard and merger threads. The threads must not be already running!
+ */
+void
+dns_worker_matcher_shards_start(struct dns_worker_matcher_shards *ms);
+
+#endif /* DNSCOL_WORKER_MATCHER_SHARDS_H */
@@ -39,14 +39,27 @@ dns_worker_packet_matcher_create(struct dns_config *conf, struct dns_frame_queue
     pm->outframe = NULL;
     pm->current_time = DNS_NO_TIME;
     pm->matching_duration = dns_fsec_to_us_time(conf->match_window_sec);
+    pm->early_release = conf->match_early_release;
+    pm->emit_delay = dns_fsec_to_us_time(conf->match_emit_delay_sec);
     pm->match_qname = conf->match_qname;
     pm->frame_max_duration = dns_fsec_to_us_time(conf->max_frame_duration_sec);
     pm->frame_max_size = conf->max_frame_size;
     assert(pm->matching_duration > 0);
     pthread_mutex_init(&pm->running, NULL);
-    // Actually uses a random seed (indicated by the 0 value)
-    pm->hash_table = dns_packet_hash_create(WORKER_PACKET_MATCHER_MIN_HASH_SIZE, 0);
-    clist_init(&pm->packet_queue);
+    pm->hash_table = dns_packet_hash_create(WORKER_PACKET_MATCHER_MIN_HASH_SIZE);
+
+    // The wheel has to hold packets from the grace time before current_time up to current_time + matching_duration
+    pm->wheel_slot_us = WORKER_PACKET_MATCHER_WHEEL_SLOT_US;
+    while (pm->matching_duration / pm->wheel_slot_us + 3 > WORKER_PACKET_MATCHER_MAX_WHEEL_SIZE)
+        pm->wheel_slot_us *= 2;
+    pm->wheel_size = 2;
+    while (pm->wheel_size < pm->matching_duration / pm->wheel_slot_us + 3)
+        pm->wheel_size *= 2;
+    pm->wheel = xmalloc_zero(pm->wheel_size * sizeof(clist));
+    for (size_t i = 0; i < pm->wheel_size; i++)
+        clist_init(&pm->wheel[i]);
+    pm->wheel_pos = 0;
+    pm->wheel_count = 0;
     return pm;
 }
 
@@ -58,10 +71,23 @@ dns_worker_packet_matcher_destroy(struct dns_worker_packet_matcher *pm)
     pthread_mutex_unlock(&pm->running);
     pthread_mutex_destroy(&pm->running);
     dns_packet_hash_destroy(pm->hash_table);
+    assert(pm->wheel_count == 0);
+    free(pm->wheel);
     free(pm);
 }
 
 
+/**
+ * Tags the frame with the matcher shard number and time and hands it over to the output queue.
+ */
+static void
+dns_worker_packet_matcher_enqueue(struct dns_worker_packet_matcher *pm, struct dns_packet_frame *frame)
+{
+    frame->shard = pm->shard;
+    frame->matcher_time = pm->current_time;
+    dns_frame_queue_enqueue(pm->out, frame); // Hand over ownership
+}
+
 /**
  * Outputs the current frame and creates a new one.
  */
@@ -69,11 +95,131 @@ static void
 dns_worker_packet_matcher_output_frame(struct dns_worker_packet_matcher *pm)
 {
     struct dns_packet_frame *new_frame = dns_packet_frame_create(pm->outframe->time_end, pm->outframe->time_end);
-    dns_frame_queue_enqueue(pm->out, pm->outframe); // Hand over ownership
+    dns_worker_packet_matcher_enqueue(pm, pm->outframe);
     pm->outframe = new_frame;
 }
 
 
+/**
+ * Append a packet leaving the matcher to the current frame, starting a new one if full.
+ */
+static void
+dns_worker_packet_matcher_append_packet(struct dns_worker_packet_matcher *pm, struct dns_packet *pkt)
+{
+    if (pm->outframe->size + pkt->memory_size > pm->frame_max_size)
+        dns_worker_packet_matcher_output_frame(pm);
+    dns_us_time_t time_end = pm->outframe->time_end;
+    dns_packet_frame_append_packet(pm->outframe, pkt);
+    // The frame ends at most at the current time minus the window (early matched requests are newer)
+    if (pm->early_release)
+        pm->outframe->time_end = MAX(time_end, MIN(pkt->ts, pm->current_time - pm->matching_duration));
+}
+
+/**
+ * Return the time when a packet in the wheel is due to leave the matcher.
+ */
+static inline dns_us_time_t
+dns_worker_packet_matcher_deadline(const struct dns_worker_packet_matcher *pm, const struct dns_packet *pkt)
+{
+    if (pkt->response && pm->early_release)
+        return pkt->ts + pm->emit_delay;
+    return pkt->ts + pm->matching_duration;
+}
+
+/**
+ * Put a packet into the wheel slot of its deadline, after all the packets with the same
+ * or earlier deadline (so the packets leave by the deadline and then by the arrival).
+ * Packets too old for the slots still in the wheel go to the next slot to expire.
+ */
+static void
+dns_worker_packet_matcher_wheel_add(struct dns_worker_packet_matcher *pm, struct dns_packet *pkt)
+{
+    // Skip the empty slots at once
+    if (pm->wheel_count == 0)
+        pm->wheel_pos = MAX(pm->wheel_pos, (uint64_t)(pm->current_time / pm->wheel_slot_us));
+    dns_us_time_t deadline = dns_worker_packet_matcher_deadline(pm, pkt);
+    uint64_t slot = deadline / pm->wheel_slot_us;
+    if (slot < pm->wheel_pos)
+        slot = pm->wheel_pos;
+    assert(slot - pm->wheel_pos < pm->wheel_size);
+    clist *list = &pm->wheel[slot & (pm->wheel_size - 1)];
+    // Time-ordered packets go right to the tail
+    struct dns_packet *prev = clist_tail(list);
+    while (prev && dns_worker_packet_matcher_deadline(pm, prev) > deadline)
+        prev = clist_prev(list, &prev->node);
+    if (prev)
+        clist_insert_after(&pkt->node, &prev->node);
+    else
+        clist_add_head(list, &pkt->node);
+    pm->wheel_count ++;
+}
+
+/**
+ * Return the next packet to leave the wheel (skipping the empty slots), or NULL when empty.
+ */
+static struct dns_packet *
+dns_worker_packet_matcher_wheel_head(struct dns_worker_packet_matcher *pm)
+{
+    if (pm->wheel_count == 0)
+        return NULL;
+    while (clist_empty(&pm->wheel[pm->wheel_pos & (pm->wheel_size - 1)]))
+        pm->wheel_pos ++;
+    return clist_head(&pm->wheel[pm->wheel_pos & (pm->wheel_size - 1)]);
+}
+
+/**
+ * Output the next packet of the wheel.
+ */
+static void
+dns_worker_packet_matcher_evict_packet(struct dns_worker_packet_matcher *pm, struct dns_packet *pkt)
+{
+    clist_unlink(&pkt->node);
+    pm->wheel_count --;
+    // Remove the packet from the hashtable only if it has no matched response
+    if ((DNS_PACKET_IS_REQUEST(pkt)) && (!pkt->response))
+        dns_packet_hash_remove_packet(pm->hash_table, pkt);
+    dns_worker_packet_matcher_append_packet(pm, pkt);
+}
+
+/**
+ * Return the time when the current output frame is due to be output.
+ */
+static inline dns_us_time_t
+dns_worker_packet_matcher_frame_deadline(const struct dns_worker_packet_matcher *pm)
+{
+    return pm->outframe->time_start + pm->frame_max_duration + pm->matching_duration;
+}
+
+/**
+ * Output the packets of the current wheel slot in one pass, from its head (due by `time`
+ * and before the frame deadline, as checked by the caller) for as long as they are due
+ * before both and the current time is before `time`, advancing the current time to their deadlines.
+ */
+static void
+dns_worker_packet_matcher_evict_slot(struct dns_worker_packet_matcher *pm, dns_us_time_t time)
+{
+    clist *list = &pm->wheel[pm->wheel_pos & (pm->wheel_size - 1)];
+    struct dns_packet *pkt = clist_head(list);
+    dns_us_time_t deadline = dns_worker_packet_matcher_deadline(pm, pkt);
+    do {
+        pm->current_time = MAX(pm->current_time, deadline);
+        dns_worker_packet_matcher_evict_packet(pm, pkt);
+        pkt = clist_head(list);
+        if (!pkt)
+            break;
+        deadline = dns_worker_packet_matcher_deadline(pm, pkt);
+        // A full output frame starts a new one, with its own deadline
+    } while (pm->current_time < time && deadline <= time && deadline < dns_worker_packet_matcher_frame_deadline(pm));
+}
+
+dns_us_time_t
+dns_worker_packet_matcher_exit_time(const struct dns_worker_packet_matcher *pm, const struct dns_packet *pkt)
+{
+    if (pkt->response && pm->early_release)
+        return MAX(pkt->response->ts, pkt->ts + pm->emit_delay);
+    return pkt->ts + pm->matching_duration;
+}
+
 /**
  * Advance the time of the matcher to the given time.
  * Outputs any packets that should leave the matcher berore that time
@@ -84,7 +230,7 @@ static void
 dns_worker_packet_matcher_advance_time_to(struct dns_worker_packet_matcher *pm, dns_us_time_t time)
 {
     assert(pm && time != DNS_NO_TIME && pm->current_time != DNS_NO_TIME);
-    if (time < pm->current_time - 1000) { // TODO: configurable grace time (now 1 ms), or reorder packets?
+    if (time < pm->current_time - WORKER_PACKET_MATCHER_TIME_GRACE_US) {
         msg(L_WARN | DNS_MSG_SPAM, "Not advancing matcher time back %f s from %f s (packets in the wrong order?)",
             dns_us_time_to_fsec(pm->current_time - time), dns_us_time_to_fsec(pm->current_time));
         return;
@@ -92,36 +238,25 @@ dns_worker_packet_matcher_advance_time_to(struct dns_worker_packet_matcher *pm,
 
     while (pm->current_time < time) {
         // What happens first - packet exit or frame end?
-        struct dns_packet *pkt = clist_head(&pm->packet_queue);
+        struct dns_packet *pkt = dns_worker_packet_matcher_wheel_head(pm);
         // When will current frame get evicted:
-        dns_us_time_t ev_time = pm->outframe->time_start + pm->frame_max_duration + pm->matching_duration;
-        // When will the next queued packet (if any) get evicted:
-        if (pkt) {
-            ev_time = MIN(ev_time, pkt->ts + pm->matching_duration);
-        }
+        dns_us_time_t frame_ev_time = dns_worker_packet_matcher_frame_deadline(pm);
+        dns_us_time_t ev_time = frame_ev_time;
+        // When will the next waiting packet (if any) get evicted:
+        if (pkt)
+            ev_time = MIN(ev_time, dns_worker_packet_matcher_deadline(pm, pkt));
         if (ev_time > time) {
             // Both events after `time`
             pm->current_time = time;
+        } else if (ev_time == frame_ev_time) {
+            // Output frame before it is too long
+            pm->current_time = MAX(pm->current_time, ev_time);
+            assert(pm->outframe->time_end <= ev_time - pm->matching_duration);
+            pm->outframe->time_end = ev_time - pm->matching_duration;
+            dns_worker_packet_matcher_output_frame(pm);
         } else {
-            if (ev_time == pm->outframe->time_start + pm->frame_max_duration + pm->matching_duration) {
-                // Output frame before it is too long
-                assert(pm->outframe->time_end <= ev_time - pm->matching_duration);
-                pm->outframe->time_end = ev_time - pm->matching_duration;
-                pm->current_time = ev_time;
-                dns_worker_packet_matcher_output_frame(pm);
-            } else {
-                // Output the packet
-                if (pm->outframe->size + pkt->memory_size > pm->frame_max_size)
-                    dns_worker_packet_matcher_output_frame(pm);
-                // Remove packet from the queue
-                clist_unlink(&pkt->node);
-                // Remove the packet from the hashtable only if it has no matched response
-                if ((DNS_PACKET_IS_REQUEST(pkt)) && (!pkt->response)) {
-                    dns_packet_hash_remove_packet(pm->hash_table, pkt);
-                }
-                dns_packet_frame_append_packet(pm->outframe, pkt);
-                pm->current_time = ev_time;
-            }
+            // Output the due packets of the slot
+            dns_worker_packet_matcher_evict_slot(pm, time);
         }
     }
 }
@@ -177,19 +312,31 @@ dns_worker_packet_matcher_main(void *matcher)
     while((pkt = dns_worker_packet_matcher_next_packet(pm))) {
         // NOTE: pm->curtime is already advanced by .._next_packet()
         if (DNS_PACKET_IS_REQUEST(pkt)) {
-            // Requests are enqueued and hashed
+            // Requests are put into the wheel and hashed
             dns_packet_hash_insert_packet(pm->hash_table, pkt);
-            clist_add_tail(&pm->packet_queue, &pkt->node); 
+            dns_worker_packet_matcher_wheel_add(pm, pkt);
         } else {
             struct dns_packet *req = dns_packet_hash_get_match(pm->hash_table, pkt, pm->match_qname);
-            if (req) {
+            if (req && !pm->early_release) {
                 // Matched response to a request 
-                // - request removed from hash and left in the queue
+                // - request removed from hash and left in the wheel
+                // - response included in the request
+                req->response = pkt;
+            } else if (req) {
+                // Matched response to a request, released early
+                // - request removed from hash and the wheel
                 // - response included in the request
+                // - both output right away or after the emit delay
+                clist_unlink(&req->node);
+                pm->wheel_count --;
                 req->response = pkt;
+                if (req->ts + pm->emit_delay <= pm->current_time)
+                    dns_worker_packet_matcher_append_packet(pm, req);
+                else
+                    dns_worker_packet_matcher_wheel_add(pm, req);
             } else {
-                // Response not matched, enqueue
-                clist_add_tail(&pm->packet_queue, &pkt->node);
+                // Response not matched, wait in the wheel
+                dns_worker_packet_matcher_wheel_add(pm, pkt);
             }
         }
     }
@@ -197,10 +344,10 @@ dns_worker_packet_matcher_main(void *matcher)
     if (pm->current_time != DNS_NO_TIME) 
         dns_worker_packet_matcher_advance_time_to(pm, pm->current_time + pm->matching_duration + 1);
     if (pm->outframe) {
-        dns_frame_queue_enqueue(pm->out, pm->outframe);
+        dns_worker_packet_matcher_enqueue(pm, pm->outframe);
         pm->outframe = NULL;
     }
-    dns_frame_queue_enqueue(pm->out, dns_packet_frame_create_final(pm->current_time));
+    dns_worker_packet_matcher_enqueue(pm, dns_packet_frame_create_final(pm->current_time));
     pthread_mutex_unlock(&pm->running);
     return NULL;
 }
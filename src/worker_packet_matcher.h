@@ -32,9 +32,19 @@ struct dns_packet_hash;
 
 /**
  * A worker matching requests to responses within a time window.
- * All the packets are kept in a queue, staying there for matching_duration.
  * All requests are hashed by IP+PORT+ID, all responses are matched against
  * this hash to find a matching QNAME (which may be empty in some cases).
+ *
+ * The packets wait in a timing wheel of `wheel_slot_us` slots, ordered by
+ * the deadline and the arrival within a slot, and leave at `ts + matching_duration`.
+ * The due packets of a slot are output in a single pass over the slot.
+ * A matched request stays in the wheel and leaves together with its response.
+ * For time-ordered input, the output is in the input order.
+ *
+ * With `early_release`, a matched request leaves together with its response as soon
+ * as the response arrives, or is moved back to the wheel until `ts + emit_delay` if that
+ * is later. The output is ordered by the time of leaving the matcher, which keeps it
+ * ordered by `ts` only up to `matching_duration - emit_delay`.
  */
 struct dns_worker_packet_matcher {
     /** Input and output queue. Output may be NULL (discard). */
@@ -49,12 +59,33 @@ struct dns_worker_packet_matcher {
     /** The hash table with packets */
     struct dns_packet_hash *hash_table;
 
-    /** The queue of packets in the hash table */
-    clist packet_queue;
+    /** Timing wheel of the waiting packets, a ring of `wheel_size` packet lists.
+     * A packet with deadline `ts + matching_duration` is in the absolute slot
+     * `deadline / wheel_slot_us`, stored at index `slot % wheel_size`.
+     * Every slot is ordered by the deadline and the arrival. */
+    clist *wheel;
+
+    /** Number of slots in the wheel (a power of two, covering more than `matching_duration`) */
+    size_t wheel_size;
+
+    /** Duration of a wheel slot */
+    dns_us_time_t wheel_slot_us;
+
+    /** Absolute index of the slot with the next packet to leave */
+    uint64_t wheel_pos;
+
+    /** Number of packets in the wheel */
+    size_t wheel_count;
 
     /** The length of the window for finding matches */
     dns_us_time_t matching_duration;
 
+    /** Output the matched pairs before the end of the matching window */
+    int early_release;
+
+    /** Minimal delay of an early released matched pair after the request (0 to output right away) */
+    dns_us_time_t emit_delay;
+
     /** Maximum packet frame duration */
     dns_us_time_t frame_max_duration;
 
@@ -72,17 +103,38 @@ struct dns_worker_packet_matcher {
 
     /** Time of the last packet read */
     dns_us_time_t current_time;
+
+    /** Index of this matcher when running as one of several shards, stored in output frames. */
+    int shard;
 };
 
 /** Default and minimal size for the matcher hash table */
 #define WORKER_PACKET_MATCHER_MIN_HASH_SIZE 1024
 
+/** Minimal duration of a timing wheel slot */
+#define WORKER_PACKET_MATCHER_WHEEL_SLOT_US 1000
+
+/** Maximal number of timing wheel slots, the slots are longer for very long matching windows */
+#define WORKER_PACKET_MATCHER_MAX_WHEEL_SIZE 65536
+
+/** Packets older than the matcher time by at most this are not reported as being in the wrong order
+ * (the time never goes back). Larger reordering is undone by the input (`input_reorder_window`). */
+#define WORKER_PACKET_MATCHER_TIME_GRACE_US 1000
+
 /**
  * Create a packet matcher. The output queue is optional.
  */
 struct dns_worker_packet_matcher *
 dns_worker_packet_matcher_create(struct dns_config *conf, struct dns_frame_queue *in, struct dns_frame_queue *out);
 
+/**
+ * Return the time when the packet leaves the matcher (for time-ordered input):
+ * with `early_release`, for a matched request the response time or `ts + emit_delay`
+ * (whichever is later), `ts + matching_duration` otherwise.
+ */
+dns_us_time_t
+dns_worker_packet_matcher_exit_time(const struct dns_worker_packet_matcher *pm, const struct dns_packet *pkt);
+
 /**
  * Wait for the packet matcher thread to stop.
  */
@@ -0,0 +1,196 @@
+/* 
+ *  Copyright (C) 2016 CZ.NIC, z.s.p.o.
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <inttypes.h>
+#include <assert.h>
+#include <pthread.h>
+
+#include "packet_frame.h"
+#include "frame_queue.h"
+#include "worker_packet_parsers.h"
+#include "packet.h"
+
+/** Argument of a parser thread */
+struct dns_worker_packet_parsers_thread {
+    struct dns_worker_packet_parsers *wp;
+    int index;
+};
+
+struct dns_worker_packet_parsers *
+dns_worker_packet_parsers_create(struct dns_config *conf, struct dns_frame_queue *in, struct dns_frame_queue *out)
+{
+    assert(in && out && conf->input_parse_threads >= 1);
+    struct dns_worker_packet_parsers *wp = xmalloc_zero(sizeof(struct dns_worker_packet_parsers));
+    wp->in = in;
+    wp->out = out;
+    wp->count = conf->input_parse_threads;
+    wp->fields = (conf->output_type == DNS_OUTPUT_TYPE_CBOR) ? conf->cbor_fields : conf->csv_fields;
+    wp->compact_packets = conf->input_compact_packets;
+    pthread_mutex_init(&wp->running, NULL);
+
+    wp->parser_in = xmalloc_zero(wp->count * sizeof(struct dns_frame_queue *));
+    wp->parser_out = xmalloc_zero(wp->count * sizeof(struct dns_frame_queue *));
+    wp->threads = xmalloc_zero(wp->count * sizeof(pthread_t));
+    wp->malformed = xmalloc_zero(wp->count * sizeof(uint64_t));
+    for (int i = 0; i < wp->count; i++) {
+        wp->parser_in[i] = dns_frame_queue_create_spsc(conf->max_queue_len, conf->max_queue_size, DNS_QUEUE_BLOCK);
+        wp->parser_out[i] = dns_frame_queue_create_spsc(conf->max_queue_len, conf->max_queue_size, DNS_QUEUE_BLOCK);
+    }
+    return wp;
+}
+
+void
+dns_worker_packet_parsers_destroy(struct dns_worker_packet_parsers *wp)
+{
+    if (pthread_mutex_trylock(&wp->running) != 0)
+        die("destroying running packet parsers");
+    pthread_mutex_unlock(&wp->running);
+    pthread_mutex_destroy(&wp->running);
+    for (int i = 0; i < wp->count; i++) {
+        dns_frame_queue_destroy(wp->parser_in[i]);
+        dns_frame_queue_destroy(wp->parser_out[i]);
+    }
+    free(wp->parser_in);
+    free(wp->parser_out);
+    free(wp->threads);
+    free(wp->malformed);
+    free(wp);
+}
+
+/**
+ * Hand the input frames to the parsers round-robin. After the final frame,
+ * every other parser gets a final frame of its own to stop it.
+ */
+static void*
+dns_worker_packet_parsers_dispatch_main(void *parsers)
+{
+    struct dns_worker_packet_parsers *wp = parsers;
+    for (int i = 0; ; i = (i + 1) % wp->count) {
+        struct dns_packet_frame *f = dns_frame_queue_dequeue(wp->in);
+        int final = (f->type == 1);
+        dns_us_time_t time = f->time_end;
+        dns_frame_queue_enqueue(wp->parser_in[i], f);
+        if (final) {
+            for (int j = 1; j < wp->count; j++)
+                dns_frame_queue_enqueue(wp->parser_in[(i + j) % wp->count], dns_packet_frame_create_final(time));
+            break;
+        }
+    }
+    return NULL;
+}
+
+/**
+ * Parse the unparsed packets of the frames of one parser in place, until the final frame.
+ */
+static void*
+dns_worker_packet_parsers_parse_main(void *thread)
+{
+    struct dns_worker_packet_parsers_thread *t = thread;
+    struct dns_worker_packet_parsers *wp = t->wp;
+    int i = t->index;
+    free(t);
+    while (1) {
+        struct dns_packet_frame *f = dns_frame_queue_dequeue(wp->parser_in[i]);
+        int final = (f->type == 1);
+        clist parsed;
+        clist_move(&parsed, &f->packets);
+        f->count = 0;
+        f->size = 0;
+        struct dns_packet *pkt;
+        while ((pkt = clist_remove_head(&parsed))) {
+            if (pkt->unparsed && dns_packet_parse(pkt, wp->fields, wp->compact_packets) != DNS_RET_OK) {
+                wp->malformed[i] ++;
+                dns_packet_destroy(pkt);
+                continue;
+            }
+            dns_packet_frame_append_packet(f, pkt);
+        }
+        dns_frame_queue_enqueue(wp->parser_out[i], f);
+        if (final)
+            break;
+    }
+    return NULL;
+}
+
+/**
+ * Collect the parsed frames round-robin in the dispatch order. After the final frame,
+ * drop the final frames of the other parsers.
+ */
+static void*
+dns_worker_packet_parsers_collect_main(void *parsers)
+{
+    struct dns_worker_packet_parsers *wp = parsers;
+    for (int i = 0; ; i = (i + 1) % wp->count) {
+        struct dns_packet_frame *f = dns_frame_queue_dequeue(wp->parser_out[i]);
+        int final = (f->type == 1);
+        dns_frame_queue_enqueue(wp->out, f);
+        if (final) {
+            for (int j = 1; j < wp->count; j++) {
+                f = dns_frame_queue_dequeue(wp->parser_out[(i + j) % wp->count]);
+                assert(f->type == 1);
+                dns_packet_frame_destroy(f);
+            }
+            break;
+        }
+    }
+    return NULL;
+}
+
+void
+dns_worker_packet_parsers_finish(struct dns_worker_packet_parsers *wp)
+{
+    int r = pthread_join(wp->dispatch_thread, NULL);
+    assert(r == 0);
+    for (int i = 0; i < wp->count; i++) {
+        r = pthread_join(wp->threads[i], NULL);
+        assert(r == 0);
+    }
+    r = pthread_join(wp->collect_thread, NULL);
+    assert(r == 0);
+    pthread_mutex_unlock(&wp->running);
+    wp->packets_malformed = 0;
+    for (int i = 0; i < wp->count; i++) {
+        char name[32];
+        snprintf(name, sizeof(name), "parser-%d-in", i);
+        dns_frame_queue_report(wp->parser_in[i], name);
+        wp->packets_malformed += wp->malformed[i];
+    }
+    msg(L_INFO, "Packet parsers dropped %"PRIu64" malformed packets", wp->packets_malformed);
+    msg(L_DEBUG, "Packet parsers stopped and joined");
+}
+
+void
+dns_worker_packet_parsers_start(struct dns_worker_packet_parsers *wp)
+{
+    if (pthread_mutex_trylock(&wp->running) != 0)
+        die("starting running packet parsers");
+    int r = pthread_create(&wp->collect_thread, NULL, dns_worker_packet_parsers_collect_main, wp);
+    assert(r == 0);
+    for (int i = 0; i < wp->count; i++) {
+        struct dns_worker_packet_parsers_thread *t = xmalloc_zero(sizeof(struct dns_worker_packet_parsers_thread));
+        t->wp = wp;
+        t->index = i;
+        r = pthread_create(&wp->threads[i], NULL, dns_worker_packet_parsers_parse_main, t);
+        assert(r == 0);
+    }
+    r = pthread_create(&wp->dispatch_thread, NULL, dns_worker_packet_parsers_dispatch_main, wp);
+    assert(r == 0);
+    msg(L_DEBUG, "Packet parsers started (%d threads)", wp->count);
+}
@@ -0,0 +1,95 @@
+/* 
+ *  Copyright (C) 2016 CZ.NIC, z.s.p.o.
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef DNSCOL_WORKER_PACKET_PARSERS_H
+#define DNSCOL_WORKER_PACKET_PARSERS_H
+
+#include "common.h"
+#include "config.h"
+
+/**
+ * \file worker_packet_parsers.h
+ * DNS parsing of the input frames in several threads.
+ */
+
+struct dns_frame_queue;
+
+/**
+ * A pool of threads parsing the DNS data of the unparsed packets of the input
+ * (see `dns_packet_create_unparsed()`), so the capture thread only decodes the
+ * packet headers and copies the DNS data.
+ *
+ * A dispatcher thread hands the input frames to the parsers round-robin,
+ * every parser parses its frames in place (dropping the malformed packets)
+ * and a collector thread takes the parsed frames round-robin in the same order,
+ * so the output stream has the frames and packets in the input order.
+ */
+struct dns_worker_packet_parsers {
+    /** Input and output queue, not owned. */
+    struct dns_frame_queue *in, *out;
+
+    /** Number of parser threads. */
+    int count;
+
+    /** Output fields and compact packets, as in `struct dns_input` */
+    uint32_t fields;
+    int compact_packets;
+
+    /** Per-parser input and output queues, owned. */
+    struct dns_frame_queue **parser_in, **parser_out;
+
+    /** The parser threads. */
+    pthread_t *threads;
+
+    /** The dispatching and collecting threads. */
+    pthread_t dispatch_thread, collect_thread;
+
+    /** The mutex indicating that the threads are started and running. */
+    pthread_mutex_t running;
+
+    /** Number of packets dropped as malformed by the parsers (updated on finish) */
+    uint64_t packets_malformed;
+
+    /** Per-parser counts of the dropped packets */
+    uint64_t *malformed;
+};
+
+/**
+ * Create a pool of `conf->input_parse_threads` parsers. The output queue is required.
+ */
+struct dns_worker_packet_parsers *
+dns_worker_packet_parsers_create(struct dns_config *conf, struct dns_frame_queue *in, struct dns_frame_queue *out);
+
+/**
+ * Wait for all the threads of the parsers to stop (after the final frame).
+ */
+void
+dns_worker_packet_parsers_finish(struct dns_worker_packet_parsers *wp);
+
+/**
+ * Destroy the parsers struct, the threads must not be running!
+ */
+void
+dns_worker_packet_parsers_destroy(struct dns_worker_packet_parsers *wp);
+
+/**
+ * Start the dispatcher, parser and collector threads. The threads must not be already running!
+ */
+void
+dns_worker_packet_parsers_start(struct dns_worker_packet_parsers *wp);
+
+#endif /* DNSCOL_WORKER_PACKET_PARSERS_H */
@@ -0,0 +1,201 @@
+#!/usr/bin/env python3
+"""
+Writes the small synthetic pcap files of the tests into the given directory
+(Ethernet link type, all DNS messages valid):
+
+  defrag.pcap   IPv4 and IPv6 responses and an IPv4 request split into
+                fragments (the IPv4 ones out of order)
+  tcp.pcap      two requests in one TCP segment, a request spanning two
+                segments, three responses in one segment, and a flow with
+                one message per segment
+  reorder.pcap  a response captured before its request (the request
+                timestamped 50 us earlier) and an in-order pair
+
+The files follow each other in time (one second apart), so they can also be
+read together in this order.
+
+Usage:
+
+    ./make_pcaps.py OUTPUT_DIR
+
+"""
+
+import ipaddress
+import os
+import struct
+import sys
+
+# All the packets are within a few seconds of this time (one output period)
+BASE_TIME = 1500000100
+
+CLIENT4, SERVER4 = '192.0.2.1', '198.51.100.53'
+CLIENT6, SERVER6 = '2001:db8::1', '2001:db8::53'
+
+TYPE_A, TYPE_TXT, TYPE_AAAA, TYPE_OPT = 1, 16, 28, 41
+PROTO_TCP, PROTO_UDP, PROTO_FRAGMENT = 6, 17, 44
+
+
+def addr_bytes(addr):
+    if ':' in addr:
+        return ipaddress.IPv6Address(addr).packed
+    return bytes(int(x) for x in addr.split('.'))
+
+
+def checksum(data):
+    if len(data) % 2:
+        data += b'\0'
+    s = sum(struct.unpack('!%dH' % (len(data) // 2), data))
+    while s >> 16:
+        s = (s & 0xffff) + (s >> 16)
+    return ~s & 0xffff
+
+
+def dname(name):
+    return b''.join(bytes([len(l)]) + l.encode() for l in name.split('.')) + b'\0'
+
+
+def dns_query(id, qtype, padding=None):
+    """A query for example.com, with an OPT RR with a padding option of the given length."""
+    ar = 1 if padding is not None else 0
+    msg = struct.pack('!6H', id, 0x0100, 1, 0, 0, ar) + dname('example.com') + struct.pack('!2H', qtype, 1)
+    if padding is not None:
+        option = struct.pack('!2H', 12, padding) + b'\0' * padding
+        msg += b'\0' + struct.pack('!HHIH', TYPE_OPT, 4096, 0, len(option)) + option
+    return msg
+
+
+def dns_response(id, qtype, txt_strings=0):
+    """A response for example.com, with a TXT answer of the given number of 200 byte strings."""
+    an = 1 if txt_strings else 0
+    msg = struct.pack('!6H', id, 0x8180, 1, an, 0, 0) + dname('example.com') + struct.pack('!2H', qtype, 1)
+    if txt_strings:
+        rdata = (bytes([200]) + b't' * 200) * txt_strings
+        msg += struct.pack('!HHHIH', 0xc00c, TYPE_TXT, 1, 300, len(rdata)) + rdata
+    return msg
+
+
+def pseudo_header(src, dst, proto, length):
+    if len(src) == 4:
+        return src + dst + struct.pack('!BBH', 0, proto, length)
+    return src + dst + struct.pack('!IxxxB', length, proto)
+
+
+def udp(src, dst, sport, dport, payload):
+    hdr = struct.pack('!4H', sport, dport, 8 + len(payload), 0)
+    s = checksum(pseudo_header(addr_bytes(src), addr_bytes(dst), PROTO_UDP, len(hdr) + len(payload)) + hdr + payload)
+    return struct.pack('!4H', sport, dport, 8 + len(payload), s or 0xffff) + payload
+
+
+def tcp(src, dst, sport, dport, seq, payload):
+    hdr = struct.pack('!HHIIBBHHH', sport, dport, seq, 1, 5 << 4, 0x18, 65535, 0, 0)  # PSH, ACK
+    s = checksum(pseudo_header(addr_bytes(src), addr_bytes(dst), PROTO_TCP, len(hdr) + len(payload)) + hdr + payload)
+    return hdr[:16] + struct.pack('!H', s) + hdr[18:] + payload
+
+
+def ipv4(src, dst, proto, payload, ident=1, frag=0x4000):
+    """IPv4 packet, `frag` being the flags and offset field (don't fragment by default)."""
+    hdr = struct.pack('!BBHHHBBH4s4s', 0x45, 0, 20 + len(payload), ident, frag, 64, proto, 0,
+                      addr_bytes(src), addr_bytes(dst))
+    return hdr[:10] + struct.pack('!H', checksum(hdr)) + hdr[12:] + payload
+
+
+def ipv4_fragments(src, dst, proto, payload, size, ident):
+    """IPv4 fragments of the payload with `size` bytes of payload each (a multiple of 8)."""
+    frags = []
+    for offset in range(0, len(payload), size):
+        more = 0x2000 if offset + size < len(payload) else 0
+        frags.append(ipv4(src, dst, proto, payload[offset:offset + size], ident, more | offset // 8))
+    return frags
+
+
+def ipv6(src, dst, next_header, payload):
+    return struct.pack('!IHBB16s16s', 6 << 28, len(payload), next_header, 64,
+                       addr_bytes(src), addr_bytes(dst)) + payload
+
+
+def ipv6_fragments(src, dst, proto, payload, size, ident):
+    """IPv6 packets with a fragment header, `size` bytes of payload each (a multiple of 8)."""
+    frags = []
+    for offset in range(0, len(payload), size):
+        more = 1 if offset + size < len(payload) else 0
+        frag_hdr = struct.pack('!BxHI', proto, offset | more, ident)
+        frags.append(ipv6(src, dst, PROTO_FRAGMENT, frag_hdr + payload[offset:offset + size]))
+    return frags
+
+
+def ether(ip_packet):
+    ethertype = 0x86dd if ip_packet[0] >> 4 == 6 else 0x0800
+    return b'\x02\0\0\0\0\x02' + b'\x02\0\0\0\0\x01' + struct.pack('!H', ethertype) + ip_packet
+
+
+def write_pcap(path, packets):
+    """Write the (time offset in us, IP packet) pairs as Ethernet frames."""
+    with open(path, 'wb') as f:
+        f.write(struct.pack('<IHHiIII', 0xa1b2c3d4, 2, 4, 0, 0, 65535, 1))
+        for offset_us, packet in packets:
+            frame = ether(packet)
+            f.write(struct.pack('<IIII', BASE_TIME + offset_us // 1000000, offset_us % 1000000,
+                                len(frame), len(frame)))
+            f.write(frame)
+
+
+def udp4(client_port, msg, response=False):
+    if response:
+        return ipv4(SERVER4, CLIENT4, PROTO_UDP, udp(SERVER4, CLIENT4, 53, client_port, msg))
+    return ipv4(CLIENT4, SERVER4, PROTO_UDP, udp(CLIENT4, SERVER4, client_port, 53, msg))
+
+
+def tcp_prefixed(*msgs):
+    return b''.join(struct.pack('!H', len(m)) + m for m in msgs)
+
+
+def defrag_packets():
+    big_response = dns_response(1, TYPE_A, txt_strings=5)
+    resp1 = ipv4_fragments(SERVER4, CLIENT4, PROTO_UDP, udp(SERVER4, CLIENT4, 53, 40001, big_response), 1000, 101)
+    resp2 = ipv6_fragments(SERVER6, CLIENT6, PROTO_UDP,
+                           udp(SERVER6, CLIENT6, 53, 40002, dns_response(2, TYPE_AAAA, txt_strings=5)), 1000, 102)
+    big_query = dns_query(3, TYPE_TXT, padding=1360)
+    req3 = ipv4_fragments(CLIENT4, SERVER4, PROTO_UDP, udp(CLIENT4, SERVER4, 40003, 53, big_query), 1000, 103)
+    return [
+        (0, udp4(40001, dns_query(1, TYPE_A))),
+        (1000, resp1[1]),  # The last fragment first
+        (1010, resp1[0]),
+        (2000, ipv6(CLIENT6, SERVER6, PROTO_UDP, udp(CLIENT6, SERVER6, 40002, 53, dns_query(2, TYPE_AAAA)))),
+        (3000, resp2[0]),
+        (3010, resp2[1]),
+        (4000, req3[1]),
+        (4010, req3[0]),
+        (5000, udp4(40003, dns_response(3, TYPE_TXT), response=True)),
+    ]
+
+
+def tcp_packets():
+    q12 = tcp_prefixed(dns_query(12, TYPE_TXT))
+    responses = tcp_prefixed(dns_response(10, TYPE_A), dns_response(11, TYPE_AAAA), dns_response(12, TYPE_TXT))
+    return [
+        (1000000, ipv4(CLIENT4, SERVER4, PROTO_TCP, tcp(CLIENT4, SERVER4, 40010, 53, 1000,
+                                                       tcp_prefixed(dns_query(10, TYPE_A), dns_query(11, TYPE_AAAA))))),
+        (1001000, ipv4(CLIENT4, SERVER4, PROTO_TCP, tcp(CLIENT4, SERVER4, 40010, 53, 1062, q12[:10]))),
+        (1002000, ipv4(CLIENT4, SERVER4, PROTO_TCP, tcp(CLIENT4, SERVER4, 40010, 53, 1072, q12[10:]))),
+        (1003000, ipv4(SERVER4, CLIENT4, PROTO_TCP, tcp(SERVER4, CLIENT4, 53, 40010, 5000, responses))),
+        (1004000, ipv6(CLIENT6, SERVER6, PROTO_TCP, tcp(CLIENT6, SERVER6, 40011, 53, 7000,
+                                                       tcp_prefixed(dns_query(13, TYPE_A))))),
+        (1005000, ipv6(SERVER6, CLIENT6, PROTO_TCP, tcp(SERVER6, CLIENT6, 53, 40011, 9000,
+                                                       tcp_prefixed(dns_response(13, TYPE_A))))),
+    ]
+
+
+def reorder_packets():
+    return [
+        (2000150, udp4(40020, dns_response(20, TYPE_A), response=True)),
+        (2000100, udp4(40020, dns_query(20, TYPE_A))),
+        (2001000, udp4(40021, dns_query(21, TYPE_A))),
+        (2001500, udp4(40021, dns_response(21, TYPE_A), response=True)),
+    ]
+
+
+if __name__ == '__main__':
+    if len(sys.argv) != 2:
+        sys.exit(__doc__)
+    for name, packets in [('defrag', defrag_packets()), ('tcp', tcp_packets()), ('reorder', reorder_packets())]:
+        write_pcap(os.path.join(sys.argv[1], name + '.pcap'), packets)
@@ -0,0 +1,58 @@
+#!/usr/bin/env python3
+"""
+Sends the frames of the given pcap files (Ethernet link type, as written by
+make_pcaps.py) on a network interface, keeping the time gaps between them,
+for testing the live capture. Needs CAP_NET_RAW.
+
+With --check, only checks that the frames can be sent: exits with 0 when they
+can and with 77 otherwise.
+
+Usage:
+
+    ./replay_pcap.py [--check] INTERFACE [PCAP...]
+
+"""
+
+import socket
+import struct
+import sys
+import time
+
+
+def read_pcap(path):
+    """Yield the (time in us, frame) pairs of a little-endian microsecond pcap file."""
+    with open(path, 'rb') as f:
+        magic, _, _, _, _, _, linktype = struct.unpack('<IHHiIII', f.read(24))
+        if magic != 0xa1b2c3d4 or linktype != 1:
+            sys.exit('%s: only little-endian Ethernet pcap files are supported' % path)
+        while True:
+            header = f.read(16)
+            if len(header) < 16:
+                return
+            sec, usec, incl_len, _ = struct.unpack('<IIII', header)
+            yield sec * 1000000 + usec, f.read(incl_len)
+
+
+if __name__ == '__main__':
+    args = sys.argv[1:]
+    check = args[:1] == ['--check']
+    if check:
+        args = args[1:]
+    if len(args) < 1:
+        sys.exit(__doc__)
+    try:
+        sock = socket.socket(socket.AF_PACKET, socket.SOCK_RAW)
+        sock.bind((args[0], 0))
+    except (PermissionError, AttributeError) as e:
+        if check:
+            sys.exit(77)
+        sys.exit('Can not send on %s: %s' % (args[0], e))
+    if check:
+        sys.exit(0)
+    last = None
+    for path in args[1:]:
+        for ts, frame in read_pcap(path):
+            if last is not None and ts > last:
+                time.sleep((ts - last) / 1e6)
+            last = ts
+            sock.send(frame)